@@ -0,0 +1,198 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Packet authentication.
+
+#include "auth.h"
+
+#include <string.h>
+
+#define SHA256_BLOCK_LEN 64
+#define SHA256_LEN 32
+#define HMAC_IPAD 0x36
+#define HMAC_OPAD 0x5C
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t sha256_init[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+// A key in use, with its replay window: the highest counter seen, and a bit
+// for each of the AUTH_WINDOW counters up to it, set once seen
+struct auth_slot {
+    struct auth_key key;
+    uint64_t highest;
+    uint64_t seen;
+};
+
+static struct auth_slot slots[AUTH_MAX_KEYS];
+static unsigned int slot_count;
+
+static inline uint32_t rotr(uint32_t x, unsigned int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+// Hash one 64-byte block into the state
+static void sha256Block(uint32_t h[8], const uint8_t *block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t) block[4 * i] << 24) | ((uint32_t) block[4 * i + 1] << 16)
+                | ((uint32_t) block[4 * i + 2] << 8) | (uint32_t) block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = k + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += k;
+}
+
+// Finish a hash from a state that has already taken in prefix_len bytes, a
+// whole number of blocks, by hashing len more bytes and the padding
+static void sha256Finish(const uint32_t start[8], size_t prefix_len, const uint8_t *data, size_t len,
+        uint8_t out[SHA256_LEN]) {
+    uint32_t h[8];
+    memcpy(h, start, sizeof(h));
+    uint64_t bits = (uint64_t) (prefix_len + len) * 8;
+    while (len >= SHA256_BLOCK_LEN) {
+        sha256Block(h, data);
+        data += SHA256_BLOCK_LEN;
+        len -= SHA256_BLOCK_LEN;
+    }
+    uint8_t block[2 * SHA256_BLOCK_LEN];
+    memset(block, 0, sizeof(block));
+    memcpy(block, data, len);
+    block[len] = 0x80;
+    size_t total = (len + 9 <= SHA256_BLOCK_LEN) ? SHA256_BLOCK_LEN : 2 * SHA256_BLOCK_LEN;
+    for (int i = 0; i < 8; i++) {
+        block[total - 1 - i] = (uint8_t) (bits >> (8 * i));
+    }
+    sha256Block(h, block);
+    if (total > SHA256_BLOCK_LEN) sha256Block(h, block + SHA256_BLOCK_LEN);
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = (uint8_t) (h[i] >> 24);
+        out[4 * i + 1] = (uint8_t) (h[i] >> 16);
+        out[4 * i + 2] = (uint8_t) (h[i] >> 8);
+        out[4 * i + 3] = (uint8_t) h[i];
+    }
+}
+
+// HMAC-SHA256, starting from the key's prepared pads
+static void hmac(const struct auth_key *key, const uint8_t *data, size_t len, uint8_t out[SHA256_LEN]) {
+    uint8_t inner[SHA256_LEN];
+    sha256Finish(key->inner, SHA256_BLOCK_LEN, data, len, inner);
+    sha256Finish(key->outer, SHA256_BLOCK_LEN, inner, sizeof(inner), out);
+}
+
+// Compare two tags in a time that does not depend on where they differ
+static bool tagsEqual(const uint8_t *a, const uint8_t *b) {
+    uint8_t diff = 0;
+    for (int i = 0; i < AUTH_TAG_LEN; i++) {
+        diff |= a[i] ^ b[i];
+    }
+    return diff == 0;
+}
+
+void authPrepare(const struct auth_key_config *config, struct auth_key *key) {
+    uint8_t pad[SHA256_BLOCK_LEN];
+    key->id = config->id;
+    memcpy(key->inner, sha256_init, sizeof(key->inner));
+    memcpy(key->outer, sha256_init, sizeof(key->outer));
+    for (int i = 0; i < SHA256_BLOCK_LEN; i++) {
+        pad[i] = (uint8_t) (((i < config->len) ? config->key[i] : 0) ^ HMAC_IPAD);
+    }
+    sha256Block(key->inner, pad);
+    for (int i = 0; i < SHA256_BLOCK_LEN; i++) {
+        pad[i] = (uint8_t) (((i < config->len) ? config->key[i] : 0) ^ HMAC_OPAD);
+    }
+    sha256Block(key->outer, pad);
+}
+
+size_t authWrap(const struct auth_key *key, uint64_t counter, const uint8_t *packet, size_t len, uint8_t *buf,
+        size_t buf_len) {
+    size_t total = AUTH_LEN(len);
+    if (buf_len < total) return 0;
+    buf[0] = AUTH_MAGIC;
+    buf[1] = key->id;
+    for (int i = 0; i < 8; i++) {
+        buf[2 + i] = (uint8_t) (counter >> (8 * i));
+    }
+    memmove(buf + AUTH_HEADER_LEN, packet, len);
+    uint8_t tag[SHA256_LEN];
+    hmac(key, buf, AUTH_HEADER_LEN + len, tag);
+    memcpy(buf + AUTH_HEADER_LEN + len, tag, AUTH_TAG_LEN);
+    return total;
+}
+
+void authInit(const struct auth_key_config *keys, unsigned int count) {
+    slot_count = (count > AUTH_MAX_KEYS) ? AUTH_MAX_KEYS : count;
+    for (unsigned int i = 0; i < slot_count; i++) {
+        authPrepare(&keys[i], &slots[i].key);
+        // Counter 0 counts as seen, so that senders start from 1
+        slots[i].highest = 0;
+        slots[i].seen = 1;
+    }
+}
+
+enum packet_status authVerify(const uint8_t *buf, size_t len, const uint8_t **body, size_t *body_len) {
+    if (len == 0 || buf[0] != AUTH_MAGIC) return PACKET_ERR_UNAUTHENTICATED;
+    if (len < AUTH_LEN(1)) return PACKET_ERR_SYNTAX;
+    struct auth_slot *slot = NULL;
+    for (unsigned int i = 0; i < slot_count && slot == NULL; i++) {
+        if (slots[i].key.id == buf[1]) slot = &slots[i];
+    }
+    if (slot == NULL) return PACKET_ERR_AUTH;
+
+    uint64_t counter = 0;
+    for (int i = 7; i >= 0; i--) {
+        counter = (counter << 8) | buf[2 + i];
+    }
+    if (counter <= slot->highest) {
+        uint64_t behind = slot->highest - counter;
+        if (behind >= AUTH_WINDOW || (slot->seen & (1ULL << behind))) return PACKET_ERR_REPLAYED;
+    }
+
+    uint8_t tag[SHA256_LEN];
+    hmac(&slot->key, buf, len - AUTH_TAG_LEN, tag);
+    if (!tagsEqual(tag, buf + len - AUTH_TAG_LEN)) return PACKET_ERR_AUTH;
+
+    // Only a genuine packet moves the window
+    if (counter > slot->highest) {
+        uint64_t ahead = counter - slot->highest;
+        slot->seen = (ahead >= AUTH_WINDOW) ? 1 : (slot->seen << ahead) | 1;
+        slot->highest = counter;
+    } else {
+        slot->seen |= 1ULL << (slot->highest - counter);
+    }
+    *body = buf + AUTH_HEADER_LEN;
+    *body_len = len - AUTH_HEADER_LEN - AUTH_TAG_LEN;
+    return PACKET_OK;
+}
@@ -0,0 +1,78 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Packet authentication.
+//
+// With keys configured, a demand packet can be wrapped in an authenticated
+// envelope, and with auth_required set, nothing else is accepted:
+//   0     magic (AUTH_MAGIC)
+//   1     key ID
+//   2-9   64-bit counter, little-endian, higher for every packet sent
+//         under the key
+//   10-   the demand packet itself, ASCII or binary
+//   last  AUTH_TAG_LEN bytes: the start of HMAC-SHA256 over all preceding
+//         bytes with the key
+// The counter protects against replays. Each key keeps the highest counter
+// seen and a window of AUTH_WINDOW counters behind it, and a counter already
+// seen, or older than the window, is rejected. A sender should start its
+// counter from the time, e.g. in microseconds since the epoch, so that it
+// never goes backwards across a restart, and each controller should have
+// its own key.
+//
+// Envelopes are checked in the comms thread before the parse, so nothing
+// unauthenticated is ever parsed. Each key's inner and outer HMAC pads are
+// hashed once at startup, which leaves two SHA-256 blocks to hash for a
+// packet of up to 45 bytes and three for anything longer, and the tag is
+// compared in constant time. The counter is
+// checked before the tag, so a flood of replayed packets costs no hashing.
+
+#ifndef AUTH_H
+#define AUTH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "packet.h"
+
+#define AUTH_MAGIC 0xA7
+#define AUTH_HEADER_LEN 10
+#define AUTH_TAG_LEN 16
+#define AUTH_LEN(packet_len) ((size_t) (AUTH_HEADER_LEN + (packet_len) + AUTH_TAG_LEN))
+#define AUTH_WINDOW 64
+// Most keys, and the key length limits in bytes
+#define AUTH_MAX_KEYS 8
+#define AUTH_KEY_MIN_LEN 16
+#define AUTH_KEY_MAX_LEN 64
+
+// A key as configured
+struct auth_key_config {
+    uint8_t id;
+    uint8_t len;
+    uint8_t key[AUTH_KEY_MAX_LEN];
+};
+
+// A key ready for use: the SHA-256 states after its inner and outer pads
+struct auth_key {
+    uint8_t id;
+    uint32_t inner[8];
+    uint32_t outer[8];
+};
+
+// Work out a key's pads
+void authPrepare(const struct auth_key_config *config, struct auth_key *key);
+
+// Wrap a packet in an envelope under a key, for senders. Returns the
+// number of bytes written, or 0 if buf is too small.
+size_t authWrap(const struct auth_key *key, uint64_t counter, const uint8_t *packet, size_t len, uint8_t *buf,
+        size_t buf_len);
+
+// Set up the keys that envelopes are checked against, each with an empty
+// replay window
+void authInit(const struct auth_key_config *keys, unsigned int count);
+
+// Check an envelope and record its counter. On PACKET_OK, *body and
+// *body_len give the packet inside. Returns PACKET_ERR_UNAUTHENTICATED if
+// buf is not an envelope at all, PACKET_ERR_AUTH for an unknown key or a
+// wrong tag, and PACKET_ERR_REPLAYED for a counter already used. Only
+// called from the comms thread.
+enum packet_status authVerify(const uint8_t *buf, size_t len, const uint8_t **body, size_t *body_len);
+
+#endif // AUTH_H
@@ -0,0 +1,127 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Battery and DC jack voltage monitoring.
+
+#define _GNU_SOURCE
+#include "battery.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "config.h"
+#include "hal.h"
+#include "log.h"
+#include "metrics.h"
+
+// Scheduling priority of the sampling thread, well below the control path
+#define BATTERY_THREAD_NICE 10
+
+static _Atomic uint32_t battery_mv;
+static _Atomic uint32_t jack_mv;
+static _Atomic uint32_t raw_mv;
+static _Atomic uint32_t samples;
+static atomic_bool low;
+static atomic_bool sampling;
+static pthread_t sample_thread;
+
+static void *sampleThread(__attribute__ ((unused)) void *arg) {
+    setpriority(PRIO_PROCESS, (id_t) gettid(), BATTERY_THREAD_NICE);
+    double battery = 0.0, jack = 0.0;
+    bool first = true;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (atomic_load(&sampling)) {
+        const struct config_snapshot *config = configAcquire(CONFIG_READER_BATTERY);
+        unsigned int period_ms = 1000 / config->battery_sample_hz;
+        double filter_ms = config->battery_filter_ms;
+        uint32_t low_mv = config->battery_low_mv;
+        uint32_t high_mv = low_mv + config->battery_hysteresis_mv;
+        configRelease(CONFIG_READER_BATTERY);
+
+        double raw_battery = halBatteryVolts();
+        double raw_jack = halJackVolts();
+        atomic_store(&raw_mv, (raw_battery > 0.0) ? (uint32_t) lround(raw_battery * 1000.0) : 0);
+        atomic_fetch_add(&samples, 1);
+
+        // First-order low pass, seeded with the first sample
+        if (first) {
+            battery = raw_battery;
+            jack = raw_jack;
+            first = false;
+        } else {
+            double alpha = period_ms / (filter_ms + period_ms);
+            battery += alpha * (raw_battery - battery);
+            jack += alpha * (raw_jack - jack);
+        }
+        uint32_t mv = (battery > 0.0) ? (uint32_t) lround(battery * 1000.0) : 0;
+        atomic_store(&battery_mv, mv);
+        atomic_store(&jack_mv, (jack > 0.0) ? (uint32_t) lround(jack * 1000.0) : 0);
+        metricSet(METRICS_BATTERY, METRIC_BATTERY_MV, mv);
+        metricSet(METRICS_BATTERY, METRIC_JACK_MV, atomic_load(&jack_mv));
+
+        // Low battery, with hysteresis so that it does not flicker as the
+        // voltage sags and recovers under load
+        bool was_low = atomic_load(&low);
+        bool is_low = (low_mv > 0) && (was_low ? mv < high_mv : mv < low_mv);
+        if (is_low != was_low) {
+            if (is_low) {
+                logWarning("Battery low at %.2f V", mv / 1000.0);
+            } else {
+                logInfo("Battery recovered to %.2f V", mv / 1000.0);
+            }
+            atomic_store(&low, is_low);
+            metricSet(METRICS_BATTERY, METRIC_BATTERY_LOW, is_low);
+        }
+
+        next.tv_nsec += (long) period_ms * 1000000L;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    return NULL;
+}
+
+int batteryStart(void) {
+    if (halAdcInit()) {
+        logError("ERROR: failed to initialise the ADC");
+        return -1;
+    }
+    atomic_store(&sampling, true);
+    if (pthread_create(&sample_thread, NULL, sampleThread, NULL)) {
+        atomic_store(&sampling, false);
+        halAdcCleanup();
+        return -1;
+    }
+    return 0;
+}
+
+void batteryStop(void) {
+    if (!atomic_load(&sampling)) return;
+    atomic_store(&sampling, false);
+    pthread_join(sample_thread, NULL);
+    halAdcCleanup();
+}
+
+uint32_t batteryMillivolts(void) {
+    return atomic_load(&battery_mv);
+}
+
+uint32_t batteryJackMillivolts(void) {
+    return atomic_load(&jack_mv);
+}
+
+uint32_t batteryRawMillivolts(void) {
+    return atomic_load(&raw_mv);
+}
+
+uint32_t batterySamples(void) {
+    return atomic_load(&samples);
+}
+
+bool batteryLow(void) {
+    return atomic_load(&low);
+}
@@ -0,0 +1,39 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Battery and DC jack voltage monitoring.
+//
+// A low-priority thread samples the battery and DC jack voltages through
+// the ADC at the configured rate, smooths them with a first-order filter
+// and publishes them as atomics, so any thread can read the latest values
+// without locking or touching the ADC itself. The servo loop only ever
+// reads the published low-battery flag, so sampling never disturbs its
+// timing.
+
+#ifndef BATTERY_H
+#define BATTERY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Start the ADC and the sampling thread. Returns 0 on success.
+int batteryStart(void);
+
+// Stop the sampling thread and release the ADC
+void batteryStop(void);
+
+// Latest filtered battery and DC jack voltages in millivolts, or 0 before
+// the first sample
+uint32_t batteryMillivolts(void);
+uint32_t batteryJackMillivolts(void);
+
+// Latest unfiltered battery voltage in millivolts, or 0 before the first
+// sample, for noticing the battery being connected as soon as possible
+uint32_t batteryRawMillivolts(void);
+
+// Number of samples taken since batteryStart, so that a reading of 0 can be
+// told apart from no reading yet
+uint32_t batterySamples(void);
+
+// Whether the filtered battery voltage is below the configured low level
+bool batteryLow(void);
+
+#endif // BATTERY_H
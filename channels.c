@@ -0,0 +1,132 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Servo channel table.
+
+#include "channels.h"
+
+#include <math.h>
+#include "log.h"
+
+// Longest interval the rate limit is applied over, which keeps the
+// arithmetic in channelSlew() within 32 bits
+#define SLEW_MAX_ELAPSED_US 50000
+
+// Apply a channel's deadband and expo curve to a demand x, normalised to
+// the range -1 to 1. Only used while building lookup tables.
+static double applyCurve(const struct channel_config *c, double x) {
+    double deadband = c->deadband / (double) DEMAND_FULL_SCALE;
+    double expo = c->expo / (double) DEMAND_FULL_SCALE;
+    double magnitude = fabs(x);
+    if (magnitude <= deadband) return 0.0;
+    magnitude = (magnitude - deadband) / (1.0 - deadband);
+    magnitude = (1.0 - expo) * magnitude + expo * magnitude * magnitude * magnitude;
+    return (x < 0) ? -magnitude : magnitude;
+}
+
+// Exact pulse length in microseconds for a normalised demand x. Only used
+// while building lookup tables.
+static double curvePulse(const struct channel_config *c, double x) {
+    if (c->bipolar) {
+        if (c->inverted) x = -x;
+        x = applyCurve(c, x);
+        double half_range = (x >= 0) ? (c->max_us - c->centre_us) : (c->centre_us - c->min_us);
+        return c->centre_us + x * half_range;
+    } else {
+        x = applyCurve(c, x);
+        if (c->inverted) x = 1.0 - x;
+        return c->min_us + x * (c->max_us - c->min_us);
+    }
+}
+
+int channelTableInit(struct channel_table *table, const struct channel_config *configs, unsigned int count) {
+    if (count > CHANNEL_MAX) {
+        logError("too many channels: %u, maximum is %d", count, CHANNEL_MAX);
+        return -1;
+    }
+
+    table->count = 0;
+    table->bipolar = 0;
+    table->inverted = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        const struct channel_config *c = &configs[i];
+        if (c->max_us > CHANNEL_MAX_PULSE_US || c->centre_us > CHANNEL_MAX_PULSE_US) {
+            logError("channel %u pulse lengths must be at most %d us", i, CHANNEL_MAX_PULSE_US);
+            return -1;
+        }
+        if (c->servo > 8 || c->min_us <= 0 || c->min_us >= c->max_us
+                || (c->bipolar && (c->centre_us <= c->min_us || c->centre_us >= c->max_us))
+                || c->expo > DEMAND_FULL_SCALE || c->deadband >= DEMAND_FULL_SCALE
+                || c->interpolation > INTERPOLATE_EXTRAPOLATE || c->low_battery_limit > DEMAND_FULL_SCALE) {
+            logError("invalid configuration for channel %u", i);
+            return -1;
+        }
+        table->servo[i] = c->servo;
+        table->min_us[i] = c->min_us;
+        table->max_us[i] = c->max_us;
+        table->centre_us[i] = c->centre_us;
+        table->rate_limit[i] = c->rate_limit;
+        table->failsafe_hold_ms[i] = c->failsafe_hold_ms;
+        table->failsafe_ramp_ms[i] = c->failsafe_ramp_ms;
+        table->interpolation[i] = (uint8_t) c->interpolation;
+        table->refresh_divider[i] = (c->refresh_divider > 1) ? c->refresh_divider : 1;
+        table->low_battery_limit[i] = c->low_battery_limit;
+        if (c->bipolar) table->bipolar |= (uint8_t) (1 << i);
+        if (c->inverted) table->inverted |= (uint8_t) (1 << i);
+
+        // Sample the curve across the channel's demand range
+        double lowest = c->bipolar ? -1.0 : 0.0;
+        for (int j = 0; j <= CHANNEL_LUT_SEGMENTS; j++) {
+            double x = lowest + (1.0 - lowest) * j / CHANNEL_LUT_SEGMENTS;
+            double pulse = curvePulse(c, x) * (1 << CHANNEL_LUT_FRAC_BITS);
+            table->lut[i][j] = (uint16_t) lround(pulse);
+        }
+    }
+    table->count = (uint8_t) count;
+    return 0;
+}
+
+int channelSafePulse(const struct channel_table *table, unsigned int ch) {
+    if (table->bipolar & (1 << ch)) return table->centre_us[ch];
+    return (table->inverted & (1 << ch)) ? table->max_us[ch] : table->min_us[ch];
+}
+
+int channelPulse(const struct channel_table *table, unsigned int ch, int32_t demand, bool *out_of_range) {
+    bool bipolar = table->bipolar & (1 << ch);
+    int32_t lowest = channelLowestDemand(table, ch);
+    if (demand < lowest || demand > DEMAND_FULL_SCALE) {
+        if (out_of_range != NULL) *out_of_range = true;
+        return channelSafePulse(table, ch);
+    }
+
+    // Position within the lookup table, as a segment index plus a fraction
+    // of a segment with CHANNEL_LUT_SHIFT bits
+    uint32_t span = bipolar ? 2 * DEMAND_FULL_SCALE : DEMAND_FULL_SCALE;
+    uint32_t position = ((uint32_t) (demand - lowest) << (2 * CHANNEL_LUT_SHIFT)) / span;
+    uint32_t index = position >> CHANNEL_LUT_SHIFT;
+    uint32_t frac = position & ((1 << CHANNEL_LUT_SHIFT) - 1);
+    const uint16_t *lut = table->lut[ch];
+    int32_t pulse = lut[index];
+    if (index < CHANNEL_LUT_SEGMENTS) {
+        pulse += ((int32_t) (lut[index + 1] - lut[index]) * (int32_t) frac) >> CHANNEL_LUT_SHIFT;
+    }
+    return (pulse + (1 << (CHANNEL_LUT_FRAC_BITS - 1))) >> CHANNEL_LUT_FRAC_BITS;
+}
+
+int32_t channelFailsafe(const struct channel_table *table, unsigned int ch, int32_t demand, uint32_t age_ms, bool *in_failsafe) {
+    uint32_t hold = table->failsafe_hold_ms[ch];
+    if (hold == 0 || age_ms < hold) return demand;
+    *in_failsafe = true;
+    uint32_t ramp = table->failsafe_ramp_ms[ch];
+    uint32_t into_ramp = age_ms - hold;
+    if (into_ramp >= ramp) return 0;
+    return (int32_t) ((int64_t) demand * (ramp - into_ramp) / ramp);
+}
+
+int channelSlew(const struct channel_table *table, unsigned int ch, int current, int target, uint32_t elapsed_us) {
+    if (table->rate_limit[ch] == 0) return target;
+    if (elapsed_us > SLEW_MAX_ELAPSED_US) elapsed_us = SLEW_MAX_ELAPSED_US;
+    int max_step = (int) (table->rate_limit[ch] * elapsed_us / 1000000);
+    if (max_step < 1) max_step = 1;
+    if (target > current + max_step) return current + max_step;
+    if (target < current - max_step) return current - max_step;
+    return target;
+}
@@ -0,0 +1,154 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Servo channel table.
+//
+// Each channel maps one demand value from a packet onto one servo output.
+// Channels are described with a struct channel_config each, then packed
+// into a struct channel_table, which keeps each property in its own small
+// array so that the servo loop can walk every channel in a single pass with
+// as little memory traffic as possible.
+//
+// The whole demand to pulse length mapping, including inversion and any
+// expo or deadband curve, is worked out once when the table is built and
+// stored as a lookup table per channel. At runtime a pulse length costs a
+// table lookup and an integer interpolation, however complex the curve.
+
+#ifndef CHANNELS_H
+#define CHANNELS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "demand.h"
+
+// Largest number of channels. The Beaglebone Blue has 8 servo outputs.
+#define CHANNEL_MAX DEMAND_CHANNELS
+
+// Number of segments in each channel's lookup table, which must be a power
+// of two, and the fixed-point scale of the pulse lengths stored in it.
+#define CHANNEL_LUT_SEGMENTS 256
+#define CHANNEL_LUT_SHIFT 8
+#define CHANNEL_LUT_FRAC_BITS 4
+
+// Longest pulse length a channel can use, in microseconds. Well beyond any
+// real servo or ESC, and short enough to fit the lookup table's 16 bits,
+// which hold up to UINT16_MAX >> CHANNEL_LUT_FRAC_BITS microseconds.
+#define CHANNEL_MAX_PULSE_US 3000
+_Static_assert((CHANNEL_MAX_PULSE_US << CHANNEL_LUT_FRAC_BITS) <= UINT16_MAX, "pulse lengths must fit the lookup table");
+
+// How a channel's demand moves between updates from the controller. See
+// interpolate.h.
+enum interpolation {
+    INTERPOLATE_NONE,
+    INTERPOLATE_LINEAR,
+    INTERPOLATE_CUBIC,
+    INTERPOLATE_EXTRAPOLATE
+};
+
+// Description of a single channel
+struct channel_config {
+    // Servo output, numbered 1-8 as on the board. 0 drives every output.
+    uint8_t servo;
+    // Pulse lengths in microseconds at minimum, maximum and centre demand
+    int16_t min_us;
+    int16_t max_us;
+    int16_t centre_us;
+    // Bipolar channels (e.g. rudder) take demands from -100% to 100% either
+    // side of the centre pulse length. Other channels (e.g. throttle) take
+    // demands from 0% to 100%, starting at the minimum pulse length.
+    bool bipolar;
+    // Reverse the direction of the channel
+    bool inverted;
+    // Maximum rate of change of pulse length in microseconds per second, or
+    // 0 for no limit
+    uint16_t rate_limit;
+    // Expo curve, in units of 1/DEMAND_SCALE percent. 0 is linear; higher
+    // values soften the response around zero demand, as on an RC transmitter.
+    uint16_t expo;
+    // Deadband around zero demand, in units of 1/DEMAND_SCALE percent.
+    // Demands inside it give zero output, and the rest of the range is
+    // stretched to fill the gap.
+    uint16_t deadband;
+    // Failsafe when the link is lost. Once no valid demand has arrived for
+    // failsafe_hold_ms, the channel moves from its last demand to zero
+    // demand over failsafe_ramp_ms (0 to go straight there). A hold of 0
+    // disables the failsafe for the channel, leaving it at its last demand.
+    uint16_t failsafe_hold_ms;
+    uint16_t failsafe_ramp_ms;
+    // Smoothing between demand updates, run at the servo refresh rate
+    enum interpolation interpolation;
+    // Refresh the channel on every Nth servo tick, so that analogue servos
+    // can stay at 50 Hz while digital servos and ESCs on other channels run
+    // at a high servo rate. 0 and 1 both mean every tick. New demands sent
+    // immediately go out on every channel regardless.
+    uint8_t refresh_divider;
+    // Most demand allowed either way while the battery is low, in units of
+    // 1/DEMAND_SCALE percent, or 0 for no limit
+    uint16_t low_battery_limit;
+    // Weighted sum of the packet's values to take instead of the value of
+    // the same number, with a weight for each of the first mix_count values
+    // in units of 1/DEMAND_SCALE percent, or none if mix_count is 0. See
+    // mixer.h.
+    uint8_t mix_count;
+    int16_t mix[CHANNEL_MAX];
+};
+
+// Packed table of all active channels
+struct channel_table {
+    uint8_t count;
+    uint8_t servo[CHANNEL_MAX];
+    int16_t min_us[CHANNEL_MAX];
+    int16_t max_us[CHANNEL_MAX];
+    int16_t centre_us[CHANNEL_MAX];
+    uint16_t rate_limit[CHANNEL_MAX];
+    uint16_t failsafe_hold_ms[CHANNEL_MAX];
+    uint16_t failsafe_ramp_ms[CHANNEL_MAX];
+    uint8_t interpolation[CHANNEL_MAX];
+    uint8_t refresh_divider[CHANNEL_MAX];
+    uint16_t low_battery_limit[CHANNEL_MAX];
+    // Per-channel flags, one bit per channel
+    uint8_t bipolar;
+    uint8_t inverted;
+    // Demand to pulse length lookup tables, in units of
+    // 1/(1 << CHANNEL_LUT_FRAC_BITS) microseconds. Entry 0 is the lowest
+    // demand the channel accepts (0 or -100%) and the last entry is 100%.
+    uint16_t lut[CHANNEL_MAX][CHANNEL_LUT_SEGMENTS + 1];
+};
+
+// Build a channel table from count channel descriptions. Returns -1 if
+// there are too many channels or a description is inconsistent, including
+// any pulse length over CHANNEL_MAX_PULSE_US.
+int channelTableInit(struct channel_table *table, const struct channel_config *configs, unsigned int count);
+
+// Pulse length to send when a channel has no demand, the pulse for zero
+// demand: minimum for unipolar channels, or maximum if they are inverted,
+// and centre for bipolar ones
+int channelSafePulse(const struct channel_table *table, unsigned int ch);
+
+// Pulse length for a demand on a channel. Demands outside the channel's
+// range give the safe pulse length, and set *out_of_range if it is not NULL.
+int channelPulse(const struct channel_table *table, unsigned int ch, int32_t demand, bool *out_of_range);
+
+// Demand to apply to a channel when the latest valid demand is age_ms old,
+// following the channel's failsafe stages: the demand itself while it is
+// held, then ramping down to zero. Sets *in_failsafe once the hold is over.
+int32_t channelFailsafe(const struct channel_table *table, unsigned int ch, int32_t demand, uint32_t age_ms, bool *in_failsafe);
+
+// Lowest demand a channel accepts: 0 for unipolar channels, -100% for
+// bipolar ones
+static inline int32_t channelLowestDemand(const struct channel_table *table, unsigned int ch) {
+    return (table->bipolar & (1 << ch)) ? -DEMAND_FULL_SCALE : 0;
+}
+
+// Demand limited to the channel's low battery limit, if it has one
+static inline int32_t channelLowBattery(const struct channel_table *table, unsigned int ch, int32_t demand) {
+    int32_t limit = table->low_battery_limit[ch];
+    if (limit == 0) return demand;
+    if (demand > limit) return limit;
+    if (demand < -limit) return -limit;
+    return demand;
+}
+
+// Move a pulse length from current towards target, limited by the channel's
+// rate limit over elapsed_us microseconds
+int channelSlew(const struct channel_table *table, unsigned int ch, int current, int target, uint32_t elapsed_us);
+
+#endif // CHANNELS_H
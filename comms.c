@@ -0,0 +1,734 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Comms reactor.
+
+#define _GNU_SOURCE
+#include "comms.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include "auth.h"
+#include "battery.h"
+#include "controller.h"
+#include "health.h"
+#include "local.h"
+#include "metrics.h"
+#include "packet.h"
+#include "realtime.h"
+#include "recorder.h"
+#include "sources.h"
+#include "config.h"
+#include "log.h"
+
+// Number of packets read from a socket per recvmmsg() call
+#define COMMS_BATCH_SIZE 16
+// Largest packet read from a socket, enough for the longest ASCII packet in
+// an authenticated envelope. Anything longer is discarded.
+#define COMMS_MAX_PACKET_LEN 128
+// Most telemetry messages sent per round, in one sendmmsg() call per socket.
+// Acks beyond this are dropped.
+#define COMMS_SEND_BATCH 32
+
+// epoll tags for the reactor's event sources. Sockets are tagged with their
+// index into the sockets array.
+#define EVENT_SIGNAL 1000
+#define EVENT_FAILOVER 1001
+#define EVENT_TELEMETRY 1002
+#define EVENT_LOCAL 1003
+#define EVENT_HEALTH 1004
+
+static const struct comms_config *config;
+static int sockets[COMMS_MAX_LISTEN];
+static unsigned int socket_count;
+static int epoll_fd = -1;
+static int signal_fd = -1;
+static int failover_fd = -1;
+static int telemetry_fd = -1;
+// Source address standing for the shared memory block
+static struct sockaddr_storage local_address;
+
+// Receive buffers, shared by all sockets since they are drained one at a time
+static uint8_t buffers[COMMS_BATCH_SIZE][COMMS_MAX_PACKET_LEN];
+static struct sockaddr_storage senders[COMMS_BATCH_SIZE];
+static struct iovec iovecs[COMMS_BATCH_SIZE];
+static struct mmsghdr msgs[COMMS_BATCH_SIZE];
+static char controls[COMMS_BATCH_SIZE][CMSG_SPACE(sizeof(struct timespec))];
+
+// Packet ingest state, only used by the comms thread
+static uint32_t local_sequence;
+
+// Telemetry settings from the current config snapshot, acks waiting to be
+// sent this round, and the batch of outgoing messages
+struct pending_ack {
+    int source;
+    uint32_t sequence;
+    uint32_t sender_time_us;
+    uint64_t arrival_ns;
+};
+static unsigned int telemetry_hz;
+static bool telemetry_acks;
+static bool auth_required;
+static struct pending_ack acks[COMMS_SEND_BATCH];
+static unsigned int ack_count;
+static uint8_t out_buffers[COMMS_SEND_BATCH][COMMS_MAX_PACKET_LEN];
+static struct iovec out_iovecs[COMMS_SEND_BATCH];
+static struct mmsghdr out_msgs[COMMS_SEND_BATCH];
+static unsigned int out_links[COMMS_SEND_BATCH];
+static unsigned int out_count;
+
+// What was received while handling one round of events. The valid demands
+// themselves are kept in each source's entry in the source table.
+struct batch {
+    bool received;
+    unsigned int valid;
+    enum packet_status status;
+};
+
+// Realtime clock in nanoseconds, for comparing against kernel timestamps
+static uint64_t realtimeNanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+// Monotonic arrival time of a received packet, from the kernel's
+// SO_TIMESTAMPNS timestamp. Falls back to now if there is no timestamp.
+static uint64_t packetArrival(struct msghdr *msg, int64_t realtime_offset_ns, uint64_t now) {
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(msg); c != NULL; c = CMSG_NXTHDR(msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+            uint64_t arrived = (uint64_t) ((int64_t) ((uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec) + realtime_offset_ns);
+            return (arrived < now) ? arrived : now;
+        }
+    }
+    return now;
+}
+
+// Open, configure and bind one listening socket. Returns the socket, or -1.
+static int openSocket(const struct listen_address *listen) {
+    struct sockaddr_storage address;
+    socklen_t address_len;
+    memset(&address, 0, sizeof(address));
+    struct sockaddr_in *v4 = (struct sockaddr_in *) &address;
+    struct sockaddr_in6 *v6 = (struct sockaddr_in6 *) &address;
+    if (inet_pton(AF_INET, listen->address, &v4->sin_addr) == 1) {
+        v4->sin_family = AF_INET;
+        v4->sin_port = htons(listen->port);
+        address_len = sizeof(*v4);
+    } else if (inet_pton(AF_INET6, listen->address, &v6->sin6_addr) == 1) {
+        v6->sin6_family = AF_INET6;
+        v6->sin6_port = htons(listen->port);
+        address_len = sizeof(*v6);
+    } else {
+        logError("invalid listen address %s", listen->address);
+        return -1;
+    }
+
+    int udpsocket = socket(address.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+    if (udpsocket < 0) {
+        logError("create socket failed");
+        return -1;
+    }
+
+    int one = 1;
+    if (setsockopt(udpsocket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0) {
+        logError("configure socket failed 1");
+        close(udpsocket);
+        return -1;
+    }
+    // Keep IPv6 sockets to IPv6 only, so they can sit alongside IPv4 ones
+    // on the same port
+    if (address.ss_family == AF_INET6
+            && setsockopt(udpsocket, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one)) < 0) {
+        logError("configure socket failed 2");
+        close(udpsocket);
+        return -1;
+    }
+    // Optionally enlarge the receive buffer so that bursts of packets are
+    // queued rather than dropped by the kernel
+    if (config->rcvbuf_bytes > 0
+            && setsockopt(udpsocket, SOL_SOCKET, SO_RCVBUF, &config->rcvbuf_bytes, sizeof(config->rcvbuf_bytes)) < 0) {
+        logError("configure socket failed 3");
+        close(udpsocket);
+        return -1;
+    }
+    // Ask the kernel to timestamp each packet on arrival, for latency stats
+    if (setsockopt(udpsocket, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one)) < 0) {
+        logError("configure socket failed 4");
+        close(udpsocket);
+        return -1;
+    }
+    if (listen->interface[0] != '\0'
+            && setsockopt(udpsocket, SOL_SOCKET, SO_BINDTODEVICE, listen->interface, strlen(listen->interface)) < 0) {
+        logError("bind socket to interface %s failed", listen->interface);
+        close(udpsocket);
+        return -1;
+    }
+
+    if (bind(udpsocket, (struct sockaddr *) &address, address_len) < 0) {
+        logError("bind socket failed for %s port %d", listen->address, listen->port);
+        close(udpsocket);
+        return -1;
+    }
+    logInfo("Listening on %s port %d%s%s", listen->address, listen->port,
+            listen->interface[0] ? " on " : "", listen->interface);
+    return udpsocket;
+}
+
+// Arm the failover timer for an absolute monotonic time, or disarm it if
+// deadline_ns is 0
+static void armFailover(uint64_t deadline_ns) {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = (time_t) (deadline_ns / 1000000000ULL);
+    spec.it_value.tv_nsec = (long) (deadline_ns % 1000000000ULL);
+    timerfd_settime(failover_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+// Arm the telemetry timer to fire hz times a second, or disarm it if hz is 0
+static void armTelemetry(unsigned int hz) {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (hz > 0) {
+        spec.it_interval.tv_sec = (hz == 1) ? 1 : 0;
+        spec.it_interval.tv_nsec = (hz == 1) ? 0 : 1000000000L / hz;
+        spec.it_value = spec.it_interval;
+    }
+    timerfd_settime(telemetry_fd, 0, &spec, NULL);
+}
+
+// Hand a demand over to the servo loop and wake it so it goes out straight
+// away. Channels missing from the packet are zeroed.
+static void publish(const struct packet *packet, uint64_t arrival_ns, int source) {
+    struct demand d;
+    d.sequence = packet->has_sequence ? packet->sequence : ++local_sequence;
+    d.has_sender_time = packet->has_sequence;
+    d.sender_time_us = packet->sender_time_us;
+    d.source = (uint8_t) source;
+    for (int i = 0; i < DEMAND_CHANNELS; i++) {
+        d.value[i] = (i < packet->channels) ? packet->value[i] : 0;
+    }
+    d.has_heading = packet->has_heading;
+    d.heading = packet->heading;
+    d.timestamp_ns = monotonicNanos();
+    d.arrival_ns = arrival_ns;
+    demandPublish(&demand_slot, &d);
+    eventfd_write(demand_event, 1);
+}
+
+// Add an accepted demand to the flight recorder
+static void recordDemand(int source, const struct packet *packet, uint64_t arrival_ns) {
+    struct recorder_record r;
+    memset(&r, 0, sizeof(r));
+    r.time_ns = arrival_ns;
+    r.type = RECORDER_DEMAND;
+    r.source = (uint8_t) source;
+    r.channels = packet->channels;
+    r.flags = (uint8_t) (((packet->format == PACKET_FORMAT_BINARY) ? RECORDER_FLAG_BINARY : 0)
+            | (packet->has_sequence ? RECORDER_FLAG_SEQUENCE : 0) | (packet->has_heading ? RECORDER_FLAG_HEADING : 0));
+    r.sequence = packet->has_sequence ? packet->sequence : 0;
+    r.sender_time_us = packet->has_sequence ? packet->sender_time_us : 0;
+    r.heading = packet->has_heading ? packet->heading : 0;
+    for (int i = 0; i < packet->channels; i++) {
+        r.demand[i] = (int16_t) packet->value[i];
+    }
+    recorderWrite(&r);
+}
+
+// Authenticate and parse one packet from sender, received on socket number
+// link, and take it into the source table if it is valid
+static void ingest(const struct sockaddr_storage *sender, unsigned int link, const uint8_t *buf, size_t len,
+        bool truncated, uint64_t arrived, struct batch *b) {
+    struct packet parsed;
+    enum packet_status status = PACKET_ERR_TOO_LONG;
+    if (!truncated) {
+        const uint8_t *body = buf;
+        size_t body_len = len;
+        status = authVerify(buf, len, &body, &body_len);
+        if (status == PACKET_ERR_UNAUTHENTICATED && !auth_required) status = PACKET_OK;
+        if (status == PACKET_OK) status = parsePacket(body, body_len, &parsed);
+    }
+    uint64_t now = monotonicNanos();
+    histogramRecord(&hist_arrival_to_parse, now - arrived);
+    metricAdd(METRICS_COMMS, METRIC_PACKETS_RECEIVED, 1);
+    b->received = true;
+    b->status = status;
+    if (status == PACKET_ERR_UNAUTHENTICATED || status == PACKET_ERR_AUTH) {
+        metricAdd(METRICS_COMMS, METRIC_AUTH_FAILURES, 1);
+        return;
+    } else if (status == PACKET_ERR_REPLAYED) {
+        metricAdd(METRICS_COMMS, METRIC_PACKETS_REPLAYED, 1);
+        return;
+    } else if (status != PACKET_OK) {
+        metricAdd(METRICS_COMMS, METRIC_PARSE_ERRORS, 1);
+        return;
+    }
+    bool was_stale;
+    int index = sourcesAccept(sender, link, &parsed, arrived, now, &was_stale);
+    if (index < 0) {
+        metricAdd(METRICS_COMMS, was_stale ? METRIC_PACKETS_STALE : METRIC_PACKETS_UNKNOWN, 1);
+        return;
+    }
+    b->valid++;
+    metricAdd(METRICS_COMMS, METRIC_PACKETS_ACCEPTED, 1);
+    recordDemand(index, &parsed, arrived);
+    if (telemetry_acks) {
+        if (ack_count < COMMS_SEND_BATCH) {
+            acks[ack_count++] = (struct pending_ack) { index,
+                    parsed.has_sequence ? parsed.sequence : 0,
+                    parsed.has_sequence ? parsed.sender_time_us : 0, arrived };
+        } else {
+            metricAdd(METRICS_COMMS, METRIC_ACKS_DROPPED, 1);
+        }
+    }
+}
+
+// Read everything queued on a socket into the source table. Latest wins:
+// only the newest valid packet from each source is kept. Binary packets are
+// ordered by sequence number, and anything older than the newest seen from
+// the same source is rejected. ASCII packets carry no sequence number, so
+// arrival order is used.
+static void drainSocket(unsigned int link, struct batch *b) {
+    int udpsocket = sockets[link];
+    int count;
+    do {
+        for (int i = 0; i < COMMS_BATCH_SIZE; i++) {
+            msgs[i].msg_hdr.msg_namelen = sizeof(senders[i]);
+            msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+        }
+        count = recvmmsg(udpsocket, msgs, COMMS_BATCH_SIZE, MSG_DONTWAIT, NULL);
+        if (count <= 0) break;
+
+        // Kernel arrival timestamps are on the realtime clock, so work out
+        // the offset to the monotonic clock once per batch
+        int64_t realtime_offset_ns = (int64_t) (monotonicNanos() - realtimeNanos());
+
+        for (int i = 0; i < count; i++) {
+            uint64_t arrived = packetArrival(&msgs[i].msg_hdr, realtime_offset_ns, monotonicNanos());
+            ingest(&senders[i], link, buffers[i], msgs[i].msg_len, (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0,
+                    arrived, b);
+        }
+    } while (count == COMMS_BATCH_SIZE);
+}
+
+// Pick the controller and hand its demand to the servo loop if it has a new
+// one
+static void handOff(const struct batch *b) {
+    // Wake up again when the active source would lose control, so that fail
+    // over happens as soon as it goes quiet
+    uint64_t now = monotonicNanos();
+    int active = sourcesArbitrate(now);
+    if (active < 0) return;
+    uint64_t deadline = sourcesFailoverDeadline(active);
+    armFailover((deadline > now) ? deadline : 0);
+    struct source *s = sourcesGet(active);
+    if (!s->pending) {
+        metricAdd(METRICS_COMMS, METRIC_PACKETS_SUPERSEDED, b->valid);
+        return;
+    }
+
+    s->pending = false;
+    publish(&s->packet, s->arrival_ns, active);
+    histogramRecord(&hist_parse_to_handoff, monotonicNanos() - s->parsed_ns);
+    metricAdd(METRICS_COMMS, METRIC_DEMANDS_HANDED_OFF, 1);
+
+    metricAdd(METRICS_COMMS, METRIC_PACKETS_SUPERSEDED, (b->valid > 0) ? b->valid - 1 : 0);
+    if (logEnabled(LOG_LEVEL_DEBUG)) {
+        char text[PACKET_MAX_CHANNELS * 8 + 1] = "";
+        int len = 0;
+        for (int i = 0; i < s->packet.channels; i++) {
+            len += snprintf(text + len, sizeof(text) - len, " %.2f", s->packet.value[i] / (double) DEMAND_SCALE);
+        }
+        logDebug("Received demand from %s:%s (%llu superseded in total)", s->name, text,
+                (unsigned long long) metricGet(METRIC_PACKETS_SUPERSEDED));
+    }
+}
+
+// Queue an encoded message of len bytes in out_buffers[out_count] for the
+// given source
+static void queueReply(const struct source *s, size_t len) {
+    // The shared memory block has no way back
+    if (s->reply_address.ss_family == AF_UNIX) return;
+    struct mmsghdr *m = &out_msgs[out_count];
+    out_iovecs[out_count].iov_len = len;
+    m->msg_hdr.msg_name = (void *) &s->reply_address;
+    m->msg_hdr.msg_namelen = (s->reply_address.ss_family == AF_INET6)
+            ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    out_links[out_count] = s->link;
+    out_count++;
+}
+
+// Send the queued acks, and a state report to the active source if one is
+// due, batching everything for each socket into one sendmmsg() call
+static void sendTelemetry(int active, bool report_due) {
+    struct output_state o;
+    bool have_output = outputRead(&output_slot, &o);
+    uint8_t state = 0;
+    if (have_output && o.failsafe) state |= PACKET_STATE_FAILSAFE;
+    if (have_output && o.power_cut) state |= PACKET_STATE_POWER_CUT;
+    if (batteryLow()) state |= PACKET_STATE_BATTERY_LOW;
+    uint64_t now = monotonicNanos();
+
+    out_count = 0;
+    for (unsigned int i = 0; i < ack_count; i++) {
+        const struct pending_ack *a = &acks[i];
+        struct packet_ack ack = {
+            .sequence = a->sequence,
+            .sender_time_us = a->sender_time_us,
+            .held_us = (uint32_t) ((now - a->arrival_ns) / 1000),
+            .state = (uint8_t) (state | ((a->source == active) ? PACKET_STATE_IN_CONTROL : 0))
+        };
+        size_t len = packetEncodeAck(&ack, out_buffers[out_count], COMMS_MAX_PACKET_LEN);
+        if (len > 0) queueReply(sourcesGet(a->source), len);
+    }
+    ack_count = 0;
+
+    if (report_due && have_output && active >= 0 && out_count < COMMS_SEND_BATCH) {
+        struct packet_report r = {
+            .sequence = o.sequence,
+            .sender_time_us = o.sender_time_us,
+            .time_us = (uint32_t) (now / 1000),
+            .latency_us = o.latency_us,
+            .battery_mv = (uint16_t) batteryMillivolts(),
+            .jack_mv = (uint16_t) batteryJackMillivolts(),
+            .state = (uint8_t) (state | ((o.source == active) ? PACKET_STATE_IN_CONTROL : 0)),
+            .channels = o.channels
+        };
+        memcpy(r.pulse_us, o.pulse_us, sizeof(r.pulse_us));
+        size_t len = packetEncodeReport(&r, out_buffers[out_count], COMMS_MAX_PACKET_LEN);
+        if (len > 0) queueReply(sourcesGet(active), len);
+    }
+
+    // Messages for the same socket go out together, in order
+    for (unsigned int link = 0; link < socket_count; link++) {
+        struct mmsghdr batch[COMMS_SEND_BATCH];
+        unsigned int n = 0;
+        for (unsigned int i = 0; i < out_count; i++) {
+            if (out_links[i] == link) batch[n++] = out_msgs[i];
+        }
+        if (n == 0) continue;
+        int sent = sendmmsg(sockets[link], batch, n, MSG_DONTWAIT);
+        if (sent > 0) metricAdd(METRICS_COMMS, METRIC_TELEMETRY_SENT, (uint64_t) sent);
+        if (sent < (int) n) {
+            // Only the first failure is worth a warning, as a missing route
+            // or full socket buffer will fail every time
+            metricAdd(METRICS_COMMS, METRIC_TELEMETRY_ERRORS, 1);
+            if (metricGet(METRIC_TELEMETRY_ERRORS) == 1) {
+                logWarning("Sending telemetry failed: %s", (sent < 0) ? strerror(errno) : "partial send");
+            } else {
+                logDebug("Sending telemetry failed (%llu failures, %llu acks dropped in total)",
+                        (unsigned long long) metricGet(METRIC_TELEMETRY_ERRORS),
+                        (unsigned long long) metricGet(METRIC_ACKS_DROPPED));
+            }
+        }
+    }
+}
+
+// Take the latest demand from the shared memory block into the source
+// table. It needs no parsing, only the same range checks as a packet.
+static void drainLocal(struct batch *b) {
+    struct packet demand;
+    uint64_t written;
+    bool invalid;
+    if (!localRead(&demand, &written, &invalid)) {
+        if (invalid) {
+            b->received = true;
+            b->status = PACKET_ERR_RANGE;
+            metricAdd(METRICS_COMMS, METRIC_PACKETS_RECEIVED, 1);
+            metricAdd(METRICS_COMMS, METRIC_PARSE_ERRORS, 1);
+        }
+        return;
+    }
+    metricAdd(METRICS_COMMS, METRIC_PACKETS_RECEIVED, 1);
+    b->received = true;
+    b->status = PACKET_OK;
+    uint64_t now = monotonicNanos();
+    uint64_t arrived = (written < now) ? written : now;
+    histogramRecord(&hist_arrival_to_parse, now - arrived);
+    bool was_stale;
+    int index = sourcesAccept(&local_address, 0, &demand, arrived, now, &was_stale);
+    if (index < 0) {
+        metricAdd(METRICS_COMMS, was_stale ? METRIC_PACKETS_STALE : METRIC_PACKETS_UNKNOWN, 1);
+        return;
+    }
+    b->valid++;
+    metricAdd(METRICS_COMMS, METRIC_PACKETS_ACCEPTED, 1);
+    recordDemand(index, &demand, arrived);
+}
+
+// Pick up source priorities, failover time and telemetry settings from the
+// config, whenever it has been reloaded
+static void refreshConfig(void) {
+    static unsigned int generation = 0;
+    static bool configured = false;
+    const struct config_snapshot *snapshot = configAcquire(CONFIG_READER_COMMS);
+    if (!configured || snapshot->generation != generation) {
+        if (sourcesConfigure(&snapshot->sources) == 0) configured = true;
+        generation = snapshot->generation;
+        if (snapshot->telemetry_hz != telemetry_hz) {
+            telemetry_hz = snapshot->telemetry_hz;
+            armTelemetry(telemetry_hz);
+        }
+        telemetry_acks = snapshot->telemetry_acks && socket_count > 0;
+    }
+    configRelease(CONFIG_READER_COMMS);
+}
+
+// Say why, if nothing received in a round was usable
+static void reportDiscards(const struct batch *b) {
+    if (b->received && b->valid == 0) {
+        logWarning("Discarded packet: %s (%llu errors, %llu stale, %llu unknown sources in total)",
+                (b->status != PACKET_OK) ? packetStatusString(b->status) : "stale or unknown source",
+                (unsigned long long) metricGet(METRIC_PARSE_ERRORS), (unsigned long long) metricGet(METRIC_PACKETS_STALE),
+                (unsigned long long) metricGet(METRIC_PACKETS_UNKNOWN));
+    }
+}
+
+// Handle a signal read from the signalfd
+static void handleSignal(void) {
+    struct signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGUSR1) {
+            atomic_store(&stats_requested, true);
+        } else if (info.ssi_signo == SIGHUP) {
+            atomic_store(&reload_requested, true);
+        } else {
+            logInfo("Received signal %d, shutting down", (int) info.ssi_signo);
+            atomic_store(&running, false);
+            eventfd_write(demand_event, 1);
+        }
+    }
+}
+
+// The signals handled by the reactor: shutdown, statistics and reload
+static void handledSignals(sigset_t *mask) {
+    sigemptyset(mask);
+    sigaddset(mask, SIGINT);
+    sigaddset(mask, SIGTERM);
+    sigaddset(mask, SIGUSR1);
+    sigaddset(mask, SIGHUP);
+}
+
+int commsBlockSignals(void) {
+    sigset_t mask;
+    handledSignals(&mask);
+    return pthread_sigmask(SIG_BLOCK, &mask, NULL) ? -1 : 0;
+}
+
+int commsInit(const struct comms_config *c) {
+    config = c;
+    if ((config->listen_count == 0 && !config->replay) || config->listen_count > COMMS_MAX_LISTEN) {
+        logError("need between 1 and %d listen addresses", COMMS_MAX_LISTEN);
+        return -1;
+    }
+    auth_required = config->auth_required;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        logError("create epoll failed");
+        return -1;
+    }
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+
+    // Shutdown, statistics and reload signals
+    sigset_t mask;
+    handledSignals(&mask);
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    event.data.u32 = EVENT_SIGNAL;
+    if (signal_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event) < 0) {
+        logError("create signalfd failed");
+        return -1;
+    }
+
+    // Failover from a source that has gone quiet
+    failover_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    event.data.u32 = EVENT_FAILOVER;
+    if (failover_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, failover_fd, &event) < 0) {
+        logError("create failover timer failed");
+        return -1;
+    }
+
+    // Telemetry reports, armed once the config has been read
+    telemetry_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    event.data.u32 = EVENT_TELEMETRY;
+    if (telemetry_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, telemetry_fd, &event) < 0) {
+        logError("create telemetry timer failed");
+        return -1;
+    }
+
+    // Pings from the health monitor
+    if (healthEventFd() >= 0) {
+        event.data.u32 = EVENT_HEALTH;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, healthEventFd(), &event) < 0) {
+            logError("add health ping to epoll failed");
+            return -1;
+        }
+    }
+
+    // Demands from the shared memory block, if there is one
+    if (localEventFd() >= 0) {
+        struct sockaddr_un *local = (struct sockaddr_un *) &local_address;
+        memset(&local_address, 0, sizeof(local_address));
+        local->sun_family = AF_UNIX;
+        snprintf(local->sun_path, sizeof(local->sun_path), "%s", localName());
+        event.data.u32 = EVENT_LOCAL;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, localEventFd(), &event) < 0) {
+            logError("add shared memory to epoll failed");
+            return -1;
+        }
+    }
+
+    // Listening sockets
+    for (unsigned int i = 0; i < config->listen_count; i++) {
+        int udpsocket = openSocket(&config->listen[i]);
+        if (udpsocket < 0) return -1;
+        sockets[socket_count] = udpsocket;
+        event.data.u32 = socket_count;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, udpsocket, &event) < 0) {
+            logError("add socket to epoll failed");
+            return -1;
+        }
+        socket_count++;
+    }
+
+    // Set up the batch of receive buffers
+    for (int i = 0; i < COMMS_BATCH_SIZE; i++) {
+        iovecs[i].iov_base = buffers[i];
+        iovecs[i].iov_len = COMMS_MAX_PACKET_LEN;
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &senders[i];
+        msgs[i].msg_hdr.msg_control = controls[i];
+    }
+    for (int i = 0; i < COMMS_SEND_BATCH; i++) {
+        out_iovecs[i].iov_base = out_buffers[i];
+        memset(&out_msgs[i], 0, sizeof(out_msgs[i]));
+        out_msgs[i].msg_hdr.msg_iov = &out_iovecs[i];
+        out_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    return 0;
+}
+
+void *commsThread(__attribute__ ((unused)) void *arg) {
+    // In real-time mode, run just below the servo loop's priority
+    if (config->realtime) {
+        realtimePrefaultStack(config->realtime_prefault_bytes);
+        if (realtimeSetCurrentThread("comms", config->realtime_priority, config->realtime_cpu) == 0) {
+            logInfo("Comms thread running at SCHED_FIFO priority %d", config->realtime_priority);
+        } else {
+            logWarning("Comms thread could not be made real-time, continuing with normal scheduling");
+        }
+    }
+
+    struct epoll_event events[COMMS_MAX_LISTEN + 4];
+    while (atomic_load(&running)) {
+        int count = epoll_wait(epoll_fd, events, COMMS_MAX_LISTEN + 4, -1);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            logError("epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        refreshConfig();
+
+        // Gather the newest demand from every socket that is ready, so that
+        // only one is handed off however many links and sources are active
+        struct batch b = { .received = false, .valid = 0, .status = PACKET_ERR_EMPTY };
+        bool failover = false;
+        bool report_due = false;
+        for (int i = 0; i < count; i++) {
+            uint32_t tag = events[i].data.u32;
+            if (tag == EVENT_SIGNAL) {
+                handleSignal();
+            } else if (tag == EVENT_FAILOVER) {
+                uint64_t expirations;
+                if (read(failover_fd, &expirations, sizeof(expirations)) == sizeof(expirations)) failover = true;
+            } else if (tag == EVENT_TELEMETRY) {
+                uint64_t expirations;
+                if (read(telemetry_fd, &expirations, sizeof(expirations)) == sizeof(expirations)) report_due = true;
+            } else if (tag == EVENT_HEALTH) {
+                healthCommsAnswer();
+            } else if (tag == EVENT_LOCAL) {
+                drainLocal(&b);
+            } else if (tag < socket_count) {
+                drainSocket(tag, &b);
+            }
+        }
+
+        reportDiscards(&b);
+        if (b.valid > 0 || failover) handOff(&b);
+        if (ack_count > 0 || report_due) sendTelemetry(sourcesActive(), report_due);
+    }
+    return NULL;
+}
+
+bool commsReplayWait(uint64_t until_ns) {
+    struct epoll_event events[COMMS_MAX_LISTEN + 4];
+    for (;;) {
+        uint64_t now = monotonicNanos();
+        int timeout_ms = (until_ns > now) ? (int) ((until_ns - now) / 1000000) : 0;
+        int count = epoll_wait(epoll_fd, events, COMMS_MAX_LISTEN + 4, timeout_ms);
+        bool failover = false;
+        for (int i = 0; i < count; i++) {
+            uint32_t tag = events[i].data.u32;
+            uint64_t expirations;
+            if (tag == EVENT_SIGNAL) {
+                handleSignal();
+            } else if (tag == EVENT_FAILOVER) {
+                if (read(failover_fd, &expirations, sizeof(expirations)) == sizeof(expirations)) failover = true;
+            } else if (tag == EVENT_TELEMETRY) {
+                // Nowhere to send reports in a replay
+                if (read(telemetry_fd, &expirations, sizeof(expirations)) < 0) continue;
+            } else if (tag == EVENT_HEALTH) {
+                healthCommsAnswer();
+            }
+        }
+        if (!atomic_load(&running)) return false;
+        if (failover) {
+            struct batch b = { .received = false, .valid = 0, .status = PACKET_ERR_EMPTY };
+            handOff(&b);
+        }
+        if (count <= 0) break;
+    }
+
+    // epoll only waits to the millisecond, so sleep out the rest
+    struct timespec until = { .tv_sec = (time_t) (until_ns / 1000000000ULL), .tv_nsec = (long) (until_ns % 1000000000ULL) };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR);
+    return atomic_load(&running);
+}
+
+void commsReplayPacket(const struct sockaddr_storage *sender, const uint8_t *buf, size_t len) {
+    refreshConfig();
+    struct batch b = { .received = false, .valid = 0, .status = PACKET_ERR_EMPTY };
+    ingest(sender, 0, buf, len, len > COMMS_MAX_PACKET_LEN, monotonicNanos(), &b);
+    reportDiscards(&b);
+    if (b.valid > 0) handOff(&b);
+}
+
+void commsCleanup(void) {
+    for (unsigned int i = 0; i < socket_count; i++) {
+        close(sockets[i]);
+    }
+    socket_count = 0;
+    if (failover_fd >= 0) close(failover_fd);
+    if (telemetry_fd >= 0) close(telemetry_fd);
+    if (signal_fd >= 0) close(signal_fd);
+    if (epoll_fd >= 0) close(epoll_fd);
+    failover_fd = telemetry_fd = signal_fd = epoll_fd = -1;
+}
@@ -0,0 +1,81 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Comms reactor.
+//
+// A single thread waits in epoll on every listening socket, the shared
+// memory doorbell (local.h), a failover timer and a signalfd, so it reacts
+// immediately to demands on any link, to a controller going quiet and to
+// shutdown, without any blocking-with-timeout calls. Loss of every controller is handled by the failsafe in the servo
+// loop, from the arrival time of the last valid demand.
+//
+// The same thread sends telemetry back when it is turned on: an ack for
+// every valid demand, and state reports to the active controller on a
+// timer, in one sendmmsg() call per socket per round.
+
+#ifndef COMMS_H
+#define COMMS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "sources.h"
+
+// Most listening sockets the reactor will handle
+#define COMMS_MAX_LISTEN 8
+// Longest listen address and network interface name, including the
+// terminator
+#define COMMS_ADDRESS_LEN 48
+#define COMMS_INTERFACE_LEN 16
+
+// An address to listen for packets on. The address may be IPv4 or IPv6,
+// e.g. "0.0.0.0" or "::" for any. If interface is not empty, only packets
+// arriving on that network interface are accepted.
+struct listen_address {
+    char address[COMMS_ADDRESS_LEN];
+    uint16_t port;
+    char interface[COMMS_INTERFACE_LEN];
+};
+
+struct comms_config {
+    const struct listen_address *listen;
+    unsigned int listen_count;
+    // Socket receive buffer size in bytes, or 0 for the kernel default
+    int rcvbuf_bytes;
+    // Real-time scheduling for the comms thread
+    bool realtime;
+    int realtime_priority;
+    int realtime_cpu;
+    size_t realtime_prefault_bytes;
+    // Replaying recorded packets rather than listening, in which case there
+    // need be no listen addresses
+    bool replay;
+    // Reject packets not in a valid authenticated envelope (auth.h)
+    bool auth_required;
+};
+
+// Block the signals the reactor handles in the calling thread. Must be
+// called in main() before any other threads are created, so that they all
+// inherit the mask and the signals are only ever seen through the signalfd.
+int commsBlockSignals(void);
+
+// Open and bind all the sockets and create the reactor's timer and signalfd.
+// The config must remain valid while the comms thread runs. Source
+// priorities and failover come from the current config snapshot instead, so
+// that they can be reloaded. Returns 0 on success.
+int commsInit(const struct comms_config *config);
+
+// Comms thread entry point. Runs the reactor until shutdown.
+void *commsThread(void *arg);
+
+// Replay support. Instead of the comms thread, a replay thread feeds
+// recorded packets into the same parse, arbitration and handoff path with
+// commsReplayPacket(), as if each had just arrived, and waits between them
+// with commsReplayWait(), which handles signals and failover as the reactor
+// would. commsReplayWait() returns false if the controller has been asked
+// to shut down.
+bool commsReplayWait(uint64_t until_ns);
+void commsReplayPacket(const struct sockaddr_storage *sender, const uint8_t *buf, size_t len);
+
+// Close everything opened by commsInit()
+void commsCleanup(void);
+
+#endif // COMMS_H
@@ -0,0 +1,590 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Runtime configuration file, with hot reload.
+
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <stdatomic.h>
+
+// Longest line in the config file
+#define CONFIG_LINE_LEN 256
+
+// Most words in one setting's value, e.g. "mix = 100 50", one weight per
+// channel
+#define CONFIG_MAX_WORDS CHANNEL_MAX
+
+// Highest servo refresh rate that can be configured
+#define CONFIG_MAX_SERVO_RATE_HZ 1000
+
+// Shortest gap to leave between the end of a channel's longest pulse and
+// the start of its next frame
+#define CONFIG_FRAME_GUARD_US 100
+
+static _Atomic(struct config_snapshot *) current;
+static _Atomic(const struct config_snapshot *) hazard[CONFIG_READERS];
+static unsigned int generation;
+
+// Remove leading and trailing whitespace in place
+static char *trim(char *text) {
+    while (isspace((unsigned char) *text)) text++;
+    char *end = text + strlen(text);
+    while (end > text && isspace((unsigned char) end[-1])) end--;
+    *end = '\0';
+    return text;
+}
+
+// Split a value into whitespace-separated words in place. Returns the
+// number of words, or -1 if there are too many.
+static int splitWords(char *text, char *words[CONFIG_MAX_WORDS]) {
+    int count = 0;
+    for (char *word = strtok(text, " \t"); word != NULL; word = strtok(NULL, " \t")) {
+        if (count == CONFIG_MAX_WORDS) return -1;
+        words[count++] = word;
+    }
+    return count;
+}
+
+static bool parseLong(const char *text, long min, long max, long *out) {
+    char *end;
+    errno = 0;
+    long value = strtol(text, &end, 10);
+    if (errno != 0 || end == text || *end != '\0' || value < min || value > max) return false;
+    *out = value;
+    return true;
+}
+
+static bool parseBool(const char *text, bool *out) {
+    if (!strcasecmp(text, "1") || !strcasecmp(text, "yes") || !strcasecmp(text, "true") || !strcasecmp(text, "on")) {
+        *out = true;
+    } else if (!strcasecmp(text, "0") || !strcasecmp(text, "no") || !strcasecmp(text, "false") || !strcasecmp(text, "off")) {
+        *out = false;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// A percentage from 0 to 100, e.g. "30" or "2.5", in demand units
+static bool parsePercent(const char *text, uint16_t *out) {
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || *end != '\0' || !(value >= 0.0 && value <= 100.0)) return false;
+    *out = (uint16_t) lround(value * DEMAND_SCALE);
+    return true;
+}
+
+// A voltage, e.g. "6.6", in millivolts
+static bool parseVolts(const char *text, uint32_t *out) {
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || *end != '\0' || !(value >= 0.0 && value <= 60.0)) return false;
+    *out = (uint32_t) lround(value * 1000.0);
+    return true;
+}
+
+// An authentication key: "<id> <hex>", the key being AUTH_KEY_MIN_LEN to
+// AUTH_KEY_MAX_LEN bytes. IDs must be unique.
+static bool parseAuthKey(struct config_snapshot *s, char *value) {
+    char *words[CONFIG_MAX_WORDS];
+    long id;
+    if (splitWords(value, words) != 2 || !parseLong(words[0], 0, UINT8_MAX, &id)) return false;
+    size_t digits = strlen(words[1]);
+    if (s->auth_key_count == AUTH_MAX_KEYS || digits % 2 != 0 || digits < 2 * AUTH_KEY_MIN_LEN
+            || digits > 2 * AUTH_KEY_MAX_LEN) return false;
+    for (unsigned int i = 0; i < s->auth_key_count; i++) {
+        if (s->auth_keys[i].id == id) return false;
+    }
+    struct auth_key_config *k = &s->auth_keys[s->auth_key_count];
+    for (size_t i = 0; i < digits / 2; i++) {
+        char byte[3] = { words[1][2 * i], words[1][2 * i + 1], '\0' };
+        if (!isxdigit((unsigned char) byte[0]) || !isxdigit((unsigned char) byte[1])) return false;
+        k->key[i] = (uint8_t) strtoul(byte, NULL, 16);
+    }
+    k->id = (uint8_t) id;
+    k->len = (uint8_t) (digits / 2);
+    s->auth_key_count++;
+    return true;
+}
+
+// A decimal number within a range
+static bool parseDouble(const char *text, double min, double max, double *out) {
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || *end != '\0' || !(value >= min && value <= max)) return false;
+    *out = value;
+    return true;
+}
+
+static bool parseLogLevel(const char *text, enum log_level *out) {
+    static const char *const names[] = { "error", "warning", "info", "debug" };
+    for (int i = 0; i <= LOG_LEVEL_DEBUG; i++) {
+        if (!strcasecmp(text, names[i])) {
+            *out = (enum log_level) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// A channel's mix: a weight in percent for each of the first few packet
+// values, e.g. "100 -50", or none
+static bool parseMix(char *text, struct channel_config *c) {
+    if (!strcmp(text, "none")) {
+        c->mix_count = 0;
+        return true;
+    }
+    char *words[CONFIG_MAX_WORDS];
+    int count = splitWords(text, words);
+    if (count < 1) return false;
+    for (int i = 0; i < count; i++) {
+        char *end;
+        double value = strtod(words[i], &end);
+        if (end == words[i] || *end != '\0' || !(value >= -200.0 && value <= 200.0)) return false;
+        c->mix[i] = (int16_t) lround(value * DEMAND_SCALE);
+    }
+    c->mix_count = (uint8_t) count;
+    return true;
+}
+
+static bool parseMixerSaturation(const char *text, enum mixer_saturation *out) {
+    if (!strcasecmp(text, "clip")) {
+        *out = MIXER_CLIP;
+    } else if (!strcasecmp(text, "scale")) {
+        *out = MIXER_SCALE;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool parseInterpolation(const char *text, enum interpolation *out) {
+    static const char *const names[] = { "none", "linear", "cubic", "extrapolate" };
+    for (int i = 0; i <= INTERPOLATE_EXTRAPOLATE; i++) {
+        if (!strcasecmp(text, names[i])) {
+            *out = (enum interpolation) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Apply one setting from a [channel N] section. Returns false if the key is
+// unknown or the value invalid.
+static bool channelSetting(struct channel_config *c, const char *key, char *value) {
+    long n;
+    bool flag;
+    if (!strcmp(key, "servo")) {
+        if (!parseLong(value, 0, 8, &n)) return false;
+        c->servo = (uint8_t) n;
+    } else if (!strcmp(key, "min_us")) {
+        if (!parseLong(value, 1, INT16_MAX, &n)) return false;
+        c->min_us = (int16_t) n;
+    } else if (!strcmp(key, "max_us")) {
+        if (!parseLong(value, 1, INT16_MAX, &n)) return false;
+        c->max_us = (int16_t) n;
+    } else if (!strcmp(key, "centre_us")) {
+        if (!parseLong(value, 1, INT16_MAX, &n)) return false;
+        c->centre_us = (int16_t) n;
+    } else if (!strcmp(key, "bipolar")) {
+        if (!parseBool(value, &flag)) return false;
+        c->bipolar = flag;
+    } else if (!strcmp(key, "inverted")) {
+        if (!parseBool(value, &flag)) return false;
+        c->inverted = flag;
+    } else if (!strcmp(key, "rate_limit")) {
+        if (!parseLong(value, 0, UINT16_MAX, &n)) return false;
+        c->rate_limit = (uint16_t) n;
+    } else if (!strcmp(key, "expo")) {
+        return parsePercent(value, &c->expo);
+    } else if (!strcmp(key, "deadband")) {
+        return parsePercent(value, &c->deadband);
+    } else if (!strcmp(key, "failsafe_hold_ms")) {
+        if (!parseLong(value, 0, UINT16_MAX, &n)) return false;
+        c->failsafe_hold_ms = (uint16_t) n;
+    } else if (!strcmp(key, "failsafe_ramp_ms")) {
+        if (!parseLong(value, 0, UINT16_MAX, &n)) return false;
+        c->failsafe_ramp_ms = (uint16_t) n;
+    } else if (!strcmp(key, "interpolation")) {
+        return parseInterpolation(value, &c->interpolation);
+    } else if (!strcmp(key, "low_battery_limit")) {
+        return parsePercent(value, &c->low_battery_limit);
+    } else if (!strcmp(key, "refresh_divider")) {
+        if (!parseLong(value, 1, UINT8_MAX, &n)) return false;
+        c->refresh_divider = (uint8_t) n;
+    } else if (!strcmp(key, "mix")) {
+        return parseMix(value, c);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Apply one top-level setting. listen and source lines add to lists, which
+// replace the built-in ones the first time each appears. Returns false if
+// the key is unknown or the value invalid.
+static bool globalSetting(struct config_snapshot *s, const char *key, char *value, bool *listen_seen, bool *source_seen) {
+    long n;
+    bool flag;
+    char *words[CONFIG_MAX_WORDS];
+    if (!strcmp(key, "port")) {
+        if (!parseLong(value, 1, UINT16_MAX, &n)) return false;
+        s->port = (uint16_t) n;
+    } else if (!strcmp(key, "listen")) {
+        // listen = <address> [port] [interface]
+        int count = splitWords(value, words);
+        if (count < 1 || count > 3) return false;
+        if (!*listen_seen) s->listen_count = 0;
+        *listen_seen = true;
+        if (s->listen_count == COMMS_MAX_LISTEN || strlen(words[0]) >= COMMS_ADDRESS_LEN) return false;
+        struct listen_address *l = &s->listen[s->listen_count];
+        memset(l, 0, sizeof(*l));
+        strcpy(l->address, words[0]);
+        if (count >= 2) {
+            if (!parseLong(words[1], 1, UINT16_MAX, &n)) return false;
+            l->port = (uint16_t) n;
+        }
+        if (count == 3) {
+            if (strlen(words[2]) >= COMMS_INTERFACE_LEN) return false;
+            strcpy(l->interface, words[2]);
+        }
+        struct sockaddr_storage check;
+        if (!sourcesParseAddress(l->address, &check)) return false;
+        s->listen_count++;
+    } else if (!strcmp(key, "local_shm")) {
+        // local_shm = </name>, or none
+        if (!strcmp(value, "none")) {
+            s->local_shm[0] = '\0';
+        } else {
+            if (value[0] != '/' || strlen(value) >= LOCAL_NAME_LEN || strchr(value + 1, '/') != NULL) return false;
+            strcpy(s->local_shm, value);
+        }
+    } else if (!strcmp(key, "recorder_file")) {
+        // recorder_file = <path>, or none
+        if (!strcmp(value, "none")) {
+            s->recorder_file[0] = '\0';
+        } else {
+            if (strlen(value) >= CONFIG_PATH_LEN) return false;
+            strcpy(s->recorder_file, value);
+        }
+    } else if (!strcmp(key, "recorder_max_mb")) {
+        if (!parseLong(value, 2, 1000000, &n)) return false;
+        s->recorder_max_mb = (unsigned int) n;
+    } else if (!strcmp(key, "metrics_port")) {
+        if (!parseLong(value, 0, UINT16_MAX, &n)) return false;
+        s->metrics_port = (uint16_t) n;
+    } else if (!strcmp(key, "metrics_statsd")) {
+        // metrics_statsd = <address> [port], or none
+        if (!strcmp(value, "none")) {
+            s->metrics_statsd[0] = '\0';
+        } else {
+            int count = splitWords(value, words);
+            if (count < 1 || count > 2 || strlen(words[0]) >= COMMS_ADDRESS_LEN) return false;
+            struct sockaddr_storage check;
+            if (!sourcesParseAddress(words[0], &check)) return false;
+            if (count == 2) {
+                if (!parseLong(words[1], 1, UINT16_MAX, &n)) return false;
+                s->metrics_statsd_port = (uint16_t) n;
+            }
+            strcpy(s->metrics_statsd, words[0]);
+        }
+    } else if (!strcmp(key, "metrics_interval_ms")) {
+        if (!parseLong(value, 100, 3600000, &n)) return false;
+        s->metrics_interval_ms = (unsigned int) n;
+    } else if (!strcmp(key, "rcvbuf_bytes")) {
+        if (!parseLong(value, 0, INT32_MAX, &n)) return false;
+        s->rcvbuf_bytes = (int) n;
+    } else if (!strcmp(key, "realtime")) {
+        if (!parseBool(value, &flag)) return false;
+        s->realtime = flag;
+    } else if (!strcmp(key, "realtime_servo_priority")) {
+        if (!parseLong(value, 1, 99, &n)) return false;
+        s->realtime_servo_priority = (int) n;
+    } else if (!strcmp(key, "realtime_comms_priority")) {
+        if (!parseLong(value, 1, 99, &n)) return false;
+        s->realtime_comms_priority = (int) n;
+    } else if (!strcmp(key, "realtime_cpu")) {
+        if (!parseLong(value, -1, 1023, &n)) return false;
+        s->realtime_cpu = (int) n;
+    } else if (!strcmp(key, "servo_rate_hz")) {
+        if (!parseLong(value, 1, CONFIG_MAX_SERVO_RATE_HZ, &n)) return false;
+        s->servo_rate_hz = (unsigned int) n;
+    } else if (!strcmp(key, "immediate_updates")) {
+        if (!parseBool(value, &flag)) return false;
+        s->immediate_updates = flag;
+    } else if (!strcmp(key, "min_frame_us")) {
+        if (!parseLong(value, 0, 1000000, &n)) return false;
+        s->min_frame_us = (unsigned int) n;
+    } else if (!strcmp(key, "late_threshold_us")) {
+        if (!parseLong(value, 0, 1000000, &n)) return false;
+        s->late_threshold_us = (unsigned int) n;
+    } else if (!strcmp(key, "failsafe_power_cut_ms")) {
+        if (!parseLong(value, 0, 3600000, &n)) return false;
+        s->failsafe_power_cut_ms = (unsigned int) n;
+    } else if (!strcmp(key, "arming_hold_ms")) {
+        if (!parseLong(value, 0, 60000, &n)) return false;
+        s->arming_hold_ms = (unsigned int) n;
+    } else if (!strcmp(key, "watchdog_device")) {
+        // watchdog_device = <path>, or none
+        if (!strcmp(value, "none")) {
+            s->watchdog_device[0] = '\0';
+        } else {
+            if (strlen(value) >= CONFIG_PATH_LEN) return false;
+            strcpy(s->watchdog_device, value);
+        }
+    } else if (!strcmp(key, "watchdog_servo_ms")) {
+        if (!parseLong(value, 1, 60000, &n)) return false;
+        s->watchdog_servo_ms = (unsigned int) n;
+    } else if (!strcmp(key, "watchdog_comms_ms")) {
+        if (!parseLong(value, 4, 60000, &n)) return false;
+        s->watchdog_comms_ms = (unsigned int) n;
+    } else if (!strcmp(key, "mixer_saturation")) {
+        return parseMixerSaturation(value, &s->mixer_saturation);
+    } else if (!strcmp(key, "log_level")) {
+        return parseLogLevel(value, &s->log_level);
+    } else if (!strcmp(key, "battery_sample_hz")) {
+        if (!parseLong(value, 1, 1000, &n)) return false;
+        s->battery_sample_hz = (unsigned int) n;
+    } else if (!strcmp(key, "battery_filter_ms")) {
+        if (!parseLong(value, 0, 3600000, &n)) return false;
+        s->battery_filter_ms = (unsigned int) n;
+    } else if (!strcmp(key, "battery_low_v")) {
+        return parseVolts(value, &s->battery_low_mv);
+    } else if (!strcmp(key, "battery_hysteresis_v")) {
+        return parseVolts(value, &s->battery_hysteresis_mv);
+    } else if (!strcmp(key, "battery_startup_v")) {
+        return parseVolts(value, &s->battery_startup_mv);
+    } else if (!strcmp(key, "heading_channel")) {
+        if (!parseLong(value, 0, CHANNEL_MAX, &n)) return false;
+        s->heading_channel = (unsigned int) n;
+    } else if (!strcmp(key, "heading_kp")) {
+        return parseDouble(value, 0.0, 1000.0, &s->heading_kp);
+    } else if (!strcmp(key, "heading_ki")) {
+        return parseDouble(value, 0.0, 1000.0, &s->heading_ki);
+    } else if (!strcmp(key, "heading_kd")) {
+        return parseDouble(value, 0.0, 1000.0, &s->heading_kd);
+    } else if (!strcmp(key, "heading_offset")) {
+        return parseDouble(value, -180.0, 180.0, &s->heading_offset);
+    } else if (!strcmp(key, "heading_imu_hz")) {
+        // The DMP only runs at 200 Hz divided by a whole number
+        if (!parseLong(value, 4, 200, &n) || 200 % n != 0) return false;
+        s->heading_imu_hz = (unsigned int) n;
+    } else if (!strcmp(key, "source")) {
+        // source = <address> <priority>
+        if (splitWords(value, words) != 2) return false;
+        if (!*source_seen) s->sources.priority_count = 0;
+        *source_seen = true;
+        if (s->sources.priority_count == SOURCE_MAX || strlen(words[0]) >= SOURCE_NAME_LEN) return false;
+        if (!parseLong(words[1], 0, 1000000, &n)) return false;
+        struct sockaddr_storage check;
+        if (!sourcesParseAddress(words[0], &check)) return false;
+        struct source_priority *p = &s->sources.priorities[s->sources.priority_count++];
+        strcpy(p->address, words[0]);
+        p->priority = (int) n;
+    } else if (!strcmp(key, "default_priority")) {
+        if (!parseLong(value, -1, 1000000, &n)) return false;
+        s->sources.default_priority = (int) n;
+    } else if (!strcmp(key, "local_priority")) {
+        if (!parseLong(value, -1, 1000000, &n)) return false;
+        s->sources.local_priority = (int) n;
+    } else if (!strcmp(key, "failover_ms")) {
+        if (!parseLong(value, 1, 3600000, &n)) return false;
+        s->sources.failover_ms = (unsigned int) n;
+    } else if (!strcmp(key, "sequence_restart_gap")) {
+        if (!parseLong(value, 0, INT32_MAX, &n)) return false;
+        s->sources.sequence_restart_gap = (uint32_t) n;
+    } else if (!strcmp(key, "telemetry_hz")) {
+        if (!parseLong(value, 0, 1000, &n)) return false;
+        s->telemetry_hz = (unsigned int) n;
+    } else if (!strcmp(key, "auth_key")) {
+        return parseAuthKey(s, value);
+    } else if (!strcmp(key, "auth_required")) {
+        if (!parseBool(value, &flag)) return false;
+        s->auth_required = flag;
+    } else if (!strcmp(key, "telemetry_acks")) {
+        if (!parseBool(value, &flag)) return false;
+        s->telemetry_acks = flag;
+    } else if (!strcmp(key, "channels")) {
+        if (!parseLong(value, 1, CHANNEL_MAX, &n)) return false;
+        s->channel_count = (unsigned int) n;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Read the file into s. Returns false if it could not be read or has an
+// invalid line.
+static bool readFile(FILE *f, const char *path, struct config_snapshot *s) {
+    char line[CONFIG_LINE_LEN];
+    int line_number = 0;
+    int section = -1;
+    bool listen_seen = false, source_seen = false;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line_number++;
+        char *comment = strchr(line, '#');
+        if (comment != NULL) *comment = '\0';
+        char *text = trim(line);
+        if (*text == '\0') continue;
+
+        // Section header, e.g. [channel 1]
+        if (*text == '[') {
+            int n;
+            char end;
+            if (sscanf(text, "[channel %d %c", &n, &end) != 2 || end != ']' || n < 1 || n > CHANNEL_MAX) {
+                logError("%s line %d: unknown section %s", path, line_number, text);
+                return false;
+            }
+            section = n - 1;
+            // New channels start from a plain centred servo on the output
+            // of the same number
+            while (s->channel_count <= (unsigned int) section) {
+                struct channel_config *c = &s->channel[s->channel_count];
+                memset(c, 0, sizeof(*c));
+                c->servo = (uint8_t) (s->channel_count + 1);
+                c->min_us = 1000;
+                c->max_us = 2000;
+                c->centre_us = 1500;
+                s->channel_count++;
+            }
+            continue;
+        }
+
+        char *equals = strchr(text, '=');
+        if (equals == NULL) {
+            logError("%s line %d: expected key = value", path, line_number);
+            return false;
+        }
+        *equals = '\0';
+        char *key = trim(text);
+        char *value = trim(equals + 1);
+        bool ok = (section < 0) ? globalSetting(s, key, value, &listen_seen, &source_seen)
+                : channelSetting(&s->channel[section], key, value);
+        if (!ok) {
+            logError("%s line %d: unknown setting or invalid value for %s", path, line_number, key);
+            return false;
+        }
+    }
+    if (ferror(f)) {
+        logError("%s: read failed", path);
+        return false;
+    }
+    return true;
+}
+
+struct config_snapshot *configLoad(const char *path, const struct config_snapshot *defaults) {
+    struct config_snapshot *s = malloc(sizeof(*s));
+    if (s == NULL) {
+        logError("out of memory loading config");
+        return NULL;
+    }
+    *s = *defaults;
+
+    const char *name = (path != NULL) ? path : CONFIG_DEFAULT_PATH;
+    FILE *f = fopen(name, "r");
+    if (f == NULL) {
+        if (path != NULL || errno != ENOENT) {
+            logError("cannot open config file %s: %s", name, strerror(errno));
+            free(s);
+            return NULL;
+        }
+        logInfo("No config file at %s, using built-in settings", name);
+    } else {
+        bool ok = readFile(f, name, s);
+        fclose(f);
+        if (!ok) {
+            free(s);
+            return NULL;
+        }
+        logInfo("Read config file %s", name);
+    }
+
+    // Work out everything derived from the settings, and check they fit
+    // together
+    for (unsigned int i = 0; i < s->listen_count; i++) {
+        if (s->listen[i].port == 0) s->listen[i].port = s->port;
+    }
+    s->servo_period_ns = 1000000000ULL / s->servo_rate_hz;
+    // A refresh is a frame too, so at high servo rates the minimum frame is
+    // never longer than the servo period
+    if (s->min_frame_us * 1000ULL > s->servo_period_ns) {
+        s->min_frame_us = (unsigned int) (s->servo_period_ns / 1000);
+    }
+    if (channelTableInit(&s->channels, s->channel, s->channel_count)) {
+        logError("%s: invalid channel configuration", name);
+        free(s);
+        return NULL;
+    }
+    if (mixerInit(&s->mixer, s->channel, &s->channels, s->mixer_saturation)) {
+        logError("%s: a channel mixes in more values than there are channels", name);
+        free(s);
+        return NULL;
+    }
+    if (s->auth_required && s->auth_key_count == 0) {
+        logError("%s: auth_required needs at least one auth_key", name);
+        free(s);
+        return NULL;
+    }
+    if (s->heading_channel > (unsigned int) s->channels.count) {
+        logError("%s: heading_channel %u is not a channel in use", name, s->heading_channel);
+        free(s);
+        return NULL;
+    }
+    // With a mixer, heading hold replaces a packet value, which must then
+    // feed at least one channel
+    if (s->heading_channel != 0 && s->mixer.enabled && !mixerUsesValue(&s->mixer, s->heading_channel - 1)) {
+        logError("%s: heading_channel %u is a packet value that no channel mixes in", name, s->heading_channel);
+        free(s);
+        return NULL;
+    }
+    // At a high servo rate, every channel's longest pulse must still fit
+    // inside its frame
+    for (int i = 0; i < s->channels.count; i++) {
+        uint64_t frame_us = s->servo_period_ns * s->channels.refresh_divider[i] / 1000;
+        if ((uint64_t) s->channels.max_us[i] + CONFIG_FRAME_GUARD_US > frame_us) {
+            logError("%s: channel %d pulses of up to %d us do not fit in a %llu us frame", name, i + 1,
+                    s->channels.max_us[i], (unsigned long long) frame_us);
+            free(s);
+            return NULL;
+        }
+    }
+    return s;
+}
+
+void configPublish(struct config_snapshot *snapshot) {
+    snapshot->generation = ++generation;
+    struct config_snapshot *old = atomic_exchange(&current, snapshot);
+    if (old == NULL) return;
+
+    // Grace period: wait for any reader still using the old snapshot to let
+    // go of it. Readers only hold a snapshot for one pass of their loop.
+    struct timespec pause = { .tv_sec = 0, .tv_nsec = 1000000 };
+    for (int i = 0; i < CONFIG_READERS; i++) {
+        while (atomic_load(&hazard[i]) == old) {
+            nanosleep(&pause, NULL);
+        }
+    }
+    free(old);
+}
+
+const struct config_snapshot *configAcquire(enum config_reader reader) {
+    const struct config_snapshot *snapshot;
+    // Announce the snapshot before using it, then check it is still current,
+    // so that configPublish() cannot have missed the announcement
+    do {
+        snapshot = atomic_load(&current);
+        atomic_store(&hazard[reader], snapshot);
+    } while (atomic_load(&current) != snapshot);
+    return snapshot;
+}
+
+void configRelease(enum config_reader reader) {
+    atomic_store_explicit(&hazard[reader], NULL, memory_order_release);
+}
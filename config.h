@@ -0,0 +1,152 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Runtime configuration file, with hot reload.
+//
+// The #defines and tables at the top of udp_servo_control.c are the
+// defaults. A config file of "key = value" lines, with a [channel N] section
+// per servo channel, overrides them at startup, and is read again whenever
+// the process gets SIGHUP. See udp_servo_control.conf for every setting.
+//
+// Each time the file is read, a complete new snapshot is built and checked
+// off to one side, then swapped in with a single atomic pointer store, so
+// the servo loop and comms thread never see a half-applied change and never
+// wait for one. Snapshots are immutable once published. Each reader thread
+// announces the snapshot it is using while it uses it, and an old snapshot
+// is only freed once no reader still holds it, which is the grace period.
+//
+// Listen addresses, the socket buffer size, the shared memory name, the
+// flight recorder, authentication, the IMU rate and real-time scheduling
+// settings only take effect at startup.
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "auth.h"
+#include "channels.h"
+#include "comms.h"
+#include "sources.h"
+#include "local.h"
+#include "log.h"
+#include "mixer.h"
+
+// Config file read if none is given on the command line. It is not an error
+// for this one to be missing.
+#define CONFIG_DEFAULT_PATH "/etc/udp_servo_control.conf"
+// Longest file path setting, including the terminator
+#define CONFIG_PATH_LEN 128
+
+// Threads that read the configuration while the controller runs
+enum config_reader {
+    CONFIG_READER_SERVO,
+    CONFIG_READER_COMMS,
+    CONFIG_READER_BATTERY,
+    CONFIG_READER_HEALTH,
+    CONFIG_READER_HEADING,
+    CONFIG_READERS
+};
+
+struct config_snapshot {
+    // Incremented for every snapshot published, so readers can spot changes
+    unsigned int generation;
+
+    // Startup only. Listen addresses without a port of their own use port.
+    uint16_t port;
+    struct listen_address listen[COMMS_MAX_LISTEN];
+    unsigned int listen_count;
+    int rcvbuf_bytes;
+    char local_shm[LOCAL_NAME_LEN];
+    char recorder_file[CONFIG_PATH_LEN];
+    unsigned int recorder_max_mb;
+    // Metrics exporter: HTTP port, or 0 for none, and StatsD server, or an
+    // empty address for none
+    uint16_t metrics_port;
+    char metrics_statsd[COMMS_ADDRESS_LEN];
+    uint16_t metrics_statsd_port;
+    unsigned int metrics_interval_ms;
+    bool realtime;
+    int realtime_servo_priority;
+    int realtime_comms_priority;
+    int realtime_cpu;
+
+    // Servo loop
+    unsigned int servo_rate_hz;
+    uint64_t servo_period_ns;
+    bool immediate_updates;
+    unsigned int min_frame_us;
+    unsigned int late_threshold_us;
+    unsigned int failsafe_power_cut_ms;
+    unsigned int arming_hold_ms;
+    enum log_level log_level;
+
+    // Watchdogs. The servo loop counts as stalled after watchdog_servo_ms
+    // without a pass, and the comms thread after watchdog_comms_ms without
+    // answering a ping. The device is opened at startup only.
+    char watchdog_device[CONFIG_PATH_LEN];
+    unsigned int watchdog_servo_ms;
+    unsigned int watchdog_comms_ms;
+
+    // Battery monitoring. Voltages are in millivolts; a low level of 0
+    // turns off the low battery limits.
+    unsigned int battery_sample_hz;
+    unsigned int battery_filter_ms;
+    uint32_t battery_low_mv;
+    uint32_t battery_hysteresis_mv;
+    uint32_t battery_startup_mv;
+
+    // Heading hold. While demands carry a target heading, value
+    // heading_channel of the packet, numbered from 1, or none if 0, is
+    // replaced by the output of a PID controller with these gains, in
+    // percent of full demand per degree of error, per degree-second and per
+    // degree per second of turn. Without a mixer that is the channel of the
+    // same number; with one, it is the packet value before mixing, such as
+    // the rudder value feeding differential thrust. The offset in degrees is
+    // added to the IMU's heading. The IMU runs at heading_imu_hz, and is
+    // only started if a heading channel is set at startup.
+    unsigned int heading_channel;
+    double heading_kp;
+    double heading_ki;
+    double heading_kd;
+    double heading_offset;
+    unsigned int heading_imu_hz;
+
+    // Comms. Reports go to the active controller telemetry_hz times a
+    // second, or never if it is 0.
+    struct source_config sources;
+    unsigned int telemetry_hz;
+    bool telemetry_acks;
+
+    // Startup only. Keys for authenticated packets, and whether packets
+    // without a valid envelope are rejected.
+    struct auth_key_config auth_keys[AUTH_MAX_KEYS];
+    unsigned int auth_key_count;
+    bool auth_required;
+
+    // Channels, as described and as built into a table, and the mixer from
+    // packet values to channel demands. With a mixer, interpolation is of
+    // the packet values, before mixing, each following the interpolation
+    // setting of the channel of the same number.
+    struct channel_config channel[CHANNEL_MAX];
+    unsigned int channel_count;
+    struct channel_table channels;
+    enum mixer_saturation mixer_saturation;
+    struct mixer mixer;
+};
+
+// Build a snapshot from the defaults overridden by the file at path. If
+// path is NULL, CONFIG_DEFAULT_PATH is tried and may be missing. Returns a
+// newly allocated snapshot, or NULL if the file could not be read or is
+// invalid, having logged why.
+struct config_snapshot *configLoad(const char *path, const struct config_snapshot *defaults);
+
+// Make a snapshot the current one, then wait for readers to finish with the
+// one it replaces and free it. Only called from one thread at a time.
+void configPublish(struct config_snapshot *snapshot);
+
+// Get the current snapshot for a reader thread, which must call
+// configRelease() when done with it and before blocking for any length of
+// time. Never blocks.
+const struct config_snapshot *configAcquire(enum config_reader reader);
+void configRelease(enum config_reader reader);
+
+#endif // CONFIG_H
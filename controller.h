@@ -0,0 +1,33 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// State shared between the controller's threads.
+
+#ifndef CONTROLLER_H
+#define CONTROLLER_H
+
+#include <stdatomic.h>
+#include "demand.h"
+#include "output.h"
+#include "stats.h"
+
+// Cleared when the controller has been asked to shut down
+extern atomic_bool running;
+
+// Set when the statistics have been asked for
+extern atomic_bool stats_requested;
+
+// Set when the config file should be read again
+extern atomic_bool reload_requested;
+
+// Latest demand, handed from the comms thread to the servo loop without
+// locking, and the eventfd used to wake the servo loop when it changes
+extern struct demand_slot demand_slot;
+extern int demand_event;
+
+// Outputs last applied, handed back from the servo loop for telemetry
+extern struct output_slot output_slot;
+
+// Latency histograms recorded by the comms thread
+extern struct histogram hist_arrival_to_parse;
+extern struct histogram hist_parse_to_handoff;
+
+#endif // CONTROLLER_H
@@ -0,0 +1,85 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Lock-free demand handoff between the comms thread and the servo loop.
+//
+// A demand slot is a seqlock with a single writer (the comms thread) and any
+// number of readers (the servo loop). The writer never waits, and a reader
+// only ever retries if it happens to overlap a write in progress, so the
+// real-time servo loop can never block behind the network thread.
+
+#ifndef DEMAND_H
+#define DEMAND_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+
+// Number of demand values carried in each handoff, one per servo channel
+#define DEMAND_CHANNELS 8
+// Demand values are fixed point, in units of 1/DEMAND_SCALE percent, so
+// +/-100% is +/-DEMAND_FULL_SCALE
+#define DEMAND_SCALE 100
+#define DEMAND_FULL_SCALE (100 * DEMAND_SCALE)
+
+// A single demand, as written by the comms thread
+struct demand {
+    // Sequence number of the packet this demand came from
+    uint32_t sequence;
+    // CLOCK_MONOTONIC time at which the demand was handed off, in nanoseconds
+    uint64_t timestamp_ns;
+    // CLOCK_MONOTONIC time at which the packet arrived at the socket
+    uint64_t arrival_ns;
+    // Sender's own timestamp from the packet in microseconds, if it had one
+    bool has_sender_time;
+    uint32_t sender_time_us;
+    // Index of the source the demand came from
+    uint8_t source;
+    // Demand values, indexed by channel
+    int32_t value[DEMAND_CHANNELS];
+    // Target heading for heading hold in hundredths of a degree, if the packet
+    // gave one
+    bool has_heading;
+    uint16_t heading;
+};
+
+// Seqlock-protected slot holding the latest demand. The sequence counter is
+// odd while a write is in progress, and zero until the first write.
+struct demand_slot {
+    atomic_uint seq;
+    struct demand data;
+};
+
+// Monotonic time in nanoseconds, used for demand timestamps
+static inline uint64_t monotonicNanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+// Publish a new demand. Must only be called from the single writer thread.
+static inline void demandPublish(struct demand_slot *slot, const struct demand *d) {
+    unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->data = *d;
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+}
+
+// Read the latest demand into out. Returns false if nothing has been
+// published yet, in which case out is left untouched.
+static inline bool demandRead(struct demand_slot *slot, struct demand *out) {
+    for (;;) {
+        unsigned int before = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (before == 0) return false;
+        if (before & 1) continue;
+        struct demand copy = slot->data;
+        atomic_thread_fence(memory_order_acquire);
+        unsigned int after = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+        if (before == after) {
+            *out = copy;
+            return true;
+        }
+    }
+}
+
+#endif // DEMAND_H
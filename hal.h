@@ -0,0 +1,78 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Hardware abstraction.
+//
+// Everything the controller does to the board goes through these calls, so
+// that it can be built against either backend:
+//
+//   hal_rc.c    librobotcontrol, for the Beaglebone Blue
+//   hal_mock.c  no hardware at all, for benchmarking on any Linux machine
+//
+// The mock backend timestamps every batch of pulses sent and, if the
+// environment variable HAL_MOCK_PULSE_FD names an open file descriptor,
+// writes a struct hal_pulse_record to it for each pulse. tools/bench.c uses
+// this to measure latency from packet to pulse. Its IMU reports a steady
+// heading, HAL_MOCK_HEADING_ENV degrees if that is set, otherwise north.
+
+#ifndef HAL_H
+#define HAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Environment variable giving the mock backend's pulse record descriptor
+#define HAL_MOCK_PULSE_FD_ENV "HAL_MOCK_PULSE_FD"
+// Environment variable giving the mock backend's heading in degrees
+#define HAL_MOCK_HEADING_ENV "HAL_MOCK_HEADING"
+
+// One pulse sent by the mock backend
+struct hal_pulse_record {
+    // CLOCK_MONOTONIC time of the call that sent it, in nanoseconds
+    uint64_t time_ns;
+    int16_t servo;
+    uint16_t pulse_us;
+    uint32_t reserved;
+};
+
+// Servo outputs. Servo numbers are 1-8, or 0 for all at once. Calls return
+// 0 on success or -1 on failure.
+int halServoInit(void);
+void halServoCleanup(void);
+int halServoPowerRail(bool on);
+
+// Start count pulses all together, so that every channel's pulse starts in
+// the same frame. On the Beaglebone this is one pass of stores to the PRU's
+// shared memory, rather than a library call per channel. Invalid servo
+// numbers or pulse lengths are skipped and make the call return -1, as does
+// a channel whose previous pulse is still running, which is never cut short
+// or lengthened. The number of those busy channels is stored in *busy if
+// busy is not NULL.
+struct hal_pulse {
+    int servo;
+    int pulse_us;
+};
+int halServoSendPulses(const struct hal_pulse *pulses, int count, int *busy);
+
+// Battery and DC jack voltage, in volts
+int halAdcInit(void);
+void halAdcCleanup(void);
+double halBatteryVolts(void);
+double halJackVolts(void);
+
+// IMU heading, from the MPU-9250's DMP with the magnetometer fused in. The
+// callback is made from the IMU's own thread after every sample, rate_hz
+// times a second, where rate_hz is 200 divided by a whole number. A priority
+// above 0 makes that thread SCHED_FIFO at that priority.
+struct hal_imu_sample {
+    // Heading clockwise from magnetic north, 0 to 360 degrees
+    double heading_deg;
+};
+int halImuStart(unsigned int rate_hz, int priority, void (*callback)(const struct hal_imu_sample *sample));
+void halImuStop(void);
+
+// Sleep for the given number of microseconds
+void halSleep(unsigned int us);
+
+// Whether this is the mock backend, with no real servos to drive
+bool halMock(void);
+
+#endif // HAL_H
@@ -0,0 +1,133 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Hardware abstraction, mock backend with no hardware.
+//
+// Servo pulses go nowhere, except to the pulse record descriptor if one was
+// given, the battery always reads fully charged, and the IMU always points
+// the same way.
+
+#include "hal.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+
+// Battery and DC jack voltages reported by the mock
+#define HAL_MOCK_BATTERY_VOLTS 8.4
+#define HAL_MOCK_JACK_VOLTS 12.0
+// Most pulses recorded from one call
+#define HAL_MOCK_MAX_PULSES 16
+
+static int pulse_fd = -1;
+
+// The mock IMU's sample thread
+static pthread_t imu_thread;
+static atomic_bool imu_running;
+static unsigned int imu_rate_hz;
+static double imu_heading_deg;
+static void (*imu_callback)(const struct hal_imu_sample *sample);
+
+int halServoInit(void) {
+    const char *fd = getenv(HAL_MOCK_PULSE_FD_ENV);
+    if (fd != NULL) {
+        pulse_fd = atoi(fd);
+        logInfo("Mock servos, recording pulses to descriptor %d", pulse_fd);
+    } else {
+        logInfo("Mock servos");
+    }
+    return 0;
+}
+
+void halServoCleanup(void) {
+    if (pulse_fd >= 0) close(pulse_fd);
+    pulse_fd = -1;
+}
+
+int halServoPowerRail(__attribute__ ((unused)) bool on) {
+    return 0;
+}
+
+int halServoSendPulses(const struct hal_pulse *pulses, int count, int *busy) {
+    if (busy != NULL) *busy = 0;
+    if (pulse_fd < 0 || count <= 0) return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    struct hal_pulse_record r[HAL_MOCK_MAX_PULSES];
+    if (count > HAL_MOCK_MAX_PULSES) count = HAL_MOCK_MAX_PULSES;
+    for (int i = 0; i < count; i++) {
+        r[i] = (struct hal_pulse_record) {
+            .time_ns = (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec,
+            .servo = (int16_t) pulses[i].servo,
+            .pulse_us = (uint16_t) pulses[i].pulse_us,
+            .reserved = 0
+        };
+    }
+    // The whole batch goes in one write, as one pass of stores would
+    size_t len = (size_t) count * sizeof(r[0]);
+    return (write(pulse_fd, r, len) == (ssize_t) len) ? 0 : -1;
+}
+
+int halAdcInit(void) {
+    return 0;
+}
+
+void halAdcCleanup(void) {
+}
+
+double halBatteryVolts(void) {
+    return HAL_MOCK_BATTERY_VOLTS;
+}
+
+double halJackVolts(void) {
+    return HAL_MOCK_JACK_VOLTS;
+}
+
+// Make a sample at the IMU rate from an absolute-deadline clock, as the DMP
+// interrupt would
+static void *imuThread(__attribute__ ((unused)) void *arg) {
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    struct hal_imu_sample sample = { .heading_deg = imu_heading_deg };
+    while (atomic_load(&imu_running)) {
+        next.tv_nsec += 1000000000L / imu_rate_hz;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        imu_callback(&sample);
+    }
+    return NULL;
+}
+
+int halImuStart(unsigned int rate_hz, __attribute__ ((unused)) int priority,
+        void (*callback)(const struct hal_imu_sample *sample)) {
+    if (rate_hz == 0) return -1;
+    const char *heading = getenv(HAL_MOCK_HEADING_ENV);
+    imu_heading_deg = (heading != NULL) ? atof(heading) : 0.0;
+    imu_rate_hz = rate_hz;
+    imu_callback = callback;
+    atomic_store(&imu_running, true);
+    if (pthread_create(&imu_thread, NULL, imuThread, NULL)) {
+        atomic_store(&imu_running, false);
+        return -1;
+    }
+    logInfo("Mock IMU at %u Hz, heading %.1f degrees", rate_hz, imu_heading_deg);
+    return 0;
+}
+
+void halImuStop(void) {
+    if (atomic_exchange(&imu_running, false)) {
+        pthread_join(imu_thread, NULL);
+    }
+}
+
+void halSleep(unsigned int us) {
+    usleep(us);
+}
+
+bool halMock(void) {
+    return true;
+}
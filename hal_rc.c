@@ -0,0 +1,136 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Hardware abstraction, librobotcontrol backend.
+
+#include "hal.h"
+
+#include <stddef.h>
+#include <math.h>
+#include <sched.h>
+#include <rc/time.h>
+#include <rc/adc.h>
+#include <rc/mpu.h>
+#include <rc/pru.h>
+#include <rc/servo.h>
+
+// The servo firmware on PRU1 keeps one 32-bit word per channel at the start
+// of the PRU shared memory. A pulse starts as soon as its word is written
+// non-zero, and lasts that many turns of a loop of HAL_PRU_LOOP_INSTRUCTIONS
+// at HAL_PRU_CLOCK_MHZ, as in librobotcontrol's own rc_servo_send_pulse_us().
+// The firmware zeroes the word when the pulse ends, so a word that is still
+// non-zero belongs to a pulse that is running, and writing it would cut that
+// pulse short or lengthen it.
+#define HAL_PRU_CLOCK_MHZ 200
+#define HAL_PRU_LOOP_INSTRUCTIONS 48
+#define HAL_SERVO_CHANNELS 8
+
+// The channel words, or NULL to go through the library a call at a time
+static volatile uint32_t *pru_servo;
+
+// Filled in by the library's DMP interrupt thread before each callback
+static rc_mpu_data_t mpu_data;
+static void (*imu_callback)(const struct hal_imu_sample *sample);
+
+int halServoInit(void) {
+    if (rc_servo_init()) return -1;
+    pru_servo = rc_pru_shared_mem_ptr();
+    return 0;
+}
+
+void halServoCleanup(void) {
+    pru_servo = NULL;
+    rc_servo_cleanup();
+}
+
+int halServoPowerRail(bool on) {
+    return rc_servo_power_rail_en(on ? 1 : 0) ? -1 : 0;
+}
+
+int halServoSendPulses(const struct hal_pulse *pulses, int count, int *busy) {
+    int result = 0;
+    if (busy != NULL) *busy = 0;
+    if (pru_servo == NULL) {
+        // The library refuses busy channels itself
+        for (int i = 0; i < count; i++) {
+            if (rc_servo_send_pulse_us(pulses[i].servo, pulses[i].pulse_us)) result = -1;
+        }
+        return result;
+    }
+
+    // Work out every channel's loop count first, so that the stores that
+    // start the pulses follow each other with nothing in between
+    uint32_t loops[HAL_SERVO_CHANNELS] = { 0 };
+    for (int i = 0; i < count; i++) {
+        if (pulses[i].servo < 0 || pulses[i].servo > HAL_SERVO_CHANNELS || pulses[i].pulse_us < 1) {
+            result = -1;
+            continue;
+        }
+        uint32_t n = (uint32_t) pulses[i].pulse_us * HAL_PRU_CLOCK_MHZ / HAL_PRU_LOOP_INSTRUCTIONS;
+        if (pulses[i].servo == 0) {
+            for (int ch = 0; ch < HAL_SERVO_CHANNELS; ch++) loops[ch] = n;
+        } else {
+            loops[pulses[i].servo - 1] = n;
+        }
+    }
+    // Channels still busy are left alone, as the library would
+    bool skip[HAL_SERVO_CHANNELS];
+    for (int ch = 0; ch < HAL_SERVO_CHANNELS; ch++) {
+        skip[ch] = (loops[ch] != 0 && pru_servo[ch] != 0);
+        if (skip[ch]) {
+            if (busy != NULL) (*busy)++;
+            result = -1;
+        }
+    }
+    for (int ch = 0; ch < HAL_SERVO_CHANNELS; ch++) {
+        if (loops[ch] != 0 && !skip[ch]) pru_servo[ch] = loops[ch];
+    }
+    return result;
+}
+
+int halAdcInit(void) {
+    return rc_adc_init() ? -1 : 0;
+}
+
+void halAdcCleanup(void) {
+    rc_adc_cleanup();
+}
+
+double halBatteryVolts(void) {
+    return rc_adc_batt();
+}
+
+double halJackVolts(void) {
+    return rc_adc_dc_jack();
+}
+
+// Called from the library's DMP interrupt thread once each sample is read
+static void imuSample(void) {
+    double heading = fmod(mpu_data.compass_heading * (180.0 / M_PI), 360.0);
+    if (heading < 0.0) heading += 360.0;
+    struct hal_imu_sample sample = { .heading_deg = heading };
+    imu_callback(&sample);
+}
+
+int halImuStart(unsigned int rate_hz, int priority, void (*callback)(const struct hal_imu_sample *sample)) {
+    rc_mpu_config_t conf = rc_mpu_default_config();
+    conf.dmp_sample_rate = (int) rate_hz;
+    conf.enable_magnetometer = 1;
+    if (priority > 0) {
+        conf.dmp_interrupt_sched_policy = SCHED_FIFO;
+        conf.dmp_interrupt_priority = priority;
+    }
+    imu_callback = callback;
+    if (rc_mpu_initialize_dmp(&mpu_data, conf)) return -1;
+    return rc_mpu_set_dmp_callback(imuSample) ? -1 : 0;
+}
+
+void halImuStop(void) {
+    rc_mpu_power_off();
+}
+
+void halSleep(unsigned int us) {
+    rc_usleep(us);
+}
+
+bool halMock(void) {
+    return false;
+}
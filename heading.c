@@ -0,0 +1,117 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Closed-loop heading hold.
+
+#include "heading.h"
+
+#include <math.h>
+#include <stdatomic.h>
+#include "config.h"
+#include "controller.h"
+#include "demand.h"
+#include "hal.h"
+#include "log.h"
+#include "metrics.h"
+#include "packet.h"
+
+// How many IMU samples an output stays fresh for
+#define HEADING_FRESH_SAMPLES 3
+// Longest gap between samples that the integral and derivative are worked
+// over, so that a hiccup in the IMU cannot kick the rudder
+#define HEADING_MAX_DT_S 0.1
+
+static bool started;
+static uint64_t fresh_ns;
+
+// Latest output and when it was made, and when the last sample was taken
+static _Atomic int32_t output;
+static _Atomic uint64_t output_ns;
+static _Atomic uint64_t sample_ns;
+
+// Controller state, only touched from the IMU thread
+static bool holding;
+static double integral;
+static double last_heading;
+static uint64_t last_sample_ns;
+
+// An angle in degrees brought into -180 to 180
+static double wrap180(double degrees) {
+    degrees = fmod(degrees, 360.0);
+    if (degrees > 180.0) {
+        degrees -= 360.0;
+    } else if (degrees <= -180.0) {
+        degrees += 360.0;
+    }
+    return degrees;
+}
+
+// Run the controller for one IMU sample
+static void onSample(const struct hal_imu_sample *sample) {
+    uint64_t now = monotonicNanos();
+    const struct config_snapshot *config = configAcquire(CONFIG_READER_HEADING);
+    double heading = wrap180(sample->heading_deg + config->heading_offset);
+    if (heading < 0.0) heading += 360.0;
+    metricAdd(METRICS_HEADING, METRIC_IMU_SAMPLES, 1);
+    metricSet(METRICS_HEADING, METRIC_HEADING, (uint64_t) lround(heading * PACKET_HEADING_SCALE));
+
+    // Only hold a heading while the latest demand asks for one
+    struct demand d;
+    bool hold = config->heading_channel != 0 && demandRead(&demand_slot, &d) && d.has_heading;
+    if (hold != holding) {
+        if (hold) {
+            logInfo("Heading hold engaged at %.2f degrees", d.heading / (double) PACKET_HEADING_SCALE);
+            integral = 0.0;
+        } else {
+            logInfo("Heading hold released");
+        }
+    }
+    if (hold) {
+        // The derivative is taken on the measured heading, so that a new
+        // target does not kick the rudder
+        double dt = holding ? (now - last_sample_ns) / 1e9 : 0.0;
+        if (dt > HEADING_MAX_DT_S) dt = HEADING_MAX_DT_S;
+        double error = wrap180(d.heading / (double) PACKET_HEADING_SCALE - heading);
+        double rate = (dt > 0.0) ? wrap180(heading - last_heading) / dt : 0.0;
+        double demand = config->heading_kp * error + config->heading_ki * integral - config->heading_kd * rate;
+
+        // Stop integrating while the output is saturated in the direction
+        // the error would push it, so the integral cannot wind up
+        if ((demand < 100.0 || error < 0.0) && (demand > -100.0 || error > 0.0)) integral += error * dt;
+        if (demand > 100.0) demand = 100.0;
+        if (demand < -100.0) demand = -100.0;
+
+        atomic_store_explicit(&output, (int32_t) lround(demand * DEMAND_SCALE), memory_order_relaxed);
+        atomic_store_explicit(&output_ns, now, memory_order_release);
+    }
+    atomic_store_explicit(&sample_ns, now, memory_order_relaxed);
+    holding = hold;
+    last_heading = heading;
+    last_sample_ns = now;
+    configRelease(CONFIG_READER_HEADING);
+}
+
+int headingStart(unsigned int imu_hz, bool realtime, int priority) {
+    fresh_ns = HEADING_FRESH_SAMPLES * 1000000000ULL / imu_hz;
+    if (halImuStart(imu_hz, realtime ? priority : 0, onSample)) {
+        logError("IMU initialisation failed");
+        return -1;
+    }
+    started = true;
+    return 0;
+}
+
+void headingStop(void) {
+    if (started) halImuStop();
+    started = false;
+}
+
+// Whether a time is within the last few IMU samples
+static bool fresh(uint64_t then_ns, uint64_t now_ns) {
+    return then_ns != 0 && (now_ns <= then_ns || now_ns - then_ns <= fresh_ns);
+}
+
+bool headingOutput(uint64_t now_ns, int32_t *out) {
+    if (!started) return false;
+    uint64_t made_ns = atomic_load_explicit(&output_ns, memory_order_acquire);
+    if (fresh(made_ns, now_ns)) *out = atomic_load_explicit(&output, memory_order_relaxed);
+    return fresh(atomic_load_explicit(&sample_ns, memory_order_relaxed), now_ns);
+}
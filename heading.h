@@ -0,0 +1,43 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Closed-loop heading hold.
+//
+// When a demand carries a target heading, the heading channel's value in
+// the packet (normally the rudder) is replaced by the output of a PID
+// controller on the board. With a mixer (mixer.h) this is the packet value
+// before mixing, not an output channel, so heading hold can steer by
+// differential thrust. The controller runs in the IMU's own thread,
+// once for every DMP sample at 100-200 Hz, so the tight loop never crosses
+// the radio link, and a controller only needs to send targets a couple of
+// times a second.
+//
+// Each output is left for the servo loop to pick up on its next tick. It is
+// not a new demand, so it does not wake the loop for an immediate update,
+// which would send every channel at the IMU rate. It goes through the
+// channel's failsafe, low battery limit and slew like any other demand. If
+// the IMU stops producing samples, the servo loop falls back to the
+// packet's own demand for the channel, which senders should fill in as an
+// open-loop best guess.
+//
+// Headings are clockwise from north. A positive heading value must turn to
+// starboard. Without a mixer, use the channel's inverted setting if it
+// does not; with one, change the sign of that value's mix weights instead,
+// since inverted reverses a single output, not the steering.
+
+#ifndef HEADING_H
+#define HEADING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Start and stop the IMU and the controller. In real-time mode the IMU
+// thread runs at the given SCHED_FIFO priority. Returns 0 on success.
+int headingStart(unsigned int imu_hz, bool realtime, int priority);
+void headingStop(void);
+
+// Replace *out, the packet's demand for the heading channel, with the
+// controller's latest demand, if it has made one within the last few IMU
+// samples. Returns false if the IMU has gone quiet or was never started.
+// Called from the servo loop.
+bool headingOutput(uint64_t now_ns, int32_t *out);
+
+#endif // HEADING_H
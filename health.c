@@ -0,0 +1,221 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Health monitoring and watchdogs, see health.h.
+
+#include "health.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <linux/watchdog.h>
+#include "demand.h"
+#include "config.h"
+#include "controller.h"
+#include "hal.h"
+#include "log.h"
+#include "metrics.h"
+#include "notify.h"
+#include "realtime.h"
+
+// How often the monitor checks both paths
+#define HEALTH_CHECK_MS 5
+
+static int ping_fd = -1;
+static int device_fd = -1;
+static uint64_t device_feed_ns;
+static uint64_t systemd_feed_ns;
+static atomic_bool monitoring;
+static pthread_t monitor_thread;
+static bool thread_realtime;
+static int thread_priority;
+static int thread_cpu;
+
+// Last beat from each path, and when the comms thread was last pinged
+static _Atomic uint64_t servo_beat_ns;
+static _Atomic uint64_t comms_beat_ns;
+static _Atomic uint64_t ping_ns;
+
+// Statistics, written only by the monitor
+static _Atomic uint64_t worst_servo_gap_ns;
+static _Atomic uint64_t worst_comms_answer_ns;
+
+int healthInit(const char *device) {
+    ping_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ping_fd < 0) {
+        logError("create health ping failed");
+        return -1;
+    }
+    if (device[0] != '\0') {
+        // Opening the device arms it
+        device_fd = open(device, O_WRONLY | O_CLOEXEC);
+        if (device_fd < 0) {
+            logError("open watchdog %s failed: %s", device, strerror(errno));
+            return -1;
+        }
+        int timeout_s = 0;
+        if (ioctl(device_fd, WDIOC_GETTIMEOUT, &timeout_s) || timeout_s <= 0) timeout_s = 4;
+        // Feed well within the timeout, but not on every check
+        device_feed_ns = (uint64_t) timeout_s * 1000000000ULL / 4;
+        logInfo("Hardware watchdog %s armed, %d s timeout", device, timeout_s);
+    }
+    uint64_t usec = notifyWatchdogUsec();
+    if (usec > 0) {
+        systemd_feed_ns = usec * 1000 / 4;
+        logInfo("Feeding the systemd watchdog, %.1f s timeout", usec / 1e6);
+    }
+    return 0;
+}
+
+int healthEventFd(void) {
+    return ping_fd;
+}
+
+void healthCommsAnswer(void) {
+    eventfd_t count;
+    if (eventfd_read(ping_fd, &count) < 0) return;
+    atomic_store(&comms_beat_ns, monotonicNanos());
+}
+
+void healthServoBeat(void) {
+    atomic_store_explicit(&servo_beat_ns, monotonicNanos(), memory_order_relaxed);
+}
+
+static void recordWorst(_Atomic uint64_t *worst, uint64_t value) {
+    if (value > atomic_load(worst)) atomic_store(worst, value);
+}
+
+// Drive every output to its safe pulse, for when the servo loop cannot
+static void forceSafe(const struct channel_table *channels) {
+    struct hal_pulse pulses[CHANNEL_MAX];
+    for (int i = 0; i < channels->count; i++) {
+        pulses[i] = (struct hal_pulse) { channels->servo[i], channelSafePulse(channels, i) };
+    }
+    int busy;
+    halServoSendPulses(pulses, channels->count, &busy);
+    if (busy > 0) metricAdd(METRICS_HEALTH, METRIC_PULSES_BUSY, (uint64_t) busy);
+}
+
+static void *monitorThread(__attribute__ ((unused)) void *arg) {
+    if (thread_realtime) {
+        realtimeSetCurrentThread("health", thread_priority, thread_cpu);
+    }
+    uint64_t start_ns = monotonicNanos();
+    uint64_t last_device_ns = start_ns, last_systemd_ns = 0, last_safe_ns = 0;
+    uint64_t servo_stalled_ns = 0, comms_stalled_ns = 0;
+    atomic_store(&comms_beat_ns, start_ns);
+    atomic_store(&ping_ns, 0);
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (atomic_load(&monitoring) && atomic_load(&running)) {
+        const struct config_snapshot *config = configAcquire(CONFIG_READER_HEALTH);
+        uint64_t now = monotonicNanos();
+
+        // The servo loop may take up to a couple of its own periods, plus
+        // the lateness it tolerates, whatever the limit is set to
+        uint64_t servo_limit_ns = config->watchdog_servo_ms * 1000000ULL;
+        uint64_t servo_floor_ns = 2 * config->servo_period_ns + config->late_threshold_us * 1000ULL;
+        if (servo_limit_ns < servo_floor_ns) servo_limit_ns = servo_floor_ns;
+        uint64_t servo_last = atomic_load_explicit(&servo_beat_ns, memory_order_relaxed);
+        uint64_t servo_gap_ns = (servo_last != 0 && now > servo_last) ? now - servo_last : 0;
+        recordWorst(&worst_servo_gap_ns, servo_gap_ns);
+        bool servo_ok = servo_gap_ns <= servo_limit_ns;
+
+        // Ping the comms thread a few times within its limit, and see how
+        // long ago it last answered
+        uint64_t comms_limit_ns = config->watchdog_comms_ms * 1000000ULL;
+        uint64_t pinged = atomic_load(&ping_ns);
+        uint64_t answered = atomic_load(&comms_beat_ns);
+        if (answered >= pinged && pinged != 0) recordWorst(&worst_comms_answer_ns, answered - pinged);
+        if (answered >= pinged && now - pinged >= comms_limit_ns / 4) {
+            atomic_store(&ping_ns, now);
+            eventfd_write(ping_fd, 1);
+        }
+        bool comms_ok = (answered >= pinged) || (now - pinged <= comms_limit_ns);
+
+        if (!servo_ok) {
+            if (servo_stalled_ns == 0) {
+                servo_stalled_ns = servo_last;
+                metricAdd(METRICS_HEALTH, METRIC_SERVO_STALLS, 1);
+                logError("Servo loop stalled for %.0f ms, forcing safe outputs", servo_gap_ns / 1e6);
+            }
+            // Keep refreshing the safe pulses at the servo rate
+            if (now - last_safe_ns >= config->servo_period_ns) {
+                forceSafe(&config->channels);
+                last_safe_ns = now;
+            }
+        } else if (servo_stalled_ns != 0) {
+            logWarning("Servo loop recovered after %.0f ms", (servo_last - servo_stalled_ns) / 1e6);
+            servo_stalled_ns = 0;
+        }
+        if (!comms_ok) {
+            if (comms_stalled_ns == 0) {
+                comms_stalled_ns = pinged;
+                metricAdd(METRICS_HEALTH, METRIC_COMMS_STALLS, 1);
+                logError("Comms thread stalled for %.0f ms", (now - pinged) / 1e6);
+            }
+        } else if (comms_stalled_ns != 0) {
+            logWarning("Comms thread recovered after %.0f ms", (answered - comms_stalled_ns) / 1e6);
+            comms_stalled_ns = 0;
+        }
+        configRelease(CONFIG_READER_HEALTH);
+
+        // Only a healthy controller keeps its watchdogs fed
+        if (servo_ok && comms_ok) {
+            if (device_fd >= 0 && now - last_device_ns >= device_feed_ns) {
+                ioctl(device_fd, WDIOC_KEEPALIVE, 0);
+                last_device_ns = now;
+            }
+            if (systemd_feed_ns > 0 && now - last_systemd_ns >= systemd_feed_ns) {
+                notifySend("WATCHDOG=1");
+                last_systemd_ns = now;
+            }
+        }
+
+        next.tv_nsec += HEALTH_CHECK_MS * 1000000L;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    return NULL;
+}
+
+int healthStart(bool realtime, int priority, int cpu) {
+    thread_realtime = realtime;
+    thread_priority = priority;
+    thread_cpu = cpu;
+    atomic_store(&monitoring, true);
+    if (pthread_create(&monitor_thread, NULL, monitorThread, NULL)) {
+        atomic_store(&monitoring, false);
+        return -1;
+    }
+    return 0;
+}
+
+void healthStop(void) {
+    if (atomic_exchange(&monitoring, false)) {
+        pthread_join(monitor_thread, NULL);
+    }
+    // The magic character disarms the hardware watchdog on close, for a
+    // clean shutdown
+    if (device_fd >= 0) {
+        if (write(device_fd, "V", 1) != 1) logWarning("Could not disarm the hardware watchdog");
+        close(device_fd);
+        device_fd = -1;
+    }
+    if (ping_fd >= 0) close(ping_fd);
+    ping_fd = -1;
+}
+
+void healthDumpStats(FILE *out) {
+    fprintf(out, "Health: %llu servo stalls, worst gap %.3f ms; %llu comms stalls, worst answer %.3f ms\n",
+            (unsigned long long) metricGet(METRIC_SERVO_STALLS), atomic_load(&worst_servo_gap_ns) / 1e6,
+            (unsigned long long) metricGet(METRIC_COMMS_STALLS), atomic_load(&worst_comms_answer_ns) / 1e6);
+}
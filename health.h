@@ -0,0 +1,47 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Health monitoring and watchdogs.
+//
+// A monitor thread checks every few milliseconds that the servo loop is
+// still ticking and that the comms reactor still answers. The servo loop
+// beats on every pass. The comms thread is pinged through an eventfd in its
+// reactor and beats when it answers, so a stuck reactor is noticed whether
+// or not packets are arriving.
+//
+// While both are meeting their deadlines, the monitor feeds systemd's
+// watchdog (WatchdogSec=, through notify.h) and the hardware watchdog
+// device, if one is configured. If either stalls it stops feeding them, so
+// that the process is restarted or the board reset. If it is the servo loop
+// that has stalled, the monitor also drives every output to its safe pulse
+// itself in the meantime, rather than leaving the servos holding whatever
+// they were last sent. A stalled comms thread needs no more than that: the
+// servo loop keeps running and its failsafe takes over as demands age.
+
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+// Create the comms ping and open the hardware watchdog device, or none if
+// device is empty. Returns 0 on success.
+int healthInit(const char *device);
+
+// eventfd that the comms reactor waits on, calling healthCommsAnswer()
+// whenever it is readable
+int healthEventFd(void);
+void healthCommsAnswer(void);
+
+// Called by the servo loop on every pass. The servo loop is only checked
+// once it has started beating.
+void healthServoBeat(void);
+
+// Start and stop the monitor thread. In real-time mode it runs one step
+// above the servo loop, so that a servo loop spinning at its priority
+// cannot starve it. Stopping disarms the hardware watchdog.
+int healthStart(bool realtime, int priority, int cpu);
+void healthStop(void);
+
+// Print the stall counts and the longest gaps seen
+void healthDumpStats(FILE *out);
+
+#endif // HEALTH_H
@@ -0,0 +1,108 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Demand interpolation between controller updates.
+
+#include "interpolate.h"
+
+#include <string.h>
+
+// Packet intervals outside this range are not smoothed over. Anything
+// longer is treated as a fresh start after a gap in the stream.
+#define INTERPOLATE_MIN_INTERVAL_NS 1000000ULL
+#define INTERPOLATE_MAX_INTERVAL_NS 1000000000ULL
+
+// Fixed-point scale of the position within a segment
+#define SEGMENT_SHIFT 16
+#define SEGMENT_ONE (1 << SEGMENT_SHIFT)
+
+void interpolatorInit(struct interpolator *in) {
+    memset(in, 0, sizeof(*in));
+}
+
+void interpolatorSample(struct interpolator *in, const struct demand *d, uint64_t now) {
+    // Time since the last demand, by the sender's clock if both have a
+    // timestamp from the same sender
+    uint64_t interval_ns = 0;
+    if (in->have_latest && d->source == in->source) {
+        if (d->has_sender_time && in->has_sender_time) {
+            interval_ns = (uint64_t) (uint32_t) (d->sender_time_us - in->sender_time_us) * 1000ULL;
+        } else {
+            interval_ns = now - in->latest_ns;
+        }
+    }
+    bool smooth = interval_ns >= INTERPOLATE_MIN_INTERVAL_NS && interval_ns <= INTERPOLATE_MAX_INTERVAL_NS;
+
+    for (int i = 0; i < CHANNEL_MAX; i++) {
+        // Each new segment runs from the last demand, where the previous one
+        // has just finished, carrying on at the output's current rate
+        in->previous[i] = in->have_latest ? in->latest[i] : d->value[i];
+        in->latest[i] = d->value[i];
+        in->start_rate[i] = in->rate[i];
+    }
+    in->have_previous = smooth;
+    in->have_latest = true;
+    in->interval_ns = interval_ns;
+    in->latest_ns = now;
+    in->source = d->source;
+    in->has_sender_time = d->has_sender_time;
+    in->sender_time_us = d->sender_time_us;
+}
+
+// Cubic Hermite curve from p0 to p1 at position s through the segment, with
+// d0 and d1 the change over one whole segment at the current rate of change
+// at each end
+static int32_t hermite(int32_t p0, int32_t d0, int32_t p1, int32_t d1, int64_t s) {
+    int64_t s2 = (s * s) >> SEGMENT_SHIFT;
+    int64_t s3 = (s2 * s) >> SEGMENT_SHIFT;
+    int64_t h00 = 2 * s3 - 3 * s2 + SEGMENT_ONE;
+    int64_t h10 = s3 - 2 * s2 + s;
+    int64_t h01 = -2 * s3 + 3 * s2;
+    int64_t h11 = s3 - s2;
+    return (int32_t) ((h00 * p0 + h10 * d0 + h01 * p1 + h11 * d1) >> SEGMENT_SHIFT);
+}
+
+void interpolatorOutput(struct interpolator *in, const struct channel_table *table, bool mixed, uint64_t now,
+        int32_t out[CHANNEL_MAX]) {
+    uint64_t elapsed_ns = (now > in->latest_ns) ? now - in->latest_ns : 0;
+    int64_t s = SEGMENT_ONE;
+    if (in->have_previous && elapsed_ns < in->interval_ns) {
+        s = (int64_t) ((elapsed_ns << SEGMENT_SHIFT) / in->interval_ns);
+    }
+
+    for (int i = 0; i < table->count; i++) {
+        int32_t latest = in->latest[i];
+        int32_t value = latest;
+        if (in->have_previous) {
+            switch (table->interpolation[i]) {
+            case INTERPOLATE_LINEAR:
+                value = in->previous[i] + (int32_t) (((int64_t) (latest - in->previous[i]) * s) >> SEGMENT_SHIFT);
+                break;
+            case INTERPOLATE_CUBIC: {
+                int32_t d0 = (int32_t) ((int64_t) in->start_rate[i] * (int64_t) in->interval_ns / 1000000000LL);
+                value = (s < SEGMENT_ONE) ? hermite(in->previous[i], d0, latest, latest - in->previous[i], s) : latest;
+                break;
+            }
+            case INTERPOLATE_EXTRAPOLATE:
+                value = latest + (int32_t) (((int64_t) (latest - in->previous[i]) * s) >> SEGMENT_SHIFT);
+                break;
+            default:
+                break;
+            }
+        }
+
+        // Curves and predictions can overshoot, but never beyond the
+        // channel's range, or beyond any packet value's when mixing
+        if (in->have_previous && table->interpolation[i] != INTERPOLATE_NONE) {
+            int32_t lowest = mixed ? -DEMAND_FULL_SCALE : channelLowestDemand(table, i);
+            if (value < lowest) value = lowest;
+            if (value > DEMAND_FULL_SCALE) value = DEMAND_FULL_SCALE;
+        }
+
+        if (now > in->output_ns && in->output_ns != 0) {
+            int64_t rate = (int64_t) (value - in->output[i]) * 1000000000LL / (int64_t) (now - in->output_ns);
+            in->rate[i] = (rate > INT32_MAX) ? INT32_MAX : (rate < INT32_MIN) ? INT32_MIN : (int32_t) rate;
+        }
+        in->output[i] = value;
+        out[i] = value;
+    }
+    in->output_ns = now;
+}
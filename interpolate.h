@@ -0,0 +1,67 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Demand interpolation between controller updates.
+//
+// A slow controller, e.g. a 10 Hz ground station, gives a new demand every
+// few servo ticks. Rather than stepping straight to each one, the servo loop
+// can move towards it over the time the controller takes between packets:
+//
+//   INTERPOLATE_NONE         jump to each new demand
+//   INTERPOLATE_LINEAR       straight line from the previous demand to the
+//                            new one over one packet interval
+//   INTERPOLATE_CUBIC        as linear, but a cubic Hermite curve that
+//                            leaves at the output's current rate of change
+//                            and arrives moving at the controller's rate
+//   INTERPOLATE_EXTRAPOLATE  predict ahead from the last two demands, for
+//                            up to one packet interval
+//
+// Linear and cubic add up to one packet interval of lag in exchange for
+// smoothness; extrapolation adds none but can overshoot a sudden stop. The
+// packet interval comes from the sender's timestamps when packets carry
+// them, so radio jitter does not disturb it, and from arrival times if not.
+//
+// Only used by the servo loop.
+
+#ifndef INTERPOLATE_H
+#define INTERPOLATE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "channels.h"
+#include "demand.h"
+
+struct interpolator {
+    // Whether there are one or two demands to work from
+    bool have_latest;
+    bool have_previous;
+    uint8_t source;
+    bool has_sender_time;
+    uint32_t sender_time_us;
+    // Time the latest demand was taken on, and the time between it and the
+    // one before, in nanoseconds
+    uint64_t latest_ns;
+    uint64_t interval_ns;
+    int32_t latest[CHANNEL_MAX];
+    int32_t previous[CHANNEL_MAX];
+    // Output rate of change, in demand units per second, at the start of
+    // the current segment, then the output and its rate of change at the
+    // last call to interpolatorOutput()
+    int32_t start_rate[CHANNEL_MAX];
+    int32_t output[CHANNEL_MAX];
+    int32_t rate[CHANNEL_MAX];
+    uint64_t output_ns;
+};
+
+// Start an interpolator with every channel at zero demand
+void interpolatorInit(struct interpolator *in);
+
+// Take a new demand from the controller, handled at time now
+void interpolatorSample(struct interpolator *in, const struct demand *d, uint64_t now);
+
+// Work out the demand for every channel at time now, following each
+// channel's interpolation mode, into out. With mixed set the values are
+// packet values on their way into the mixer (mixer.h), so overshoot is only
+// clamped to +/-100%, not to the range of the channel of the same number.
+void interpolatorOutput(struct interpolator *in, const struct channel_table *table, bool mixed, uint64_t now,
+        int32_t out[CHANNEL_MAX]);
+
+#endif // INTERPOLATE_H
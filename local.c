@@ -0,0 +1,198 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Shared-memory demand input for controllers on the same board.
+
+#define _GNU_SOURCE
+#include "local.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "realtime.h"
+#include "log.h"
+
+// Mode of the shared memory object: only the controller's own user and
+// group may write demands into it
+#define LOCAL_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)
+// How long the doorbell thread waits before checking whether it should
+// stop, in milliseconds
+#define LOCAL_WAIT_MS 100
+// Most attempts at reading the block while a write is in progress. A writer
+// never holds it for more than a few instructions, so running out means it
+// died part way through.
+#define LOCAL_READ_ATTEMPTS 1000
+
+static char shm_name[LOCAL_NAME_LEN];
+static struct local_block *block;
+static int event_fd = -1;
+static bool have_sequence;
+static uint32_t last_sequence;
+static atomic_bool waiting;
+static pthread_t doorbell_thread;
+static bool thread_started;
+static bool thread_realtime;
+static int thread_priority, thread_cpu;
+
+// Wait on the doorbell, and pass each ring on to the comms reactor
+static void *doorbellThread(__attribute__ ((unused)) void *arg) {
+    if (thread_realtime) {
+        realtimeSetCurrentThread("local", thread_priority, thread_cpu);
+    }
+    unsigned int seen = atomic_load(&block->doorbell);
+    while (atomic_load(&waiting)) {
+        unsigned int now = atomic_load_explicit(&block->doorbell, memory_order_acquire);
+        if (now != seen) {
+            seen = now;
+            eventfd_write(event_fd, 1);
+            continue;
+        }
+        struct timespec timeout = { .tv_sec = 0, .tv_nsec = LOCAL_WAIT_MS * 1000000L };
+        syscall(SYS_futex, &block->doorbell, FUTEX_WAIT, seen, &timeout, NULL, 0);
+    }
+    return NULL;
+}
+
+int localInit(const char *name) {
+    if (name[0] != '/' || strlen(name) >= LOCAL_NAME_LEN) {
+        logError("invalid shared memory name %s", name);
+        return -1;
+    }
+    // Anyone who can write the block can take control, so it is always
+    // created afresh rather than reusing one that someone else may have made
+    // or opened up, and its owner and mode are checked once it exists
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, LOCAL_MODE);
+    if (fd < 0) {
+        logError("create shared memory %s failed: %s", name, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fchmod(fd, LOCAL_MODE) < 0 || fstat(fd, &st) < 0) {
+        logError("set shared memory %s mode failed: %s", name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (st.st_uid != geteuid() || (st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO)) != LOCAL_MODE) {
+        logError("shared memory %s is not owned by this user with mode %o", name, LOCAL_MODE);
+        close(fd);
+        return -1;
+    }
+    if (ftruncate(fd, sizeof(struct local_block)) < 0) {
+        logError("size shared memory %s failed: %s", name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    void *mapped = mmap(NULL, sizeof(struct local_block), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        logError("map shared memory %s failed: %s", name, strerror(errno));
+        return -1;
+    }
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0) {
+        logError("create local eventfd failed");
+        munmap(mapped, sizeof(struct local_block));
+        return -1;
+    }
+
+    // Start from a clean block, so that a demand left over from a previous
+    // run is never acted upon
+    block = mapped;
+    memset(block, 0, sizeof(*block));
+    block->version = LOCAL_VERSION;
+    atomic_thread_fence(memory_order_release);
+    block->magic = LOCAL_MAGIC;
+    strcpy(shm_name, name);
+    logInfo("Local demands from shared memory %s", name);
+    return 0;
+}
+
+int localStart(bool realtime, int priority, int cpu) {
+    if (block == NULL) return 0;
+    thread_realtime = realtime;
+    thread_priority = priority;
+    thread_cpu = cpu;
+    atomic_store(&waiting, true);
+    if (pthread_create(&doorbell_thread, NULL, doorbellThread, NULL)) {
+        atomic_store(&waiting, false);
+        return -1;
+    }
+    thread_started = true;
+    return 0;
+}
+
+void localStop(void) {
+    if (!thread_started) return;
+    atomic_store(&waiting, false);
+    atomic_fetch_add(&block->doorbell, 1);
+    syscall(SYS_futex, &block->doorbell, FUTEX_WAKE, 1, NULL, NULL, 0);
+    pthread_join(doorbell_thread, NULL);
+    thread_started = false;
+}
+
+int localEventFd(void) {
+    return event_fd;
+}
+
+const char *localName(void) {
+    return shm_name;
+}
+
+bool localRead(struct packet *out, uint64_t *written_ns, bool *invalid) {
+    *invalid = false;
+    eventfd_t count;
+    eventfd_read(event_fd, &count);
+
+    uint32_t sequence, channels;
+    uint64_t time_ns;
+    int32_t value[DEMAND_CHANNELS];
+    for (int attempt = 0;; attempt++) {
+        if (attempt == LOCAL_READ_ATTEMPTS) return false;
+        unsigned int before = atomic_load_explicit(&block->seq, memory_order_acquire);
+        if (before == 0) return false;
+        if (before & 1) continue;
+        sequence = block->sequence;
+        channels = block->channels;
+        time_ns = block->time_ns;
+        memcpy(value, block->value, sizeof(value));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&block->seq, memory_order_relaxed) == before) break;
+    }
+    if (have_sequence && sequence == last_sequence) return false;
+    have_sequence = true;
+    last_sequence = sequence;
+
+    if (channels < 1 || channels > PACKET_MAX_CHANNELS) {
+        *invalid = true;
+        return false;
+    }
+    for (uint32_t i = 0; i < channels; i++) {
+        if (value[i] < -DEMAND_FULL_SCALE || value[i] > DEMAND_FULL_SCALE) {
+            *invalid = true;
+            return false;
+        }
+        out->value[i] = value[i];
+    }
+    out->format = PACKET_FORMAT_BINARY;
+    out->has_sequence = true;
+    out->sequence = sequence;
+    out->sender_time_us = (uint32_t) (time_ns / 1000);
+    out->channels = (uint8_t) channels;
+    out->has_heading = false;
+    out->heading = 0;
+    *written_ns = time_ns;
+    return true;
+}
+
+void localCleanup(void) {
+    if (block == NULL) return;
+    munmap(block, sizeof(struct local_block));
+    shm_unlink(shm_name);
+    close(event_fd);
+    block = NULL;
+    event_fd = -1;
+}
@@ -0,0 +1,104 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Shared-memory demand input for controllers on the same board.
+//
+// A controller running on the Beaglebone itself, such as an autopilot, can
+// skip the network stack entirely. The controller creates a POSIX shared
+// memory object holding a single struct local_block, which the local
+// process maps and writes demands into with localWrite(). The block is a
+// seqlock, like the handoff in demand.h, so neither side ever waits for the
+// other, and there is no socket or text parse on the way.
+//
+// Demands written here are a source like any UDP sender, and go through
+// the same arbitration, at the priority set by local_priority, and the same
+// failsafe. A local writer that stops writing loses control and fails safe
+// exactly like a network one. Only one process may write to the block at a
+// time.
+//
+// Arbitration belongs to the comms thread, so a demand takes three thread
+// hops to reach the servos: the futex doorbell wakes a thread here, which
+// passes it on to the comms reactor through an eventfd, and the comms
+// thread hands the winning demand to the servo loop through demand.h. Each
+// is a wakeup with no copying, but it is not a direct handoff.
+//
+// Local demands cannot be authenticated, so the block is only writable by
+// the controller's own user and group, mode 660, and is created afresh at
+// startup. With auth_required set, there is no block at all.
+
+#ifndef LOCAL_H
+#define LOCAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "demand.h"
+#include "packet.h"
+
+// Longest shared memory object name, including the leading slash and the
+// terminator
+#define LOCAL_NAME_LEN 48
+
+// Set in the block's magic and version fields once the controller has
+// created it
+#define LOCAL_MAGIC 0x31435355
+#define LOCAL_VERSION 1
+
+struct local_block {
+    uint32_t magic;
+    uint32_t version;
+    // Seqlock counter, odd while a demand is being written
+    atomic_uint seq;
+    // Incremented after every demand, and waited on by the controller
+    atomic_uint doorbell;
+    // Demand, with a sequence number incremented for every write and the
+    // CLOCK_MONOTONIC time it was written
+    uint32_t sequence;
+    uint32_t channels;
+    uint64_t time_ns;
+    int32_t value[DEMAND_CHANNELS];
+};
+
+// Write a demand of the given number of channels, in units of
+// 1/DEMAND_SCALE percent, and wake the controller. For the local process;
+// must only be called from one thread.
+static inline void localWrite(struct local_block *block, const int32_t *value, unsigned int channels) {
+    unsigned int seq = atomic_load_explicit(&block->seq, memory_order_relaxed);
+    atomic_store_explicit(&block->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    block->sequence++;
+    block->channels = channels;
+    block->time_ns = monotonicNanos();
+    for (unsigned int i = 0; i < channels && i < DEMAND_CHANNELS; i++) {
+        block->value[i] = value[i];
+    }
+    atomic_store_explicit(&block->seq, seq + 2, memory_order_release);
+    atomic_fetch_add_explicit(&block->doorbell, 1, memory_order_release);
+    syscall(SYS_futex, &block->doorbell, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+// Controller side. Create the shared memory object with the given name,
+// e.g. "/udp_servo_control", and an eventfd that becomes readable whenever
+// the doorbell rings. Returns 0 on success.
+int localInit(const char *name);
+
+// Start and stop the thread that waits on the doorbell. It runs at the
+// given real-time priority if realtime is set.
+int localStart(bool realtime, int priority, int cpu);
+void localStop(void);
+
+// eventfd to wait on for new local demands, or -1 if there is no block,
+// and the block's name
+int localEventFd(void);
+const char *localName(void);
+
+// Read the latest demand, if there is a new one, into out, with the time
+// it was written. Returns false if there is nothing new or the block holds
+// an invalid demand, in which case *invalid is set.
+bool localRead(struct packet *out, uint64_t *written_ns, bool *invalid);
+
+// Remove the shared memory object
+void localCleanup(void);
+
+#endif // LOCAL_H
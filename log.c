@@ -0,0 +1,187 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Non-blocking logging.
+
+#define _GNU_SOURCE
+#include "log.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+// Number of slots in the ring, which must be a power of two, and the
+// longest message each can hold
+#define LOG_RING_SLOTS 256
+#define LOG_MESSAGE_LEN 120
+// How often the drain thread wakes up
+#define LOG_DRAIN_INTERVAL_MS 20
+// Most lines printed per second; anything beyond is counted and summarised
+#define LOG_RATE_LIMIT_PER_SEC 50
+// Nice value for the drain thread
+#define LOG_THREAD_NICE 10
+
+// A slot in the ring. The sequence number says whose turn it is: a producer
+// may fill the slot when it equals the producer's ticket, and the consumer
+// may read it when it equals the ticket plus one.
+struct log_slot {
+    atomic_uint seq;
+    uint8_t level;
+    char text[LOG_MESSAGE_LEN];
+};
+
+static struct log_slot ring[LOG_RING_SLOTS];
+static atomic_uint ring_head;       // next ticket for producers
+static unsigned int ring_tail;      // next slot for the consumer
+static atomic_uint ring_dropped;    // messages lost to a full ring
+static atomic_int log_level = LOG_LEVEL_INFO;
+
+static pthread_t drain_thread;
+static atomic_bool draining;
+static void (*drain_hook)(void);
+
+// Deduplication and rate limiting state, only used by the drain thread
+static char last_text[LOG_MESSAGE_LEN];
+static uint8_t last_level;
+static unsigned int repeats;
+static time_t last_emitted;
+static time_t rate_second;
+static unsigned int rate_count, rate_suppressed;
+
+void logSetLevel(enum log_level level) {
+    atomic_store(&log_level, level);
+}
+
+bool logEnabled(enum log_level level) {
+    return (int) level <= atomic_load_explicit(&log_level, memory_order_relaxed);
+}
+
+void logMessage(enum log_level level, const char *format, ...) {
+    if (!logEnabled(level)) return;
+
+    // Claim a slot, giving up if the ring is full
+    unsigned int ticket = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    struct log_slot *slot;
+    for (;;) {
+        slot = &ring[ticket & (LOG_RING_SLOTS - 1)];
+        unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int diff = (int) (seq - ticket);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring_head, &ticket, ticket + 1,
+                    memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit(&ring_dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            ticket = atomic_load_explicit(&ring_head, memory_order_relaxed);
+        }
+    }
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(slot->text, sizeof(slot->text), format, args);
+    va_end(args);
+    slot->level = (uint8_t) level;
+    atomic_store_explicit(&slot->seq, ticket + 1, memory_order_release);
+}
+
+// Print a line, subject to the rate limit
+static void emit(uint8_t level, const char *text) {
+    time_t now = time(NULL);
+    if (now != rate_second) {
+        if (rate_suppressed > 0) {
+            fprintf(stderr, "Log rate limit: suppressed %u messages\n", rate_suppressed);
+        }
+        rate_second = now;
+        rate_count = 0;
+        rate_suppressed = 0;
+    }
+    if (++rate_count > LOG_RATE_LIMIT_PER_SEC) {
+        rate_suppressed++;
+        return;
+    }
+    fprintf((level <= LOG_LEVEL_WARNING) ? stderr : stdout, "%s\n", text);
+}
+
+// Report any repeats of the last message that have been held back
+static void flushRepeats(void) {
+    if (repeats == 0) return;
+    char text[LOG_MESSAGE_LEN + 48];
+    snprintf(text, sizeof(text), "Last message repeated %u times", repeats);
+    emit(last_level, text);
+    repeats = 0;
+    last_emitted = time(NULL);
+}
+
+// Print everything currently in the ring
+static void drain(void) {
+    for (;;) {
+        struct log_slot *slot = &ring[ring_tail & (LOG_RING_SLOTS - 1)];
+        unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq != ring_tail + 1) break;
+
+        if (slot->level == last_level && strcmp(slot->text, last_text) == 0) {
+            repeats++;
+        } else {
+            flushRepeats();
+            emit(slot->level, slot->text);
+            memcpy(last_text, slot->text, sizeof(last_text));
+            last_level = slot->level;
+            last_emitted = time(NULL);
+        }
+
+        // Hand the slot back to producers for the next lap of the ring
+        atomic_store_explicit(&slot->seq, ring_tail + LOG_RING_SLOTS, memory_order_release);
+        ring_tail++;
+    }
+
+    unsigned int dropped = atomic_exchange_explicit(&ring_dropped, 0, memory_order_relaxed);
+    if (dropped > 0) {
+        fprintf(stderr, "Log ring full: dropped %u messages\n", dropped);
+    }
+}
+
+static void *drainThread(__attribute__ ((unused)) void *arg) {
+    setpriority(PRIO_PROCESS, (id_t) gettid(), LOG_THREAD_NICE);
+    struct timespec interval = { .tv_sec = 0, .tv_nsec = LOG_DRAIN_INTERVAL_MS * 1000000L };
+    while (atomic_load(&draining)) {
+        drain();
+        // A message that keeps repeating is summarised once a second
+        if (repeats > 0 && time(NULL) != last_emitted) flushRepeats();
+        if (drain_hook != NULL) drain_hook();
+        fflush(stdout);
+        fflush(stderr);
+        nanosleep(&interval, NULL);
+    }
+    drain();
+    flushRepeats();
+    fflush(stdout);
+    fflush(stderr);
+    return NULL;
+}
+
+int logStart(void (*hook)(void)) {
+    for (unsigned int i = 0; i < LOG_RING_SLOTS; i++) {
+        atomic_store(&ring[i].seq, i);
+    }
+    atomic_store(&ring_head, 0);
+    ring_tail = 0;
+    drain_hook = hook;
+    atomic_store(&draining, true);
+    if (pthread_create(&drain_thread, NULL, drainThread, NULL)) {
+        atomic_store(&draining, false);
+        return -1;
+    }
+    return 0;
+}
+
+void logStop(void) {
+    if (!atomic_load(&draining)) return;
+    atomic_store(&draining, false);
+    pthread_join(drain_thread, NULL);
+}
@@ -0,0 +1,51 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Non-blocking logging.
+//
+// logMessage() formats into a slot of a fixed-size in-memory ring and
+// returns straight away; it never locks, never allocates and never touches
+// stdio, so it is safe to call from the control path. A low-priority thread
+// drains the ring to stdout/stderr. If the ring is ever full the message is
+// dropped and counted rather than blocking the caller.
+//
+// The drain thread collapses runs of identical messages into a single
+// "repeated" line, and limits how many lines per second it prints, so that
+// a fault reported on every servo tick cannot flood the journal.
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdbool.h>
+
+enum log_level {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG
+};
+
+// Set the most verbose level that will be logged. Messages below it are
+// discarded by logMessage() before any formatting is done.
+void logSetLevel(enum log_level level);
+
+// Returns true if messages at the given level are being logged, for callers
+// that need to do extra work to build a message
+bool logEnabled(enum log_level level);
+
+// Start the drain thread. This must be called before anything is logged.
+// hook, if not NULL, is called from the drain thread every time it wakes,
+// which makes it a convenient place for other slow, non-urgent output.
+// Returns 0 on success.
+int logStart(void (*hook)(void));
+
+// Stop the drain thread after printing everything still in the ring
+void logStop(void);
+
+// Log a message, printf-style. A trailing newline is not needed.
+void logMessage(enum log_level level, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+
+#define logError(...) logMessage(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define logWarning(...) logMessage(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define logInfo(...) logMessage(LOG_LEVEL_INFO, __VA_ARGS__)
+#define logDebug(...) logMessage(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+#endif // LOG_H
@@ -0,0 +1,377 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Counters and gauges for fleet monitoring, see metrics.h.
+
+#define _GNU_SOURCE
+#include "metrics.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include "demand.h"
+#include "log.h"
+
+// Scheduling priority of the exporter, well below the control path
+#define METRICS_THREAD_NICE 10
+// Longest the exporter waits in one poll, when there is no StatsD push due
+#define METRICS_POLL_MS 200
+// Time a scrape may take before it is dropped
+#define METRICS_HTTP_TIMEOUT_MS 1000
+// Largest StatsD datagram, to stay inside one Ethernet frame
+#define METRICS_STATSD_DATAGRAM 1400
+#define METRICS_MAX_HISTOGRAMS 8
+#define METRICS_PREFIX "udp_servo_control"
+
+struct metrics_block metrics[METRICS_WRITERS];
+
+// How each metric is exported. Values are multiplied by scale, so that
+// they are in base units.
+struct metric_info {
+    const char *name;
+    const char *help;
+    bool gauge;
+    double scale;
+};
+
+static const struct metric_info info[METRIC_COUNT] = {
+    [METRIC_PACKETS_RECEIVED] = { "packets_received_total", "Packets and shared memory demands received", false, 1 },
+    [METRIC_PACKETS_ACCEPTED] = { "packets_accepted_total", "Valid demands taken into the source table", false, 1 },
+    [METRIC_PARSE_ERRORS] = { "parse_errors_total", "Packets rejected as malformed or out of range", false, 1 },
+    [METRIC_AUTH_FAILURES] = { "auth_failures_total", "Packets rejected for a missing or invalid authentication tag", false, 1 },
+    [METRIC_PACKETS_REPLAYED] = { "packets_replayed_total", "Authenticated packets rejected as replays", false, 1 },
+    [METRIC_PACKETS_STALE] = { "packets_stale_total", "Packets older than the newest from the same source", false, 1 },
+    [METRIC_PACKETS_UNKNOWN] = { "packets_unknown_total", "Packets from senders that are not allowed", false, 1 },
+    [METRIC_PACKETS_SUPERSEDED] = { "packets_superseded_total", "Valid demands replaced by a newer one before being handed off", false, 1 },
+    [METRIC_DEMANDS_HANDED_OFF] = { "demands_handed_off_total", "Demands handed to the servo loop", false, 1 },
+    [METRIC_CONTROL_CHANGES] = { "control_changes_total", "Times a different controller took control", false, 1 },
+    [METRIC_TELEMETRY_SENT] = { "telemetry_sent_total", "Reports and acks sent", false, 1 },
+    [METRIC_TELEMETRY_ERRORS] = { "telemetry_errors_total", "Failed telemetry sends", false, 1 },
+    [METRIC_ACKS_DROPPED] = { "acks_dropped_total", "Acks not sent because too many were queued", false, 1 },
+    [METRIC_SERVO_TICKS] = { "servo_ticks_total", "Keep-alive ticks handled", false, 1 },
+    [METRIC_SERVO_TICKS_MISSED] = { "servo_ticks_missed_total", "Ticks that passed unhandled because the loop overran", false, 1 },
+    [METRIC_SERVO_TICKS_LATE] = { "servo_ticks_late_total", "Ticks handled more than the late threshold after their deadline", false, 1 },
+    [METRIC_SERVO_OVER_BUDGET] = { "servo_over_budget_total", "Servo passes whose work took too much of the period", false, 1 },
+    [METRIC_SERVO_WORST_LATE_NS] = { "servo_worst_late_seconds", "Worst tick lateness seen", true, 1e-9 },
+    [METRIC_PULSES_BUSY] = { "pulses_busy_total", "Pulses skipped because the channel's previous pulse was still running", false, 1 },
+    [METRIC_FAILSAFE_EVENTS] = { "failsafe_events_total", "Times the failsafe engaged", false, 1 },
+    [METRIC_POWER_CUT_EVENTS] = { "power_cut_events_total", "Times the servo power rail was cut", false, 1 },
+    [METRIC_FAILSAFE] = { "failsafe", "1 while a channel is in failsafe", true, 1 },
+    [METRIC_POWER_CUT] = { "power_cut", "1 while the servo power rail is cut", true, 1 },
+    [METRIC_LATENCY_US] = { "latency_seconds", "Packet arrival to first pulse for the newest demand", true, 1e-6 },
+    [METRIC_BATTERY_MV] = { "battery_volts", "Filtered battery voltage", true, 1e-3 },
+    [METRIC_JACK_MV] = { "jack_volts", "Filtered DC jack voltage", true, 1e-3 },
+    [METRIC_BATTERY_LOW] = { "battery_low", "1 while the battery is low", true, 1 },
+    [METRIC_SERVO_STALLS] = { "servo_stalls_total", "Times the health monitor found the servo loop stalled", false, 1 },
+    [METRIC_COMMS_STALLS] = { "comms_stalls_total", "Times the health monitor found the comms thread stalled", false, 1 },
+    [METRIC_IMU_SAMPLES] = { "imu_samples_total", "IMU samples taken for heading hold", false, 1 },
+    [METRIC_HEADING] = { "heading_degrees", "Heading from the IMU, with the offset applied", true, 1e-2 },
+    [METRIC_HEADING_OPEN_LOOP] = { "heading_open_loop_total", "Times heading hold fell back to open loop for want of an IMU heading", false, 1 },
+};
+
+struct exported_histogram {
+    const char *name;
+    const char *help;
+    struct histogram *h;
+};
+
+static struct exported_histogram histograms[METRICS_MAX_HISTOGRAMS];
+static unsigned int histogram_count;
+static struct metrics_config config;
+static struct sockaddr_storage statsd_address;
+static int http_fd = -1;
+static int statsd_fd = -1;
+// Written by metricsStop() to wake the exporter from any wait
+static int stop_fd = -1;
+static atomic_bool exporting;
+static pthread_t export_thread;
+// Big enough for every metric and histogram in the text format
+static char page[32768];
+static char statsd_prefix[128];
+
+uint64_t metricGet(enum metric m) {
+    uint64_t sum = 0;
+    for (int w = 0; w < METRICS_WRITERS; w++) {
+        sum += atomic_load_explicit(&metrics[w].value[m], memory_order_relaxed);
+    }
+    return sum;
+}
+
+void metricsAddHistogram(const char *name, const char *help, struct histogram *h) {
+    if (histogram_count == METRICS_MAX_HISTOGRAMS) return;
+    histograms[histogram_count++] = (struct exported_histogram) { name, help, h };
+}
+
+// Append to the page, returning the new length, which stops growing once
+// the page is full
+static size_t append(size_t len, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+static size_t append(size_t len, const char *format, ...) {
+    if (len >= sizeof(page)) return len;
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(page + len, sizeof(page) - len, format, args);
+    va_end(args);
+    return (n > 0) ? len + (size_t) n : len;
+}
+
+// Render every metric in the Prometheus text format into page
+static size_t renderPrometheus(void) {
+    size_t len = 0;
+    for (int m = 0; m < METRIC_COUNT; m++) {
+        const struct metric_info *i = &info[m];
+        len = append(len, "# HELP " METRICS_PREFIX "_%s %s\n# TYPE " METRICS_PREFIX "_%s %s\n" METRICS_PREFIX "_%s %.9g\n",
+                i->name, i->help, i->name, i->gauge ? "gauge" : "counter", i->name, (double) metricGet(m) * i->scale);
+    }
+    // Buckets are cumulative in Prometheus, and bucket n of a histogram
+    // counts samples under 2^n us
+    for (unsigned int k = 0; k < histogram_count; k++) {
+        const struct exported_histogram *e = &histograms[k];
+        len = append(len, "# HELP " METRICS_PREFIX "_%s %s\n# TYPE " METRICS_PREFIX "_%s histogram\n",
+                e->name, e->help, e->name);
+        uint64_t cumulative = 0;
+        for (int b = 0; b < HISTOGRAM_BUCKETS - 1; b++) {
+            cumulative += atomic_load_explicit(&e->h->bucket[b], memory_order_relaxed);
+            len = append(len, METRICS_PREFIX "_%s_bucket{le=\"%g\"} %llu\n", e->name,
+                    (double) (1ULL << b) * 1e-6, (unsigned long long) cumulative);
+        }
+        cumulative += atomic_load_explicit(&e->h->bucket[HISTOGRAM_BUCKETS - 1], memory_order_relaxed);
+        len = append(len, METRICS_PREFIX "_%s_bucket{le=\"+Inf\"} %llu\n" METRICS_PREFIX "_%s_sum %.9g\n" METRICS_PREFIX "_%s_count %llu\n",
+                e->name, (unsigned long long) cumulative, e->name,
+                atomic_load_explicit(&e->h->sum_ns, memory_order_relaxed) * 1e-9,
+                e->name, (unsigned long long) cumulative);
+    }
+    return (len < sizeof(page)) ? len : sizeof(page) - 1;
+}
+
+// Wait until a scrape client is ready for events, so that a client that
+// goes quiet can never hold up the exporter. Returns false once the scrape
+// is past its deadline, or if the exporter is stopping.
+static bool waitClient(int client, short events, uint64_t deadline_ns) {
+    for (;;) {
+        uint64_t now = monotonicNanos();
+        if (now >= deadline_ns || !atomic_load(&exporting)) return false;
+        struct pollfd pfds[2] = {
+            { .fd = client, .events = events, .revents = 0 },
+            { .fd = stop_fd, .events = POLLIN, .revents = 0 }
+        };
+        int n = poll(pfds, 2, (int) ((deadline_ns - now + 999999) / 1000000));
+        if (n < 0 && errno != EINTR) return false;
+        if (n > 0) return (pfds[1].revents == 0);
+    }
+}
+
+// Write all of len bytes, or give up
+static bool writeAll(int fd, const char *buf, size_t len, uint64_t deadline_ns) {
+    while (len > 0) {
+        if (!waitClient(fd, POLLOUT, deadline_ns)) return false;
+        ssize_t n = write(fd, buf, len);
+        if (n <= 0) return false;
+        buf += n;
+        len -= (size_t) n;
+    }
+    return true;
+}
+
+// Answer one scrape. Only the request line matters; everything is sent
+// with Connection: close, so there is never more than one request.
+static void serveHttp(void) {
+    int client = accept4(http_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (client < 0) return;
+    // The whole scrape has to finish within the timeout. The socket
+    // timeouts also bound each write, which poll() only says will not block
+    // for the first byte.
+    uint64_t deadline_ns = monotonicNanos() + METRICS_HTTP_TIMEOUT_MS * 1000000ULL;
+    struct timeval timeout = { .tv_sec = METRICS_HTTP_TIMEOUT_MS / 1000, .tv_usec = (METRICS_HTTP_TIMEOUT_MS % 1000) * 1000 };
+    if (setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0
+            || setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
+        logDebug("Setting the metrics scrape timeout failed: %s", strerror(errno));
+        close(client);
+        return;
+    }
+
+    char request[1024];
+    size_t got = 0;
+    while (got < sizeof(request) - 1) {
+        if (!waitClient(client, POLLIN, deadline_ns)) {
+            close(client);
+            return;
+        }
+        ssize_t n = read(client, request + got, sizeof(request) - 1 - got);
+        if (n <= 0) break;
+        got += (size_t) n;
+        request[got] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL) break;
+    }
+    request[got] = '\0';
+
+    char header[160];
+    if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET /metrics?", 13) == 0) {
+        size_t len = renderPrometheus();
+        int n = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                "Content-Length: %zu\r\nConnection: close\r\n\r\n", len);
+        if (writeAll(client, header, (size_t) n, deadline_ns)) writeAll(client, page, len, deadline_ns);
+    } else {
+        static const char not_found[] = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        writeAll(client, not_found, sizeof(not_found) - 1, deadline_ns);
+    }
+    close(client);
+}
+
+// Push every metric to StatsD: counters as the change since the last push,
+// gauges as their value, packed several to a datagram
+static void pushStatsd(uint64_t *last) {
+    socklen_t address_len = (statsd_address.ss_family == AF_INET6)
+            ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    char datagram[METRICS_STATSD_DATAGRAM];
+    size_t len = 0;
+    for (int m = 0; m <= METRIC_COUNT; m++) {
+        char line[160] = "";
+        int n = 0;
+        if (m < METRIC_COUNT) {
+            const struct metric_info *i = &info[m];
+            uint64_t value = metricGet(m);
+            if (i->gauge) {
+                n = snprintf(line, sizeof(line), "%s.%s:%.9g|g\n", statsd_prefix, i->name, (double) value * i->scale);
+            } else {
+                n = snprintf(line, sizeof(line), "%s.%s:%llu|c\n", statsd_prefix, i->name, (unsigned long long) (value - last[m]));
+                last[m] = value;
+            }
+        }
+        // Send what there is when the datagram is full or at the end
+        if (len > 0 && (m == METRIC_COUNT || len + (size_t) n > sizeof(datagram))) {
+            if (sendto(statsd_fd, datagram, len - 1, MSG_DONTWAIT, (struct sockaddr *) &statsd_address, address_len) < 0) {
+                logDebug("Sending metrics to StatsD failed: %s", strerror(errno));
+            }
+            len = 0;
+        }
+        if (n > 0 && (size_t) n <= sizeof(datagram) - len) {
+            memcpy(datagram + len, line, (size_t) n);
+            len += (size_t) n;
+        }
+    }
+}
+
+static void *exportThread(__attribute__ ((unused)) void *arg) {
+    setpriority(PRIO_PROCESS, (id_t) gettid(), METRICS_THREAD_NICE);
+    uint64_t last[METRIC_COUNT] = { 0 };
+    uint64_t interval_ns = config.interval_ms * 1000000ULL;
+    uint64_t next_push = monotonicNanos() + interval_ns;
+    while (atomic_load(&exporting)) {
+        int timeout_ms = METRICS_POLL_MS;
+        if (statsd_fd >= 0) {
+            uint64_t now = monotonicNanos();
+            uint64_t wait_ms = (next_push > now) ? (next_push - now + 999999) / 1000000 : 0;
+            if (wait_ms < (uint64_t) timeout_ms) timeout_ms = (int) wait_ms;
+        }
+        struct pollfd pfds[2] = {
+            { .fd = stop_fd, .events = POLLIN, .revents = 0 },
+            { .fd = http_fd, .events = POLLIN, .revents = 0 }
+        };
+        if (poll(pfds, (http_fd >= 0) ? 2 : 1, timeout_ms) > 0 && (pfds[1].revents & POLLIN)) serveHttp();
+        if (statsd_fd >= 0 && monotonicNanos() >= next_push) {
+            pushStatsd(last);
+            next_push += interval_ns;
+            if (next_push < monotonicNanos()) next_push = monotonicNanos() + interval_ns;
+        }
+    }
+    return NULL;
+}
+
+// Open the scrape socket, on every IPv4 and IPv6 address
+static int openHttp(uint16_t port) {
+    int fd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    int one = 1, zero = 0;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    struct sockaddr_in6 address;
+    memset(&address, 0, sizeof(address));
+    address.sin6_family = AF_INET6;
+    address.sin6_addr = in6addr_any;
+    address.sin6_port = htons(port);
+    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) < 0 || listen(fd, 4) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int metricsStart(const struct metrics_config *c) {
+    config = *c;
+    if (config.http_port == 0 && config.statsd_address[0] == '\0') return 0;
+
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (stop_fd < 0) {
+        logError("create metrics stop eventfd failed");
+        return -1;
+    }
+
+    if (config.http_port != 0) {
+        http_fd = openHttp(config.http_port);
+        if (http_fd < 0) {
+            logError("open metrics port %u failed: %s", config.http_port, strerror(errno));
+            metricsStop();
+            return -1;
+        }
+        logInfo("Serving metrics on port %u", config.http_port);
+    }
+    if (config.statsd_address[0] != '\0') {
+        memset(&statsd_address, 0, sizeof(statsd_address));
+        struct sockaddr_in *v4 = (struct sockaddr_in *) &statsd_address;
+        struct sockaddr_in6 *v6 = (struct sockaddr_in6 *) &statsd_address;
+        if (inet_pton(AF_INET, config.statsd_address, &v4->sin_addr) == 1) {
+            v4->sin_family = AF_INET;
+            v4->sin_port = htons(config.statsd_port);
+        } else if (inet_pton(AF_INET6, config.statsd_address, &v6->sin6_addr) == 1) {
+            v6->sin6_family = AF_INET6;
+            v6->sin6_port = htons(config.statsd_port);
+        } else {
+            logError("invalid StatsD address %s", config.statsd_address);
+            metricsStop();
+            return -1;
+        }
+        statsd_fd = socket(statsd_address.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (statsd_fd < 0) {
+            logError("create StatsD socket failed");
+            metricsStop();
+            return -1;
+        }
+        // Each board needs its own names, so its hostname goes into them
+        char host[64] = "unknown";
+        gethostname(host, sizeof(host) - 1);
+        host[sizeof(host) - 1] = '\0';
+        for (char *p = host; *p != '\0'; p++) {
+            if (*p == '.' || *p == ':' || *p == '|') *p = '_';
+        }
+        snprintf(statsd_prefix, sizeof(statsd_prefix), METRICS_PREFIX ".%s", host);
+        logInfo("Pushing metrics to StatsD every %u ms as %s", config.interval_ms, statsd_prefix);
+    }
+
+    atomic_store(&exporting, true);
+    if (pthread_create(&export_thread, NULL, exportThread, NULL)) {
+        atomic_store(&exporting, false);
+        metricsStop();
+        return -1;
+    }
+    return 0;
+}
+
+void metricsStop(void) {
+    if (atomic_exchange(&exporting, false)) {
+        eventfd_write(stop_fd, 1);
+        pthread_join(export_thread, NULL);
+    }
+    if (http_fd >= 0) close(http_fd);
+    if (statsd_fd >= 0) close(statsd_fd);
+    if (stop_fd >= 0) close(stop_fd);
+    http_fd = -1;
+    statsd_fd = -1;
+    stop_fd = -1;
+}
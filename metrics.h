@@ -0,0 +1,112 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Counters and gauges for fleet monitoring.
+//
+// Every thread that updates metrics has its own cache-line aligned block,
+// and is the only writer of it, so an update is a relaxed load and store
+// with no locked instruction and no cache line bouncing between the control
+// path threads. A metric's value is the sum over every block, which lets
+// two threads count the same thing without sharing a line.
+//
+// A low-priority exporter thread reads the blocks and serves them in the
+// Prometheus text format at http://<board>:<metrics_port>/metrics, and/or
+// pushes them in batches to a StatsD server every metrics_interval_ms.
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "stats.h"
+
+// Threads that write metrics
+enum metrics_writer {
+    METRICS_COMMS,
+    METRICS_SERVO,
+    METRICS_BATTERY,
+    METRICS_HEALTH,
+    METRICS_HEADING,
+    METRICS_WRITERS
+};
+
+// Every metric. Names, units and descriptions are in metrics.c.
+enum metric {
+    // Comms thread
+    METRIC_PACKETS_RECEIVED,
+    METRIC_PACKETS_ACCEPTED,
+    METRIC_PARSE_ERRORS,
+    METRIC_AUTH_FAILURES,
+    METRIC_PACKETS_REPLAYED,
+    METRIC_PACKETS_STALE,
+    METRIC_PACKETS_UNKNOWN,
+    METRIC_PACKETS_SUPERSEDED,
+    METRIC_DEMANDS_HANDED_OFF,
+    METRIC_CONTROL_CHANGES,
+    METRIC_TELEMETRY_SENT,
+    METRIC_TELEMETRY_ERRORS,
+    METRIC_ACKS_DROPPED,
+    // Servo loop
+    METRIC_SERVO_TICKS,
+    METRIC_SERVO_TICKS_MISSED,
+    METRIC_SERVO_TICKS_LATE,
+    METRIC_SERVO_OVER_BUDGET,
+    METRIC_SERVO_WORST_LATE_NS,
+    METRIC_PULSES_BUSY,
+    METRIC_FAILSAFE_EVENTS,
+    METRIC_POWER_CUT_EVENTS,
+    METRIC_FAILSAFE,
+    METRIC_POWER_CUT,
+    METRIC_LATENCY_US,
+    // Battery monitor
+    METRIC_BATTERY_MV,
+    METRIC_JACK_MV,
+    METRIC_BATTERY_LOW,
+    // Health monitor
+    METRIC_SERVO_STALLS,
+    METRIC_COMMS_STALLS,
+    // Heading hold
+    METRIC_IMU_SAMPLES,
+    METRIC_HEADING,
+    METRIC_HEADING_OPEN_LOOP,
+    METRIC_COUNT
+};
+
+struct metrics_block {
+    _Atomic uint64_t value[METRIC_COUNT];
+} __attribute__ ((aligned (64)));
+
+extern struct metrics_block metrics[METRICS_WRITERS];
+
+// Add to a counter, or set a gauge. Must only be called from the writer's
+// own thread.
+static inline void metricAdd(enum metrics_writer writer, enum metric m, uint64_t n) {
+    _Atomic uint64_t *v = &metrics[writer].value[m];
+    atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline void metricSet(enum metrics_writer writer, enum metric m, uint64_t value) {
+    atomic_store_explicit(&metrics[writer].value[m], value, memory_order_relaxed);
+}
+
+// Current value of a metric, from any thread
+uint64_t metricGet(enum metric m);
+
+// Export a latency histogram too, under the given name in seconds. Only
+// called before metricsStart().
+void metricsAddHistogram(const char *name, const char *help, struct histogram *h);
+
+// Where to export to: an HTTP port, 0 for none, and a StatsD server's IPv4
+// or IPv6 address and port, an empty address for none
+struct metrics_config {
+    uint16_t http_port;
+    const char *statsd_address;
+    uint16_t statsd_port;
+    unsigned int interval_ms;
+};
+
+// Start and stop the exporter thread. Does nothing if there is nowhere to
+// export to. Returns 0 on success.
+int metricsStart(const struct metrics_config *config);
+void metricsStop(void);
+
+#endif // METRICS_H
@@ -0,0 +1,73 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Mixer from packet values to channel demands.
+
+#include "mixer.h"
+
+#include <string.h>
+
+int mixerInit(struct mixer *mixer, const struct channel_config *configs, const struct channel_table *table,
+        enum mixer_saturation saturation) {
+    memset(mixer, 0, sizeof(*mixer));
+    mixer->saturation = saturation;
+    mixer->outputs = table->count;
+    for (int o = 0; o < table->count; o++) {
+        mixer->lowest[o] = channelLowestDemand(table, (unsigned int) o);
+        const struct channel_config *c = &configs[o];
+        if (c->mix_count == 0) continue;
+        if (c->mix_count > table->count) return -1;
+        for (int i = 0; i < c->mix_count; i++) {
+            if (c->mix[i] > MIXER_MAX_WEIGHT || c->mix[i] < -MIXER_MAX_WEIGHT) return -1;
+            // Rounded to the nearest step of the fixed-point weight
+            int32_t scaled = c->mix[i] * (1 << MIXER_WEIGHT_SHIFT);
+            mixer->weight[o][i] = (scaled + ((scaled < 0) ? -DEMAND_FULL_SCALE / 2 : DEMAND_FULL_SCALE / 2))
+                    / DEMAND_FULL_SCALE;
+        }
+        mixer->mixed |= (uint8_t) (1 << o);
+        mixer->enabled = true;
+    }
+    return 0;
+}
+
+bool mixerUsesValue(const struct mixer *mixer, unsigned int value) {
+    if (value >= mixer->outputs) return false;
+    for (int o = 0; o < mixer->outputs; o++) {
+        if (!(mixer->mixed & (1 << o))) {
+            if ((unsigned int) o == value) return true;
+        } else if (mixer->weight[o][value] != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void mixerApply(const struct mixer *mixer, const int32_t in[CHANNEL_MAX], int32_t out[CHANNEL_MAX]) {
+    // Mix every channel, noting how far the worst mixed channel goes beyond
+    // full demand either way. Unipolar channels clip at zero rather than
+    // counting as beyond it.
+    int32_t worst = DEMAND_FULL_SCALE;
+    for (int o = 0; o < mixer->outputs; o++) {
+        if (!(mixer->mixed & (1 << o))) {
+            out[o] = in[o];
+            continue;
+        }
+        int32_t sum = 0;
+        for (int i = 0; i < mixer->outputs; i++) {
+            sum += mixer->weight[o][i] * in[i];
+        }
+        int32_t value = (sum + (1 << (MIXER_WEIGHT_SHIFT - 1))) >> MIXER_WEIGHT_SHIFT;
+        out[o] = value;
+        int32_t beyond = (value > 0 || mixer->lowest[o] == 0) ? value : -value;
+        if (beyond > worst) worst = beyond;
+    }
+
+    // Desaturate, then make sure every mixed channel is in range
+    bool scale = mixer->saturation == MIXER_SCALE && worst > DEMAND_FULL_SCALE;
+    for (int o = 0; o < mixer->outputs; o++) {
+        if (!(mixer->mixed & (1 << o))) continue;
+        int32_t value = out[o];
+        if (scale) value = value * DEMAND_FULL_SCALE / worst;
+        if (value > DEMAND_FULL_SCALE) value = DEMAND_FULL_SCALE;
+        if (value < mixer->lowest[o]) value = mixer->lowest[o];
+        out[o] = value;
+    }
+}
@@ -0,0 +1,63 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Mixer from packet values to channel demands.
+//
+// By default each channel takes the value of the same number in the packet.
+// A channel given a mix instead takes a weighted sum of packet values, so
+// that one packet of throttle and yaw can drive the two motors of a
+// twin-screw boat, e.g. left = throttle + yaw/2 and right = throttle -
+// yaw/2, or split a rudder demand across vectored thrusters.
+//
+// The mix is turned into a fixed-point matrix once when the config is
+// loaded, and applied by the servo loop in a single pass per pulse, after
+// interpolation and heading hold and before each channel's failsafe, limits
+// and pulse mapping. The packet values therefore keep the interpolation
+// setting of the channel of the same number, but not its range: while
+// mixing, every interpolated packet value may run from -100% to 100%.
+//
+// When a mix would drive a channel beyond full demand, MIXER_SCALE scales
+// every mixed channel down together until it fits, which keeps the ratio
+// between them, and so the turn, at the cost of total thrust. MIXER_CLIP
+// simply clips each channel at its limits. Either way a channel never goes
+// below its lowest demand (zero for unipolar channels).
+
+#ifndef MIXER_H
+#define MIXER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "channels.h"
+
+// Mix weights are fixed point, with 1 << MIXER_WEIGHT_SHIFT for 100%, and
+// may be up to MIXER_MAX_WEIGHT either way
+#define MIXER_WEIGHT_SHIFT 12
+#define MIXER_MAX_WEIGHT (2 * DEMAND_FULL_SCALE)
+
+enum mixer_saturation {
+    MIXER_CLIP,
+    MIXER_SCALE
+};
+
+struct mixer {
+    // False if no channel has a mix, in which case the mixer is skipped
+    bool enabled;
+    enum mixer_saturation saturation;
+    uint8_t outputs;
+    // One bit per channel with a mix of its own
+    uint8_t mixed;
+    int32_t lowest[CHANNEL_MAX];
+    int32_t weight[CHANNEL_MAX][CHANNEL_MAX];
+};
+
+// Build the mixer for a channel table from each channel's mix. Returns -1
+// if a mix takes a packet value beyond the last channel.
+int mixerInit(struct mixer *mixer, const struct channel_config *configs, const struct channel_table *table,
+        enum mixer_saturation saturation);
+
+// Whether any channel's demand depends on packet value number value,
+// counting from 0
+bool mixerUsesValue(const struct mixer *mixer, unsigned int value);
+
+// Mix packet values into channel demands
+void mixerApply(const struct mixer *mixer, const int32_t in[CHANNEL_MAX], int32_t out[CHANNEL_MAX]);
+
+#endif // MIXER_H
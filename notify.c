@@ -0,0 +1,71 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Service manager notifications, see notify.h.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "notify.h"
+
+// Socket connected to the service manager, or -1 if there is none
+static int notify_fd = -1;
+
+int notifyInit(void) {
+    const char *path = getenv("NOTIFY_SOCKET");
+    if (path == NULL || path[0] == '\0') return 0;
+
+    // A leading @ names a socket in the abstract namespace
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    size_t length = strlen(path);
+    if (length >= sizeof(address.sun_path) || (path[0] != '/' && path[0] != '@')) return -1;
+    memcpy(address.sun_path, path, length);
+    if (path[0] == '@') address.sun_path[0] = '\0';
+
+    notify_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (notify_fd < 0) return -1;
+    if (connect(notify_fd, (struct sockaddr *) &address, (socklen_t) (offsetof(struct sockaddr_un, sun_path) + length))) {
+        close(notify_fd);
+        notify_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void notifySend(const char *state) {
+    if (notify_fd < 0) return;
+    // Best effort: the service manager may have gone away, and there is
+    // nothing useful to do about it here
+    send(notify_fd, state, strlen(state), MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+void notifyStatus(const char *format, ...) {
+    if (notify_fd < 0) return;
+    char state[256] = "STATUS=";
+    va_list args;
+    va_start(args, format);
+    vsnprintf(state + 7, sizeof(state) - 7, format, args);
+    va_end(args);
+    notifySend(state);
+}
+
+uint64_t notifyWatchdogUsec(void) {
+    const char *usec = getenv("WATCHDOG_USEC");
+    if (notify_fd < 0 || usec == NULL) return 0;
+    // The watchdog may be meant for another process in the same service
+    const char *pid = getenv("WATCHDOG_PID");
+    if (pid != NULL && strtol(pid, NULL, 10) != (long) getpid()) return 0;
+    char *end;
+    unsigned long long value = strtoull(usec, &end, 10);
+    return (*end == '\0') ? (uint64_t) value : 0;
+}
+
+void notifyCleanup(void) {
+    if (notify_fd >= 0) close(notify_fd);
+    notify_fd = -1;
+}
@@ -0,0 +1,33 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Service manager notifications.
+//
+// Speaks the systemd sd_notify() protocol directly over the datagram socket
+// named in $NOTIFY_SOCKET, so that libsystemd is not needed. When not run
+// by systemd, or run as a service without Type=notify, the variable is not
+// set and every call does nothing.
+
+#ifndef NOTIFY_H
+#define NOTIFY_H
+
+#include <stdint.h>
+
+// Connect to the service manager's socket, if there is one. Called once at
+// startup, before any threads that notify are started. Returns -1 only if
+// there is a socket and it could not be reached.
+int notifyInit(void);
+
+// Send one or more newline-separated assignments, e.g. "READY=1". Safe to
+// call from any thread.
+void notifySend(const char *state);
+
+// Send a human-readable status line, as shown by systemctl status
+void notifyStatus(const char *format, ...) __attribute__ ((format (printf, 1, 2)));
+
+// The systemd watchdog timeout in microseconds, within which WATCHDOG=1
+// must be sent, or 0 if the watchdog is not enabled for this process
+uint64_t notifyWatchdogUsec(void);
+
+// Close the socket
+void notifyCleanup(void);
+
+#endif // NOTIFY_H
@@ -0,0 +1,67 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Lock-free handoff of the applied outputs from the servo loop back to the
+// comms thread, for telemetry.
+//
+// The mirror image of demand.h: a seqlock with the servo loop as its single
+// writer, so the real-time loop never waits on the network thread, and the
+// comms thread copies out a consistent state whenever a report is due.
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "demand.h"
+
+// What the servo loop last did with the outputs
+struct output_state {
+    // Newest demand applied, with its sequence number and sender timestamp
+    uint32_t sequence;
+    uint32_t sender_time_us;
+    uint8_t source;
+    // Time from that demand's arrival at the socket to its first pulse
+    uint32_t latency_us;
+    // Pulse lengths last sent on each channel, in microseconds
+    uint8_t channels;
+    uint16_t pulse_us[DEMAND_CHANNELS];
+    // Whether a channel is in failsafe, and whether the servo rail is cut
+    bool failsafe;
+    bool power_cut;
+};
+
+// Seqlock-protected slot holding the latest output state. The sequence
+// counter is odd while a write is in progress, and zero until the first
+// write.
+struct output_slot {
+    atomic_uint seq;
+    struct output_state data;
+};
+
+// Publish the output state. Must only be called from the servo loop.
+static inline void outputPublish(struct output_slot *slot, const struct output_state *o) {
+    unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->data = *o;
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+}
+
+// Read the latest output state into out. Returns false if nothing has been
+// published yet, in which case out is left untouched.
+static inline bool outputRead(struct output_slot *slot, struct output_state *out) {
+    for (;;) {
+        unsigned int before = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (before == 0) return false;
+        if (before & 1) continue;
+        struct output_state copy = slot->data;
+        atomic_thread_fence(memory_order_acquire);
+        unsigned int after = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+        if (before == after) {
+            *out = copy;
+            return true;
+        }
+    }
+}
+
+#endif // OUTPUT_H
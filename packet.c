@@ -0,0 +1,253 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Demand packet parsing.
+
+#include "packet.h"
+
+
+// Longest ASCII packet we will look at: every channel at "-100.00", commas
+// between them, a heading of ";H359.99", and a little slack for whitespace
+// and a line ending.
+#define ASCII_MAX_LEN (PACKET_MAX_CHANNELS * 8 + 8 + 8)
+
+static bool isSpace(uint8_t c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static bool isDigit(uint8_t c) {
+    return c >= '0' && c <= '9';
+}
+
+// Parse one decimal number starting at *pos, leaving *pos just after it.
+// Accepts an optional sign, up to three integer digits and any number of
+// fractional digits, rounded to two decimal places, i.e. to DEMAND_SCALE.
+// Magnitudes above max, in the same units, are out of range.
+static enum packet_status parseFixed(const uint8_t *buf, size_t len, size_t *pos, int32_t max, int32_t *out) {
+    size_t i = *pos;
+    while (i < len && isSpace(buf[i])) i++;
+
+    bool negative = false;
+    if (i < len && (buf[i] == '-' || buf[i] == '+')) {
+        negative = (buf[i] == '-');
+        i++;
+    }
+
+    int32_t whole = 0;
+    unsigned int int_digits = 0;
+    while (i < len && isDigit(buf[i])) {
+        if (++int_digits > 3) return PACKET_ERR_RANGE;
+        whole = whole * 10 + (buf[i] - '0');
+        i++;
+    }
+
+    int32_t frac = 0;
+    unsigned int frac_digits = 0;
+    bool round_up = false;
+    if (i < len && buf[i] == '.') {
+        i++;
+        while (i < len && isDigit(buf[i])) {
+            if (frac_digits < 2) {
+                frac = frac * 10 + (buf[i] - '0');
+            } else if (frac_digits == 2) {
+                round_up = (buf[i] >= '5');
+            }
+            frac_digits++;
+            i++;
+        }
+    }
+    if (int_digits == 0 && frac_digits == 0) return PACKET_ERR_SYNTAX;
+    while (frac_digits < 2) {
+        frac *= 10;
+        frac_digits++;
+    }
+
+    int32_t value = whole * DEMAND_SCALE + frac + (round_up ? 1 : 0);
+    if (value > max) return PACKET_ERR_RANGE;
+
+    while (i < len && isSpace(buf[i])) i++;
+    *pos = i;
+    *out = negative ? -value : value;
+    return PACKET_OK;
+}
+
+// ASCII format: comma-separated percentages, one per channel, e.g. "50,-12.5",
+// optionally followed by a target heading in degrees, e.g. "50,0;H270.5"
+static enum packet_status parseAscii(const uint8_t *buf, size_t len, struct packet *out) {
+    if (len > ASCII_MAX_LEN) return PACKET_ERR_TOO_LONG;
+
+    size_t pos = 0;
+    uint8_t channels = 0;
+    for (;;) {
+        if (channels == PACKET_MAX_CHANNELS) return PACKET_ERR_CHANNELS;
+        enum packet_status status = parseFixed(buf, len, &pos, DEMAND_FULL_SCALE, &out->value[channels]);
+        if (status != PACKET_OK) return status;
+        channels++;
+        if (pos == len || buf[pos] == ';') break;
+        if (buf[pos] != ',') return PACKET_ERR_SYNTAX;
+        pos++;
+    }
+
+    out->has_heading = false;
+    out->heading = 0;
+    if (pos < len) {
+        pos++;
+        if (pos == len || (buf[pos] != 'H' && buf[pos] != 'h')) return PACKET_ERR_SYNTAX;
+        pos++;
+        int32_t heading;
+        enum packet_status status = parseFixed(buf, len, &pos, PACKET_HEADING_FULL, &heading);
+        if (status != PACKET_OK) return status;
+        if (pos != len) return PACKET_ERR_SYNTAX;
+        if (heading < 0 || heading >= PACKET_HEADING_FULL) return PACKET_ERR_RANGE;
+        out->has_heading = true;
+        out->heading = (uint16_t) heading;
+    }
+
+    out->format = PACKET_FORMAT_ASCII;
+    out->has_sequence = false;
+    out->sequence = 0;
+    out->sender_time_us = 0;
+    out->channels = channels;
+    return PACKET_OK;
+}
+
+// CRC-16/CCITT-FALSE: polynomial 0x1021, initial value 0xFFFF
+static uint16_t crc16(const uint8_t *buf, size_t len) {
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= (uint16_t) (buf[i] << 8);
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? (uint16_t) ((crc << 1) ^ 0x1021) : (uint16_t) (crc << 1);
+        }
+    }
+    return crc;
+}
+
+static uint16_t readLe16(const uint8_t *p) {
+    return (uint16_t) (p[0] | (p[1] << 8));
+}
+
+static uint32_t readLe32(const uint8_t *p) {
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void writeLe16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t) v;
+    p[1] = (uint8_t) (v >> 8);
+}
+
+static void writeLe32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t) v;
+    p[1] = (uint8_t) (v >> 8);
+    p[2] = (uint8_t) (v >> 16);
+    p[3] = (uint8_t) (v >> 24);
+}
+
+// Binary format, see packet.h for the layout
+static enum packet_status parseBinary(const uint8_t *buf, size_t len, struct packet *out) {
+    if (len < PACKET_BINARY_LEN(1)) return PACKET_ERR_SYNTAX;
+    if (len > PACKET_BINARY_LEN(PACKET_MAX_CHANNELS) + PACKET_BINARY_HEADING_LEN) return PACKET_ERR_TOO_LONG;
+    if (buf[1] != PACKET_BINARY_VERSION || (buf[2] & ~PACKET_FLAG_HEADING) != 0) return PACKET_ERR_VERSION;
+    bool has_heading = (buf[2] & PACKET_FLAG_HEADING) != 0;
+    uint8_t channels = buf[3];
+    if (channels == 0 || channels > PACKET_MAX_CHANNELS) return PACKET_ERR_CHANNELS;
+    if (len != PACKET_BINARY_LEN(channels) + (has_heading ? PACKET_BINARY_HEADING_LEN : 0)) return PACKET_ERR_SYNTAX;
+    if (crc16(buf, len - 2) != readLe16(buf + len - 2)) return PACKET_ERR_CHECKSUM;
+
+    for (uint8_t i = 0; i < channels; i++) {
+        int32_t value = (int16_t) readLe16(buf + PACKET_BINARY_HEADER_LEN + 2 * i);
+        if (value > DEMAND_FULL_SCALE || value < -DEMAND_FULL_SCALE) return PACKET_ERR_RANGE;
+        out->value[i] = value;
+    }
+    out->has_heading = has_heading;
+    out->heading = 0;
+    if (has_heading) {
+        out->heading = readLe16(buf + PACKET_BINARY_HEADER_LEN + 2 * channels);
+        if (out->heading >= PACKET_HEADING_FULL) return PACKET_ERR_RANGE;
+    }
+    out->format = PACKET_FORMAT_BINARY;
+    out->has_sequence = true;
+    out->sequence = readLe32(buf + 4);
+    out->sender_time_us = readLe32(buf + 8);
+    out->channels = channels;
+    return PACKET_OK;
+}
+
+enum packet_status parsePacket(const uint8_t *buf, size_t len, struct packet *out) {
+    if (len == 0) return PACKET_ERR_EMPTY;
+    if (buf[0] == PACKET_BINARY_MAGIC) return parseBinary(buf, len, out);
+    return parseAscii(buf, len, out);
+}
+
+size_t packetEncodeBinary(const struct packet *p, uint8_t *buf, size_t len) {
+    if (p->channels == 0 || p->channels > PACKET_MAX_CHANNELS) return 0;
+    if (p->has_heading && p->heading >= PACKET_HEADING_FULL) return 0;
+    size_t total = PACKET_BINARY_LEN(p->channels) + (p->has_heading ? PACKET_BINARY_HEADING_LEN : 0);
+    if (len < total) return 0;
+
+    buf[0] = PACKET_BINARY_MAGIC;
+    buf[1] = PACKET_BINARY_VERSION;
+    buf[2] = p->has_heading ? PACKET_FLAG_HEADING : 0;
+    buf[3] = p->channels;
+    writeLe32(buf + 4, p->sequence);
+    writeLe32(buf + 8, p->sender_time_us);
+    for (uint8_t i = 0; i < p->channels; i++) {
+        if (p->value[i] > DEMAND_FULL_SCALE || p->value[i] < -DEMAND_FULL_SCALE) return 0;
+        writeLe16(buf + PACKET_BINARY_HEADER_LEN + 2 * i, (uint16_t) (int16_t) p->value[i]);
+    }
+    if (p->has_heading) writeLe16(buf + PACKET_BINARY_HEADER_LEN + 2 * p->channels, p->heading);
+    writeLe16(buf + total - 2, crc16(buf, total - 2));
+    return total;
+}
+
+size_t packetEncodeReport(const struct packet_report *r, uint8_t *buf, size_t len) {
+    if (r->channels > PACKET_MAX_CHANNELS) return 0;
+    size_t total = PACKET_REPORT_LEN(r->channels);
+    if (len < total) return 0;
+
+    buf[0] = PACKET_BINARY_MAGIC;
+    buf[1] = PACKET_BINARY_VERSION;
+    buf[2] = PACKET_FLAG_REPORT;
+    buf[3] = r->channels;
+    writeLe32(buf + 4, r->sequence);
+    writeLe32(buf + 8, r->sender_time_us);
+    writeLe32(buf + 12, r->time_us);
+    writeLe32(buf + 16, r->latency_us);
+    writeLe16(buf + 20, r->battery_mv);
+    writeLe16(buf + 22, r->jack_mv);
+    buf[24] = r->state;
+    buf[25] = 0;
+    for (uint8_t i = 0; i < r->channels; i++) {
+        writeLe16(buf + PACKET_REPORT_HEADER_LEN + 2 * i, r->pulse_us[i]);
+    }
+    writeLe16(buf + total - 2, crc16(buf, total - 2));
+    return total;
+}
+
+size_t packetEncodeAck(const struct packet_ack *a, uint8_t *buf, size_t len) {
+    if (len < PACKET_ACK_LEN) return 0;
+    buf[0] = PACKET_BINARY_MAGIC;
+    buf[1] = PACKET_BINARY_VERSION;
+    buf[2] = PACKET_FLAG_ACK;
+    buf[3] = a->state;
+    writeLe32(buf + 4, a->sequence);
+    writeLe32(buf + 8, a->sender_time_us);
+    writeLe32(buf + 12, a->held_us);
+    writeLe16(buf + PACKET_ACK_LEN - 2, crc16(buf, PACKET_ACK_LEN - 2));
+    return PACKET_ACK_LEN;
+}
+
+const char *packetStatusString(enum packet_status status) {
+    switch (status) {
+        case PACKET_OK:           return "ok";
+        case PACKET_ERR_EMPTY:    return "empty packet";
+        case PACKET_ERR_TOO_LONG: return "packet too long";
+        case PACKET_ERR_SYNTAX:   return "malformed packet";
+        case PACKET_ERR_RANGE:    return "value out of range";
+        case PACKET_ERR_CHANNELS: return "wrong number of demands";
+        case PACKET_ERR_VERSION:  return "unsupported binary packet version";
+        case PACKET_ERR_CHECKSUM: return "bad checksum";
+        case PACKET_ERR_UNAUTHENTICATED: return "not authenticated";
+        case PACKET_ERR_AUTH:     return "authentication failed";
+        case PACKET_ERR_REPLAYED: return "replayed";
+    }
+    return "unknown error";
+}
@@ -0,0 +1,155 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Demand packet parsing.
+//
+// parsePacket() is the single entry point for every packet format the
+// controller accepts. It works directly on the received bytes, never
+// allocates, never touches libc locale or string functions, and reports
+// exactly why a packet was rejected.
+
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "demand.h"
+
+// Largest number of demand values a packet can carry
+#define PACKET_MAX_CHANNELS DEMAND_CHANNELS
+
+// Binary packet layout, all fields little-endian:
+//   0     magic (PACKET_BINARY_MAGIC)
+//   1     version (PACKET_BINARY_VERSION)
+//   2     flags (PACKET_FLAG_HEADING or zero)
+//   3     number of channels N, 1 to PACKET_MAX_CHANNELS
+//   4-7   sequence number, incremented by the sender for every packet
+//   8-11  sender timestamp in microseconds, wrapping
+//   12-   N signed 16-bit demands in units of 1/DEMAND_SCALE percent
+//   next  with PACKET_FLAG_HEADING only, unsigned 16-bit target heading in
+//         units of 1/PACKET_HEADING_SCALE degrees, 0 to PACKET_HEADING_FULL-1
+//   last  CRC-16/CCITT-FALSE over all preceding bytes
+// The magic byte can never start a valid ASCII packet, which is how the two
+// formats are told apart. An ASCII packet gives a target heading after its
+// demands, e.g. "50,0;H270.5". Either format can be wrapped in an
+// authenticated envelope, see auth.h.
+#define PACKET_BINARY_MAGIC 0xB5
+#define PACKET_BINARY_VERSION 1
+#define PACKET_BINARY_HEADER_LEN 12
+#define PACKET_BINARY_LEN(channels) ((size_t) (PACKET_BINARY_HEADER_LEN + 2 * (channels) + 2))
+#define PACKET_BINARY_HEADING_LEN 2
+#define PACKET_FLAG_HEADING 0x01
+#define PACKET_HEADING_SCALE 100
+#define PACKET_HEADING_FULL (360 * PACKET_HEADING_SCALE)
+
+// Telemetry sent back to controllers uses the same framing, with a flag to
+// say which kind of message it is. These flags are never valid in a demand.
+//
+// Report, sent periodically to the controller in charge:
+//   0     magic, 1 version, 2 flags (PACKET_FLAG_REPORT), 3 channels N
+//   4-7   sequence number of the newest demand applied
+//   8-11  sender timestamp of that demand, echoed back
+//   12-15 controller's own timestamp in microseconds, wrapping
+//   16-19 latency from that demand's arrival to its first pulse, in us
+//   20-21 battery voltage in millivolts
+//   22-23 DC jack voltage in millivolts
+//   24    state bits (PACKET_STATE_...)
+//   25    reserved, zero
+//   26-   N unsigned 16-bit pulse lengths applied, in microseconds
+//   last  CRC-16/CCITT-FALSE
+//
+// Ack, sent for every valid demand when acks are turned on:
+//   0     magic, 1 version, 2 flags (PACKET_FLAG_ACK), 3 state bits
+//   4-7   sequence number of the demand
+//   8-11  sender timestamp of the demand, echoed back
+//   12-15 time the demand spent in the controller before the ack, in us
+//   16-17 CRC-16/CCITT-FALSE
+// With the echoed timestamp the sender can measure the round trip time.
+#define PACKET_FLAG_REPORT 0x80
+#define PACKET_FLAG_ACK 0x40
+#define PACKET_REPORT_HEADER_LEN 26
+#define PACKET_REPORT_LEN(channels) ((size_t) (PACKET_REPORT_HEADER_LEN + 2 * (channels) + 2))
+#define PACKET_ACK_LEN 18
+
+// Report and ack state bits
+#define PACKET_STATE_FAILSAFE 0x01      // a channel is in failsafe
+#define PACKET_STATE_POWER_CUT 0x02     // the servo power rail is cut
+#define PACKET_STATE_BATTERY_LOW 0x04   // the battery is low
+#define PACKET_STATE_IN_CONTROL 0x08    // the recipient is in control
+
+struct packet_report {
+    uint32_t sequence;
+    uint32_t sender_time_us;
+    uint32_t time_us;
+    uint32_t latency_us;
+    uint16_t battery_mv;
+    uint16_t jack_mv;
+    uint8_t state;
+    uint8_t channels;
+    uint16_t pulse_us[PACKET_MAX_CHANNELS];
+};
+
+struct packet_ack {
+    uint32_t sequence;
+    uint32_t sender_time_us;
+    uint32_t held_us;
+    uint8_t state;
+};
+
+// Result of parsing a packet
+enum packet_status {
+    PACKET_OK = 0,
+    PACKET_ERR_EMPTY,       // zero-length packet
+    PACKET_ERR_TOO_LONG,    // longer than any valid packet
+    PACKET_ERR_SYNTAX,      // not a well-formed number list
+    PACKET_ERR_RANGE,       // a value lies outside +/-100%, or a bad heading
+    PACKET_ERR_CHANNELS,    // wrong number of values
+    PACKET_ERR_VERSION,     // unsupported binary version or flags
+    PACKET_ERR_CHECKSUM,    // binary CRC mismatch
+    PACKET_ERR_UNAUTHENTICATED, // not in an authenticated envelope (auth.h)
+    PACKET_ERR_AUTH,        // unknown key or wrong authentication tag
+    PACKET_ERR_REPLAYED     // authentication counter already used
+};
+
+// Packet formats
+enum packet_format {
+    PACKET_FORMAT_ASCII,
+    PACKET_FORMAT_BINARY
+};
+
+// Contents of a successfully parsed packet. Values are fixed point, in
+// units of 1/DEMAND_SCALE percent. Only the first "channels" values are set.
+struct packet {
+    enum packet_format format;
+    // Sequence number and sender timestamp, only set if has_sequence is true
+    bool has_sequence;
+    uint32_t sequence;
+    uint32_t sender_time_us;
+    uint8_t channels;
+    int32_t value[PACKET_MAX_CHANNELS];
+    // Target heading for heading hold, only set if has_heading is true
+    bool has_heading;
+    uint16_t heading;
+};
+
+// Parse len bytes from buf into out. out is only valid if PACKET_OK is
+// returned.
+enum packet_status parsePacket(const uint8_t *buf, size_t len, struct packet *out);
+
+// Encode a packet in the binary format. Returns the number of bytes written,
+// or 0 if buf is too small or the packet cannot be represented.
+size_t packetEncodeBinary(const struct packet *p, uint8_t *buf, size_t len);
+
+// Encode a report or an ack. Return the number of bytes written, or 0 if
+// buf is too small.
+size_t packetEncodeReport(const struct packet_report *r, uint8_t *buf, size_t len);
+size_t packetEncodeAck(const struct packet_ack *a, uint8_t *buf, size_t len);
+
+// Returns true if sequence number a is newer than b, allowing for wrap
+static inline bool packetSequenceNewer(uint32_t a, uint32_t b) {
+    return (int32_t) (a - b) > 0;
+}
+
+// Short human-readable description of a parse status
+const char *packetStatusString(enum packet_status status);
+
+#endif // PACKET_H
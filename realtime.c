@@ -0,0 +1,57 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Real-time scheduling support for the control path.
+
+#define _GNU_SOURCE
+#include "realtime.h"
+
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "log.h"
+
+// Largest stack area realtimePrefaultStack() will touch
+#define PREFAULT_MAX_BYTES (256 * 1024)
+
+int realtimeLockMemory(void) {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        logError("mlockall failed: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int realtimeSetCurrentThread(const char *name, int priority, int cpu) {
+    int result = 0;
+
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err) {
+        logError("%s thread: SCHED_FIFO priority %d failed: %s", name, priority, strerror(err));
+        result = -1;
+    }
+
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err) {
+            logError("%s thread: pinning to CPU %d failed: %s", name, cpu, strerror(err));
+            result = -1;
+        }
+    }
+    return result;
+}
+
+void realtimePrefaultStack(size_t bytes) {
+    if (bytes == 0) return;
+    if (bytes > PREFAULT_MAX_BYTES) bytes = PREFAULT_MAX_BYTES;
+    unsigned char stack[PREFAULT_MAX_BYTES];
+    memset(stack, 0, bytes);
+    // Stop the compiler from optimising the writes away
+    __asm__ __volatile__("" : : "r" (stack) : "memory");
+}
@@ -0,0 +1,26 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Real-time scheduling support for the control path.
+//
+// All of these are best-effort: each reports whether it worked, so that the
+// controller can say so at startup and carry on with normal scheduling if
+// it is not running with the privileges needed.
+
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <stddef.h>
+
+// Lock all current and future pages into memory so the control path never
+// takes a page fault. Returns 0 on success.
+int realtimeLockMemory(void);
+
+// Switch the calling thread to SCHED_FIFO at the given priority, and pin it
+// to the given CPU unless cpu is negative. Returns 0 on success; name is
+// used to report failures.
+int realtimeSetCurrentThread(const char *name, int priority, int cpu);
+
+// Touch the given number of bytes of the calling thread's stack, so that
+// with memory locked it is all resident before the thread starts real work
+void realtimePrefaultStack(size_t bytes);
+
+#endif // REALTIME_H
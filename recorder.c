@@ -0,0 +1,242 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Flight recorder.
+
+#define _GNU_SOURCE
+#include "recorder.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include "log.h"
+
+// Number of records the ring holds, which must be a power of two. At a
+// 400 Hz servo rate and 1000 demands a second, this is nearly three seconds.
+#define RECORDER_RING_SLOTS 4096
+// How often the writer thread empties the ring, and how often it syncs the
+// file to storage
+#define RECORDER_FLUSH_MS 50
+#define RECORDER_SYNC_MS 1000
+// Nice value for the writer thread
+#define RECORDER_THREAD_NICE 10
+
+_Static_assert(sizeof(struct recorder_record) == 64, "recorder records must be 64 bytes");
+_Static_assert(sizeof(struct recorder_segment) == 64, "recorder segment headers must be 64 bytes");
+
+// A slot in the ring, handed between producers and the writer thread by
+// sequence number in the same way as the log ring
+struct recorder_slot {
+    atomic_uint seq;
+    struct recorder_record record;
+};
+
+static struct recorder_slot ring[RECORDER_RING_SLOTS];
+static atomic_uint ring_head;
+static unsigned int ring_tail;
+static atomic_uint ring_dropped;
+static atomic_bool recording;
+static pthread_t writer_thread;
+
+// The recorder file and the segment being filled, only used by the writer
+// thread once it has started
+static int file_fd = -1;
+static unsigned int segment_slots;
+static unsigned int segment_slot;
+static uint32_t segment_index;
+static struct recorder_segment *segment;
+static struct recorder_record *segment_records;
+static uint64_t run_ns;
+static uint32_t dropped_total;
+
+static uint64_t clockNanos(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+// Map the next slot in the file as a new, empty segment. Returns 0 on
+// success.
+static int startSegment(void) {
+    off_t offset = (off_t) segment_slot * RECORDER_SEGMENT_BYTES;
+    struct stat st;
+    if (fstat(file_fd, &st) == 0 && st.st_size < offset + RECORDER_SEGMENT_BYTES) {
+        int err = posix_fallocate(file_fd, offset, RECORDER_SEGMENT_BYTES);
+        if (err) {
+            logError("extend recorder file failed: %s", strerror(err));
+            return -1;
+        }
+    }
+    void *mapped = mmap(NULL, RECORDER_SEGMENT_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, file_fd, offset);
+    if (mapped == MAP_FAILED) {
+        logError("map recorder segment failed: %s", strerror(errno));
+        return -1;
+    }
+    segment = mapped;
+    segment_records = (struct recorder_record *) (segment + 1);
+
+    // Clear the magic first, so a segment being reused is never mistaken
+    // for a complete one with a half-written header
+    segment->magic = 0;
+    segment->version = RECORDER_VERSION;
+    segment->record_size = sizeof(struct recorder_record);
+    segment->index = segment_index;
+    segment->count = 0;
+    segment->run_ns = run_ns;
+    segment->realtime_ns = clockNanos(CLOCK_REALTIME);
+    segment->monotonic_ns = clockNanos(CLOCK_MONOTONIC);
+    segment->dropped = dropped_total;
+    memset(segment->reserved, 0, sizeof(segment->reserved));
+    atomic_thread_fence(memory_order_release);
+    segment->magic = RECORDER_MAGIC;
+    return 0;
+}
+
+// Sync and unmap the current segment, and move on to the next slot
+static void finishSegment(void) {
+    if (segment == NULL) return;
+    msync(segment, RECORDER_SEGMENT_BYTES, MS_SYNC);
+    munmap(segment, RECORDER_SEGMENT_BYTES);
+    segment = NULL;
+    segment_slot = (segment_slot + 1) % segment_slots;
+    segment_index++;
+}
+
+// Move everything in the ring into the file. Returns false if the file
+// could not be written, in which case recording stops.
+static bool flush(void) {
+    for (;;) {
+        struct recorder_slot *slot = &ring[ring_tail & (RECORDER_RING_SLOTS - 1)];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != ring_tail + 1) break;
+
+        if (segment != NULL && segment->count == RECORDER_SEGMENT_RECORDS) finishSegment();
+        if (segment == NULL && startSegment()) return false;
+        segment_records[segment->count] = slot->record;
+        atomic_thread_fence(memory_order_release);
+        segment->count++;
+
+        atomic_store_explicit(&slot->seq, ring_tail + RECORDER_RING_SLOTS, memory_order_release);
+        ring_tail++;
+    }
+
+    unsigned int dropped = atomic_exchange_explicit(&ring_dropped, 0, memory_order_relaxed);
+    if (dropped > 0) {
+        dropped_total += dropped;
+        if (segment != NULL) segment->dropped = dropped_total;
+        logWarning("Recorder ring full: dropped %u records", dropped);
+    }
+    return true;
+}
+
+static void *writerThread(__attribute__ ((unused)) void *arg) {
+    setpriority(PRIO_PROCESS, (id_t) gettid(), RECORDER_THREAD_NICE);
+    struct timespec interval = { .tv_sec = 0, .tv_nsec = RECORDER_FLUSH_MS * 1000000L };
+    unsigned int since_sync_ms = 0;
+    bool ok = true;
+    while (ok && atomic_load(&recording)) {
+        ok = flush();
+        since_sync_ms += RECORDER_FLUSH_MS;
+        if (since_sync_ms >= RECORDER_SYNC_MS && segment != NULL) {
+            msync(segment, RECORDER_SEGMENT_BYTES, MS_SYNC);
+            since_sync_ms = 0;
+        }
+        nanosleep(&interval, NULL);
+    }
+    if (ok) {
+        flush();
+    } else {
+        logError("Recorder stopped");
+        atomic_store(&recording, false);
+    }
+    return NULL;
+}
+
+// Find the newest segment already in the file, so that recording carries on
+// after it
+static void findNewest(void) {
+    segment_slot = 0;
+    segment_index = 0;
+    bool found = false;
+    uint32_t newest = 0;
+    for (unsigned int i = 0; i < segment_slots; i++) {
+        struct recorder_segment header;
+        if (pread(file_fd, &header, sizeof(header), (off_t) i * RECORDER_SEGMENT_BYTES) != sizeof(header)) break;
+        if (header.magic != RECORDER_MAGIC || header.version < RECORDER_VERSION_OLDEST
+                || header.version > RECORDER_VERSION) continue;
+        if (!found || (int32_t) (header.index - newest) > 0) {
+            newest = header.index;
+            segment_slot = (i + 1) % segment_slots;
+            found = true;
+        }
+    }
+    if (found) segment_index = newest + 1;
+}
+
+int recorderStart(const char *path, unsigned int max_mb) {
+    segment_slots = (unsigned int) ((uint64_t) max_mb * 1024 * 1024 / RECORDER_SEGMENT_BYTES);
+    if (segment_slots < 2) {
+        logError("recorder file needs room for at least two segments");
+        return -1;
+    }
+    file_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (file_fd < 0) {
+        logError("open recorder file %s failed: %s", path, strerror(errno));
+        return -1;
+    }
+    findNewest();
+    run_ns = clockNanos(CLOCK_REALTIME);
+
+    for (unsigned int i = 0; i < RECORDER_RING_SLOTS; i++) {
+        atomic_store(&ring[i].seq, i);
+    }
+    atomic_store(&ring_head, 0);
+    ring_tail = 0;
+    atomic_store(&ring_dropped, 0);
+    atomic_store(&recording, true);
+    if (pthread_create(&writer_thread, NULL, writerThread, NULL)) {
+        atomic_store(&recording, false);
+        close(file_fd);
+        file_fd = -1;
+        return -1;
+    }
+    logInfo("Recording to %s from segment %u", path, segment_index);
+    return 0;
+}
+
+void recorderStop(void) {
+    if (file_fd < 0) return;
+    atomic_store(&recording, false);
+    pthread_join(writer_thread, NULL);
+    finishSegment();
+    close(file_fd);
+    file_fd = -1;
+}
+
+void recorderWrite(const struct recorder_record *r) {
+    if (!atomic_load_explicit(&recording, memory_order_relaxed)) return;
+
+    // Claim a slot, giving up if the ring is full
+    unsigned int ticket = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    struct recorder_slot *slot;
+    for (;;) {
+        slot = &ring[ticket & (RECORDER_RING_SLOTS - 1)];
+        unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int diff = (int) (seq - ticket);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring_head, &ticket, ticket + 1,
+                    memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit(&ring_dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            ticket = atomic_load_explicit(&ring_head, memory_order_relaxed);
+        }
+    }
+    slot->record = *r;
+    atomic_store_explicit(&slot->seq, ticket + 1, memory_order_release);
+}
@@ -0,0 +1,112 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Flight recorder.
+//
+// Every demand accepted by the comms thread and every pass of the servo
+// loop is recorded as a fixed-size record. recorderWrite() copies the
+// record into a preallocated in-memory ring and returns straight away; like
+// logMessage(), it never locks, allocates or makes a system call, so it is
+// safe on the control path. If the ring is ever full, the record is counted
+// as dropped rather than blocking the caller.
+//
+// A low-priority thread moves records from the ring into the recorder file
+// through a memory mapping, one fixed-size segment at a time. Segments are
+// only ever appended to, each starting with a header saying what is in it,
+// and the file is a circle of them: once it reaches its size limit, the
+// oldest segment is reused. Recording carries on from the newest segment
+// across restarts, so nothing from before a crash is overwritten until the
+// file comes round to it again. The mapping is synced to storage once a
+// second.
+//
+// tools/recorder_decode turns a recorder file into CSV.
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "demand.h"
+
+// Size of each segment of the recorder file, including its header
+#define RECORDER_SEGMENT_BYTES (1024 * 1024)
+
+#define RECORDER_MAGIC 0x43455255
+// Version 2 added the flags and heading to demand records. Version 1 files
+// have the same layout with those left zero, and can still be read.
+#define RECORDER_VERSION 2
+#define RECORDER_VERSION_OLDEST 1
+
+// Kinds of record
+enum recorder_type {
+    RECORDER_DEMAND = 1,    // demand accepted from a source by the comms thread
+    RECORDER_OUTPUT = 2     // pass of the servo loop
+};
+
+// Demand record flags, saying how the demand arrived
+#define RECORDER_FLAG_BINARY 0x01     // in the binary format, not ASCII
+#define RECORDER_FLAG_SEQUENCE 0x02   // with a sequence number and timestamp
+#define RECORDER_FLAG_HEADING 0x04    // with a target heading
+
+// One record, in native byte order. 64 bytes, so that records never
+// straddle a cache line.
+struct recorder_record {
+    // CLOCK_MONOTONIC time, in nanoseconds
+    uint64_t time_ns;
+    uint8_t type;
+    // Index of the source in the source table
+    uint8_t source;
+    uint8_t channels;
+    // PACKET_STATE_... bits, for output records
+    uint8_t state;
+    // Sequence number and sender timestamp of the demand
+    uint32_t sequence;
+    uint32_t sender_time_us;
+    // For output records, latency from the demand's arrival to its first
+    // pulse, in microseconds
+    uint32_t latency_us;
+    // Demand as received, in units of 1/DEMAND_SCALE percent
+    int16_t demand[DEMAND_CHANNELS];
+    // For output records, pulse lengths applied in microseconds
+    uint16_t pulse_us[DEMAND_CHANNELS];
+    // For demand records, RECORDER_FLAG_... bits, and the target heading in
+    // units of 1/PACKET_HEADING_SCALE degrees if RECORDER_FLAG_HEADING is set
+    uint8_t flags;
+    uint8_t reserved1;
+    uint16_t heading;
+    uint8_t reserved[4];
+};
+
+// Header at the start of every segment
+struct recorder_segment {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    // Increases by one for every segment written to the file, so that the
+    // segments can be put back in order
+    uint32_t index;
+    // Records in this segment so far
+    uint32_t count;
+    // CLOCK_REALTIME time at which this run of the controller started, in
+    // nanoseconds, which tells runs apart
+    uint64_t run_ns;
+    // CLOCK_REALTIME and CLOCK_MONOTONIC times together when the segment
+    // was started, to turn record times into wall clock times
+    uint64_t realtime_ns;
+    uint64_t monotonic_ns;
+    // Records lost to a full ring in this run, up to this segment
+    uint32_t dropped;
+    uint8_t reserved[20];
+};
+
+#define RECORDER_SEGMENT_RECORDS ((RECORDER_SEGMENT_BYTES - sizeof(struct recorder_segment)) / sizeof(struct recorder_record))
+
+// Open the recorder file at path, limited to max_mb megabytes, and start
+// the thread that writes to it. Returns 0 on success.
+int recorderStart(const char *path, unsigned int max_mb);
+
+// Write out everything still in the ring, stop the thread and close the file
+void recorderStop(void);
+
+// Record r, if the recorder is running. Never blocks.
+void recorderWrite(const struct recorder_record *r);
+
+#endif // RECORDER_H
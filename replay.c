@@ -0,0 +1,384 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Replay of recorded packet streams.
+
+#define _GNU_SOURCE
+#include "replay.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include "controller.h"
+#include "packet.h"
+#include "recorder.h"
+#include "stats.h"
+#include "log.h"
+
+// Gaps longer than this between packets, e.g. between runs in a recorder
+// file, are shortened to it
+#define REPLAY_MAX_GAP_MS 5000
+// How long to keep running after the last packet, so that its effects
+// reach the servos and the failsafe has a chance to act
+#define REPLAY_TAIL_MS 1000
+// At full speed, packets replayed between checks for signals
+#define REPLAY_CHECK_INTERVAL 256
+// Largest packet captured that will be looked at
+#define REPLAY_MAX_CAPTURE 65536
+
+// pcap file header magic numbers, for microsecond and nanosecond timestamps
+#define PCAP_MAGIC_US 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+// pcap link types
+#define LINKTYPE_NULL 0
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LOOP 108
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_LINUX_SLL2 276
+
+// A segment of a recorder file, and where it is in the file
+struct replay_segment {
+    long offset;
+    struct recorder_segment header;
+};
+
+// Where packets are coming from
+struct replay_reader {
+    FILE *file;
+    bool pcap;
+    // pcap
+    bool swapped;
+    bool nanoseconds;
+    uint32_t linktype;
+    // Recorder file: segments in the order written, and the position in them
+    struct replay_segment *segments;
+    size_t segment_count;
+    size_t segment;
+    uint32_t record;
+};
+
+static struct histogram hist_lateness = HISTOGRAM_INIT("Replay lateness");
+static unsigned long replayed, skipped;
+static uint64_t replay_ns;
+static atomic_bool finished;
+
+static uint32_t swap32(uint32_t v, bool swapped) {
+    return swapped ? __builtin_bswap32(v) : v;
+}
+
+static uint16_t read16(const uint8_t *p) {
+    return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+static int compareSegments(const void *a, const void *b) {
+    const struct replay_segment *x = a, *y = b;
+    int32_t diff = (int32_t) (x->header.index - y->header.index);
+    return (diff > 0) - (diff < 0);
+}
+
+// Find the segments of a recorder file, in the order they were written
+static bool openRecorder(struct replay_reader *r) {
+    size_t capacity = 0;
+    for (long offset = 0;; offset += RECORDER_SEGMENT_BYTES) {
+        struct recorder_segment header;
+        if (fseek(r->file, offset, SEEK_SET) || fread(&header, sizeof(header), 1, r->file) != 1) break;
+        if (header.magic != RECORDER_MAGIC || header.version < RECORDER_VERSION_OLDEST || header.version > RECORDER_VERSION
+                || header.record_size != sizeof(struct recorder_record)) continue;
+        if (header.count > RECORDER_SEGMENT_RECORDS) header.count = RECORDER_SEGMENT_RECORDS;
+        if (r->segment_count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            r->segments = realloc(r->segments, capacity * sizeof(*r->segments));
+            if (r->segments == NULL) return false;
+        }
+        r->segments[r->segment_count].offset = offset;
+        r->segments[r->segment_count].header = header;
+        r->segment_count++;
+    }
+    qsort(r->segments, r->segment_count, sizeof(*r->segments), compareSegments);
+    return r->segment_count > 0;
+}
+
+// Open a recording, telling the format from its first bytes
+static bool openReader(struct replay_reader *r, const char *path) {
+    memset(r, 0, sizeof(*r));
+    r->file = fopen(path, "rb");
+    if (r->file == NULL) {
+        logError("open %s failed: %s", path, strerror(errno));
+        return false;
+    }
+    uint32_t header[6];
+    if (fread(header, sizeof(header), 1, r->file) == 1) {
+        uint32_t magic = header[0];
+        if (magic == PCAP_MAGIC_US || magic == PCAP_MAGIC_NS
+                || magic == __builtin_bswap32(PCAP_MAGIC_US) || magic == __builtin_bswap32(PCAP_MAGIC_NS)) {
+            r->pcap = true;
+            r->swapped = magic != PCAP_MAGIC_US && magic != PCAP_MAGIC_NS;
+            r->nanoseconds = swap32(magic, r->swapped) == PCAP_MAGIC_NS;
+            r->linktype = swap32(header[5], r->swapped) & 0xffff;
+            logInfo("Replaying pcap capture %s", path);
+            return true;
+        }
+    }
+    if (openRecorder(r)) {
+        logInfo("Replaying flight recorder file %s, %zu segments", path, r->segment_count);
+        return true;
+    }
+    logError("%s is neither a pcap capture nor a flight recorder file", path);
+    return false;
+}
+
+static void closeReader(struct replay_reader *r) {
+    if (r->file != NULL) fclose(r->file);
+    free(r->segments);
+}
+
+// Find the UDP payload in a captured frame addressed to one of the ports.
+// Returns false if it is not one.
+static bool udpPayload(const struct replay_reader *r, const struct replay_config *c, const uint8_t *frame, size_t len,
+        struct sockaddr_storage *sender, const uint8_t **payload, size_t *payload_len) {
+    // Link layer, down to the start of the IP header
+    size_t offset;
+    unsigned int protocol = 0;
+    if (r->linktype == LINKTYPE_ETHERNET) {
+        if (len < 14) return false;
+        protocol = read16(frame + 12);
+        offset = 14;
+        while (protocol == 0x8100 && len >= offset + 4) {
+            protocol = read16(frame + offset + 2);
+            offset += 4;
+        }
+    } else if (r->linktype == LINKTYPE_LINUX_SLL) {
+        if (len < 16) return false;
+        protocol = read16(frame + 14);
+        offset = 16;
+    } else if (r->linktype == LINKTYPE_LINUX_SLL2) {
+        if (len < 20) return false;
+        protocol = read16(frame);
+        offset = 20;
+    } else if (r->linktype == LINKTYPE_NULL || r->linktype == LINKTYPE_LOOP || r->linktype == LINKTYPE_RAW) {
+        offset = (r->linktype == LINKTYPE_RAW) ? 0 : 4;
+        if (len <= offset) return false;
+        protocol = ((frame[offset] >> 4) == 6) ? 0x86dd : 0x0800;
+    } else {
+        return false;
+    }
+
+    // IP, then UDP
+    const uint8_t *ip = frame + offset;
+    size_t ip_len = len - offset;
+    const uint8_t *udp;
+    size_t udp_len;
+    memset(sender, 0, sizeof(*sender));
+    if (protocol == 0x0800) {
+        if (ip_len < 20 || (ip[0] >> 4) != 4 || ip[9] != IPPROTO_UDP) return false;
+        // Only whole packets, not fragments
+        if (read16(ip + 6) & 0x3fff) return false;
+        size_t header_len = (size_t) (ip[0] & 0x0f) * 4;
+        if (ip_len < header_len + 8) return false;
+        struct sockaddr_in *v4 = (struct sockaddr_in *) sender;
+        v4->sin_family = AF_INET;
+        memcpy(&v4->sin_addr, ip + 12, 4);
+        udp = ip + header_len;
+        udp_len = ip_len - header_len;
+    } else if (protocol == 0x86dd) {
+        if (ip_len < 48 || (ip[0] >> 4) != 6 || ip[6] != IPPROTO_UDP) return false;
+        struct sockaddr_in6 *v6 = (struct sockaddr_in6 *) sender;
+        v6->sin6_family = AF_INET6;
+        memcpy(&v6->sin6_addr, ip + 8, 16);
+        udp = ip + 40;
+        udp_len = ip_len - 40;
+    } else {
+        return false;
+    }
+
+    uint16_t port = read16(udp + 2);
+    bool wanted = false;
+    for (unsigned int i = 0; i < c->port_count; i++) {
+        if (c->ports[i] == port) wanted = true;
+    }
+    size_t length = read16(udp + 4);
+    if (!wanted || length < 8 || length > udp_len) return false;
+    if (sender->ss_family == AF_INET) {
+        ((struct sockaddr_in *) sender)->sin_port = htons(read16(udp));
+    } else {
+        ((struct sockaddr_in6 *) sender)->sin6_port = htons(read16(udp));
+    }
+    *payload = udp + 8;
+    *payload_len = length - 8;
+    return true;
+}
+
+// Read the next packet from a capture. Returns false at the end.
+static bool nextCapture(struct replay_reader *r, const struct replay_config *c, uint64_t *time_ns,
+        struct sockaddr_storage *sender, uint8_t *buf, size_t *len) {
+    static uint8_t frame[REPLAY_MAX_CAPTURE];
+    for (;;) {
+        uint32_t header[4];
+        if (fread(header, sizeof(header), 1, r->file) != 1) return false;
+        uint32_t captured = swap32(header[2], r->swapped);
+        if (captured > sizeof(frame)) {
+            if (fseek(r->file, captured, SEEK_CUR)) return false;
+            skipped++;
+            continue;
+        }
+        if (fread(frame, 1, captured, r->file) != captured) return false;
+        uint64_t frac = swap32(header[1], r->swapped);
+        *time_ns = (uint64_t) swap32(header[0], r->swapped) * 1000000000ULL + (r->nanoseconds ? frac : frac * 1000);
+
+        const uint8_t *payload;
+        size_t payload_len;
+        if (!udpPayload(r, c, frame, captured, sender, &payload, &payload_len)) continue;
+        // Anything too long to be a packet is still replayed, to be rejected
+        // just as it would be live
+        *len = (payload_len < REPLAY_MAX_CAPTURE) ? payload_len : REPLAY_MAX_CAPTURE;
+        memcpy(buf, payload, *len);
+        return true;
+    }
+}
+
+// Read the next demand from a recorder file and encode it as the packet it
+// came in, in the same format and with its target heading. Version 1 files
+// recorded neither, so their demands are binary if they had a sequence
+// number and ASCII if not. Sources are only recorded by their index, so each
+// is given the made up address 127.0.1.<index + 1>. Returns false at the
+// end.
+static bool nextRecord(struct replay_reader *r, uint64_t *time_ns, struct sockaddr_storage *sender,
+        uint8_t *buf, size_t *len) {
+    for (;;) {
+        if (r->segment == r->segment_count) return false;
+        const struct recorder_segment *s = &r->segments[r->segment].header;
+        if (r->record >= s->count) {
+            r->segment++;
+            r->record = 0;
+            continue;
+        }
+        struct recorder_record record;
+        long offset = r->segments[r->segment].offset + (long) sizeof(*s) + (long) r->record * (long) sizeof(record);
+        r->record++;
+        if (fseek(r->file, offset, SEEK_SET) || fread(&record, sizeof(record), 1, r->file) != 1) return false;
+        if (record.type != RECORDER_DEMAND) continue;
+        if (record.channels < 1 || record.channels > PACKET_MAX_CHANNELS) {
+            skipped++;
+            continue;
+        }
+
+        *time_ns = s->realtime_ns + (record.time_ns - s->monotonic_ns);
+        memset(sender, 0, sizeof(*sender));
+        struct sockaddr_in *v4 = (struct sockaddr_in *) sender;
+        v4->sin_family = AF_INET;
+        v4->sin_addr.s_addr = htonl(0x7f000101 + record.source);
+
+        if (s->version == 1) {
+            record.flags = (record.sequence != 0) ? RECORDER_FLAG_BINARY | RECORDER_FLAG_SEQUENCE : 0;
+        }
+        struct packet p = {
+            .format = (record.flags & RECORDER_FLAG_BINARY) ? PACKET_FORMAT_BINARY : PACKET_FORMAT_ASCII,
+            .has_sequence = (record.flags & RECORDER_FLAG_SEQUENCE) != 0,
+            .sequence = record.sequence,
+            .sender_time_us = record.sender_time_us,
+            .channels = record.channels,
+            .has_heading = (record.flags & RECORDER_FLAG_HEADING) != 0,
+            .heading = record.heading
+        };
+        for (int i = 0; i < record.channels; i++) {
+            p.value[i] = record.demand[i];
+        }
+        if (p.format == PACKET_FORMAT_BINARY) {
+            *len = packetEncodeBinary(&p, buf, REPLAY_MAX_CAPTURE);
+        } else {
+            size_t used = 0;
+            for (int i = 0; i < record.channels; i++) {
+                int32_t v = p.value[i];
+                int32_t magnitude = (v < 0) ? -v : v;
+                used += (size_t) snprintf((char *) buf + used, REPLAY_MAX_CAPTURE - used, "%s%s%d.%02d",
+                        i ? "," : "", (v < 0) ? "-" : "", magnitude / DEMAND_SCALE, magnitude % DEMAND_SCALE);
+            }
+            if (p.has_heading) {
+                used += (size_t) snprintf((char *) buf + used, REPLAY_MAX_CAPTURE - used, ";H%u.%02u",
+                        p.heading / PACKET_HEADING_SCALE, p.heading % PACKET_HEADING_SCALE);
+            }
+            *len = used;
+        }
+        if (*len == 0) {
+            skipped++;
+            continue;
+        }
+        return true;
+    }
+}
+
+void *replayThread(void *arg) {
+    const struct replay_config *c = arg;
+    struct replay_reader reader;
+    static uint8_t buf[REPLAY_MAX_CAPTURE];
+    if (!openReader(&reader, c->path)) {
+        closeReader(&reader);
+        atomic_store(&running, false);
+        eventfd_write(demand_event, 1);
+        return NULL;
+    }
+
+    // Recorded time since the first packet, less any long gaps, from which
+    // each packet's due time is worked out
+    bool first = true;
+    uint64_t last_recorded = 0, elapsed_ns = 0;
+    uint64_t start = monotonicNanos();
+    uint64_t max_gap_ns = REPLAY_MAX_GAP_MS * 1000000ULL;
+    for (;;) {
+        uint64_t recorded;
+        struct sockaddr_storage sender;
+        size_t len;
+        bool more = reader.pcap ? nextCapture(&reader, c, &recorded, &sender, buf, &len)
+                : nextRecord(&reader, &recorded, &sender, buf, &len);
+        if (!more) break;
+        if (first) {
+            last_recorded = recorded;
+            start = monotonicNanos();
+            first = false;
+        }
+        // Time going backwards, e.g. a clock step, counts as no gap at all
+        if (recorded > last_recorded) {
+            uint64_t gap = recorded - last_recorded;
+            elapsed_ns += (gap < max_gap_ns) ? gap : max_gap_ns;
+        }
+        last_recorded = recorded;
+
+        uint64_t due = start;
+        if (c->speed > 0.0) {
+            due += (uint64_t) ((double) elapsed_ns / c->speed);
+            if (!commsReplayWait(due)) break;
+        } else if (replayed % REPLAY_CHECK_INTERVAL == 0) {
+            if (!commsReplayWait(0)) break;
+            due = monotonicNanos();
+        } else {
+            due = monotonicNanos();
+        }
+        uint64_t now = monotonicNanos();
+        histogramRecord(&hist_lateness, (now > due) ? now - due : 0);
+        commsReplayPacket(&sender, buf, len);
+        replayed++;
+    }
+    replay_ns = monotonicNanos() - start;
+    closeReader(&reader);
+    atomic_store(&finished, true);
+    logInfo("Replay finished: %lu packets in %.3f s (%.0f per second), %lu skipped", replayed,
+            replay_ns / 1e9, replay_ns ? replayed * 1e9 / replay_ns : 0.0, skipped);
+
+    // Let the last demand play out, then shut down
+    if (commsReplayWait(monotonicNanos() + REPLAY_TAIL_MS * 1000000ULL)) {
+        atomic_store(&running, false);
+        eventfd_write(demand_event, 1);
+    }
+    return NULL;
+}
+
+void replayDumpStats(FILE *out) {
+    uint64_t elapsed = atomic_load(&finished) ? replay_ns : 0;
+    fprintf(out, "Replay: %lu packets, %lu skipped%s", replayed, skipped, atomic_load(&finished) ? "" : ", still running");
+    if (elapsed > 0) fprintf(out, ", %.3f s, %.0f per second", elapsed / 1e9, replayed * 1e9 / elapsed);
+    fprintf(out, "\n");
+    histogramDump(&hist_lateness, out);
+}
@@ -0,0 +1,43 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Replay of recorded packet streams.
+//
+// With --replay, the controller takes its packets from a file instead of
+// the network, and runs them through the same parse, arbitration, handoff
+// and servo path as live ones, on the mock hardware backend unless -H asks
+// for the real servos. The file can be a flight recorder file (recorder.h),
+// whose demands are re-encoded as the packets they came in as from the
+// source they came from, or a pcap capture, from which every UDP packet to
+// one of the listen ports is taken.
+//
+// Packets are replayed at their recorded times scaled by the speed, so 1 is
+// real time, 10 is ten times as fast, and 0 is as fast as possible, which
+// makes replay a throughput benchmark of the whole pipeline. How late each
+// packet was fed in compared with its scaled recorded time is kept as the
+// timing divergence, and printed with the other statistics. The controller
+// shuts down when the replay is finished.
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "comms.h"
+
+struct replay_config {
+    const char *path;
+    // Replay speed relative to real time, or 0 for as fast as possible
+    double speed;
+    // UDP ports that packets in a capture must be addressed to
+    uint16_t ports[COMMS_MAX_LISTEN];
+    unsigned int port_count;
+};
+
+// Replay thread entry point, run instead of commsThread() with a struct
+// replay_config, which must remain valid while it runs
+void *replayThread(void *arg);
+
+// Print the replay totals and timing divergence
+void replayDumpStats(FILE *out);
+
+#endif // REPLAY_H
@@ -0,0 +1,229 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Per-source state and arbitration between controllers.
+
+#include "sources.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+#include "log.h"
+#include "metrics.h"
+
+static struct source_config config;
+static struct source table[SOURCE_MAX];
+// Parsed addresses from the priority config
+static struct sockaddr_storage priority_address[SOURCE_MAX];
+static int active = -1;
+
+// Whether two addresses are the same host. The port is ignored, since a
+// sender that restarts will usually come back from a different one.
+static bool sameHost(const struct sockaddr_storage *a, const struct sockaddr_storage *b) {
+    if (a->ss_family != b->ss_family) return false;
+    if (a->ss_family == AF_INET) {
+        return ((const struct sockaddr_in *) a)->sin_addr.s_addr == ((const struct sockaddr_in *) b)->sin_addr.s_addr;
+    }
+    if (a->ss_family == AF_INET6) {
+        return memcmp(&((const struct sockaddr_in6 *) a)->sin6_addr, &((const struct sockaddr_in6 *) b)->sin6_addr,
+                sizeof(struct in6_addr)) == 0;
+    }
+    if (a->ss_family == AF_UNIX) {
+        return strcmp(((const struct sockaddr_un *) a)->sun_path, ((const struct sockaddr_un *) b)->sun_path) == 0;
+    }
+    return false;
+}
+
+// Printable form of a sender address, including the port
+static void formatAddress(const struct sockaddr_storage *address, char *out, size_t len) {
+    char host[INET6_ADDRSTRLEN] = "?";
+    unsigned int port = 0;
+    if (address->ss_family == AF_INET) {
+        const struct sockaddr_in *v4 = (const struct sockaddr_in *) address;
+        inet_ntop(AF_INET, &v4->sin_addr, host, sizeof(host));
+        port = ntohs(v4->sin_port);
+        snprintf(out, len, "%s:%u", host, port);
+    } else if (address->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *v6 = (const struct sockaddr_in6 *) address;
+        inet_ntop(AF_INET6, &v6->sin6_addr, host, sizeof(host));
+        port = ntohs(v6->sin6_port);
+        snprintf(out, len, "[%s]:%u", host, port);
+    } else if (address->ss_family == AF_UNIX) {
+        snprintf(out, len, "local %s", ((const struct sockaddr_un *) address)->sun_path);
+    } else {
+        snprintf(out, len, "%s", host);
+    }
+}
+
+// Configured priority of a sender, or the default if it is not listed
+static int priorityOf(const struct sockaddr_storage *sender) {
+    if (sender->ss_family == AF_UNIX) return config.local_priority;
+    for (unsigned int i = 0; i < config.priority_count; i++) {
+        if (sameHost(sender, &priority_address[i])) return config.priorities[i].priority;
+    }
+    return config.default_priority;
+}
+
+// Find the entry for a sender, or make one, evicting the least recently
+// heard inactive source if the table is full. Returns -1 if the sender is
+// not allowed.
+static int findSource(const struct sockaddr_storage *sender) {
+    int free_index = -1;
+    int oldest = -1;
+    for (int i = 0; i < SOURCE_MAX; i++) {
+        if (!table[i].in_use) {
+            if (free_index < 0) free_index = i;
+            continue;
+        }
+        if (sameHost(sender, &table[i].address)) return i;
+        if (i != active && (oldest < 0 || table[i].last_seen_ns < table[oldest].last_seen_ns)) oldest = i;
+    }
+
+    int priority = priorityOf(sender);
+    if (priority < 0) return -1;
+    int index = (free_index >= 0) ? free_index : oldest;
+    if (index < 0) return -1;
+    if (table[index].in_use) {
+        logInfo("Forgetting source %s to make room", table[index].name);
+    }
+
+    struct source *s = &table[index];
+    memset(s, 0, sizeof(*s));
+    s->in_use = true;
+    s->address = *sender;
+    s->priority = priority;
+    formatAddress(sender, s->name, sizeof(s->name));
+    logInfo("New source %s with priority %d", s->name, priority);
+    return index;
+}
+
+bool sourcesParseAddress(const char *text, struct sockaddr_storage *out) {
+    memset(out, 0, sizeof(*out));
+    if (inet_pton(AF_INET, text, &((struct sockaddr_in *) out)->sin_addr) == 1) {
+        out->ss_family = AF_INET;
+    } else if (inet_pton(AF_INET6, text, &((struct sockaddr_in6 *) out)->sin6_addr) == 1) {
+        out->ss_family = AF_INET6;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+int sourcesConfigure(const struct source_config *c) {
+    if (c->priority_count > SOURCE_MAX) {
+        logError("at most %d source priorities can be given", SOURCE_MAX);
+        return -1;
+    }
+    struct sockaddr_storage parsed[SOURCE_MAX];
+    for (unsigned int i = 0; i < c->priority_count; i++) {
+        if (!sourcesParseAddress(c->priorities[i].address, &parsed[i])) {
+            logError("invalid source address %s", c->priorities[i].address);
+            return -1;
+        }
+    }
+    config = *c;
+    memcpy(priority_address, parsed, sizeof(parsed));
+
+    // Sources already known keep their state, but take their new priority,
+    // and are dropped if they are no longer allowed
+    for (int i = 0; i < SOURCE_MAX; i++) {
+        if (!table[i].in_use) continue;
+        int priority = priorityOf(&table[i].address);
+        if (priority < 0) {
+            logInfo("Source %s is no longer allowed", table[i].name);
+            table[i].in_use = false;
+            if (i == active) active = -1;
+        } else if (priority != table[i].priority) {
+            logInfo("Source %s now has priority %d", table[i].name, priority);
+            table[i].priority = priority;
+        }
+    }
+    return 0;
+}
+
+int sourcesAccept(const struct sockaddr_storage *sender, unsigned int link, const struct packet *packet,
+        uint64_t arrival_ns, uint64_t parsed_ns, bool *was_stale) {
+    *was_stale = false;
+    int index = findSource(sender);
+    if (index < 0) return -1;
+    struct source *s = &table[index];
+
+    // A source quiet for long enough to lose control may have restarted, so
+    // its old sequence numbers no longer count
+    if (s->have_sequence && arrival_ns - s->last_seen_ns > config.failover_ms * 1000000ULL) {
+        s->have_sequence = false;
+    }
+    if (packet->has_sequence) {
+        // A large step backwards means the sender has restarted, so accept
+        // it rather than waiting for it to catch up
+        if (s->have_sequence && !packetSequenceNewer(packet->sequence, s->sequence)
+                && s->sequence - packet->sequence < config.sequence_restart_gap) {
+            s->stale++;
+            *was_stale = true;
+            return -1;
+        }
+        s->have_sequence = true;
+        s->sequence = packet->sequence;
+    }
+
+    // Smooth the packet interval with a 1/8 weight, for the rate
+    if (s->packets > 0 && arrival_ns > s->last_seen_ns) {
+        uint64_t interval_us = (arrival_ns - s->last_seen_ns) / 1000;
+        if (interval_us > UINT32_MAX) interval_us = UINT32_MAX;
+        s->interval_us = (s->interval_us == 0) ? (uint32_t) interval_us
+                : (uint32_t) (((uint64_t) s->interval_us * 7 + interval_us) / 8);
+    }
+    s->packets++;
+    s->last_seen_ns = arrival_ns;
+    s->reply_address = *sender;
+    s->link = link;
+    s->packet = *packet;
+    s->arrival_ns = arrival_ns;
+    s->parsed_ns = parsed_ns;
+    s->pending = true;
+    return index;
+}
+
+int sourcesArbitrate(uint64_t now) {
+    uint64_t failover_ns = config.failover_ms * 1000000ULL;
+    int best = -1;
+    for (int i = 0; i < SOURCE_MAX; i++) {
+        if (!table[i].in_use || now - table[i].last_seen_ns > failover_ns) continue;
+        // The active source keeps control against others of equal priority
+        if (best < 0 || table[i].priority > table[best].priority
+                || (table[i].priority == table[best].priority && i == active)) {
+            best = i;
+        }
+    }
+    // If everyone has gone quiet, stay with the active source, and leave the
+    // servo loop's failsafe to deal with the outputs
+    if (best < 0) return active;
+
+    if (best != active) {
+        const struct source *b = &table[best];
+        if (active >= 0) {
+            logWarning("Control passed from %s to %s (priority %d, %u Hz)", table[active].name, b->name,
+                    b->priority, b->interval_us ? 1000000 / b->interval_us : 0);
+        } else {
+            logInfo("Control taken by %s (priority %d)", b->name, b->priority);
+        }
+        active = best;
+        metricAdd(METRICS_COMMS, METRIC_CONTROL_CHANGES, 1);
+        // The new source's latest demand goes out straight away, even if it
+        // arrived while another source was in control
+        table[best].pending = true;
+    }
+    return active;
+}
+
+int sourcesActive(void) {
+    return active;
+}
+
+uint64_t sourcesFailoverDeadline(int index) {
+    return table[index].last_seen_ns + config.failover_ms * 1000000ULL;
+}
+
+struct source *sourcesGet(int index) {
+    return &table[index];
+}
@@ -0,0 +1,108 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Per-source state and arbitration between controllers.
+//
+// Every sender address that delivers valid packets gets an entry in a small
+// table, holding its priority, when it was last heard from, its sequence
+// numbers and its packet rate. Arbitration picks the highest-priority source
+// heard from within the failover time as the active controller, and only
+// its demands reach the servos. Sources of equal priority do not take over
+// from each other while the active one is still fresh.
+//
+// The table is only ever touched by the comms thread.
+
+#ifndef SOURCES_H
+#define SOURCES_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include "packet.h"
+
+// Most senders tracked at once. When the table is full, the least recently
+// heard inactive source is forgotten to make room.
+#define SOURCE_MAX 8
+
+// Longest printable source address, e.g. "[ffff:...:ffff]"
+#define SOURCE_NAME_LEN 48
+
+// Priority given to a sender address. Higher numbers win.
+struct source_priority {
+    char address[SOURCE_NAME_LEN];
+    int priority;
+};
+
+struct source_config {
+    struct source_priority priorities[SOURCE_MAX];
+    unsigned int priority_count;
+    // Priority of senders not in the table, or -1 to ignore them entirely
+    int default_priority;
+    // Priority of demands from the shared memory block, or -1 to ignore them
+    int local_priority;
+    // A source that has been quiet for this long loses control to the next
+    // highest-priority source that is still sending
+    unsigned int failover_ms;
+    // How far a binary packet's sequence number can step backwards before
+    // it is treated as a restarted sender rather than a stale packet
+    uint32_t sequence_restart_gap;
+};
+
+struct source {
+    bool in_use;
+    struct sockaddr_storage address;
+    // Full address, with port, of the latest valid packet and the index of
+    // the socket it came in on, for replies
+    struct sockaddr_storage reply_address;
+    unsigned int link;
+    char name[SOURCE_NAME_LEN];
+    int priority;
+    // CLOCK_MONOTONIC time of the latest valid packet
+    uint64_t last_seen_ns;
+    // Sequence number of the newest binary packet accepted, used to reject
+    // stale and reordered packets from this source
+    bool have_sequence;
+    uint32_t sequence;
+    // Smoothed interval between valid packets, in microseconds
+    uint32_t interval_us;
+    unsigned long packets, stale;
+    // Latest valid demand from this source, and whether it still needs
+    // handing to the servos
+    struct packet packet;
+    uint64_t arrival_ns;
+    uint64_t parsed_ns;
+    bool pending;
+};
+
+// Demands from the shared memory block (local.h) come from an AF_UNIX
+// address holding the block's name, and get local_priority.
+
+// Parse an IPv4 or IPv6 address, without a port. Returns false if it is
+// not valid.
+bool sourcesParseAddress(const char *text, struct sockaddr_storage *out);
+
+// Set or change the source configuration, which is copied. Sources already
+// in the table are given their new priorities. Returns 0 on success, or -1
+// if a priority address is invalid, in which case nothing is changed.
+int sourcesConfigure(const struct source_config *config);
+
+// Record a valid packet from sender, received on socket number link.
+// Returns the source's index, or -1 if the packet was rejected, either for a
+// stale sequence number (in which case *was_stale is set) or because the
+// sender is not allowed.
+int sourcesAccept(const struct sockaddr_storage *sender, unsigned int link, const struct packet *packet,
+        uint64_t arrival_ns, uint64_t parsed_ns, bool *was_stale);
+
+// Choose the active source at time now. Returns its index, or -1 if no
+// source has been heard from yet.
+int sourcesArbitrate(uint64_t now);
+
+// The source last chosen by sourcesArbitrate(), or -1 if there is none, or
+// it has been dropped by a change of configuration
+int sourcesActive(void);
+
+// Time at which the given source would lose control if it stays quiet
+uint64_t sourcesFailoverDeadline(int index);
+
+// Source by index, as returned from sourcesAccept() or sourcesArbitrate()
+struct source *sourcesGet(int index);
+
+#endif // SOURCES_H
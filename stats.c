@@ -0,0 +1,59 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Latency and jitter histograms.
+
+#include "stats.h"
+
+// Index of the bucket for a sample of the given length
+static unsigned int bucketFor(uint64_t ns) {
+    uint64_t us = ns / 1000;
+    if (us == 0) return 0;
+    unsigned int bucket = 64 - (unsigned int) __builtin_clzll(us);
+    return (bucket < HISTOGRAM_BUCKETS) ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+// Upper bound of a bucket in microseconds
+static uint64_t bucketLimitUs(unsigned int bucket) {
+    return 1ULL << bucket;
+}
+
+void histogramRecord(struct histogram *h, uint64_t ns) {
+    // There is only ever one writer, so plain loads and stores are enough
+    // and avoid the cost of atomic read-modify-write instructions
+    unsigned int b = bucketFor(ns);
+    atomic_store_explicit(&h->bucket[b], atomic_load_explicit(&h->bucket[b], memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_store_explicit(&h->count, atomic_load_explicit(&h->count, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_store_explicit(&h->sum_ns, atomic_load_explicit(&h->sum_ns, memory_order_relaxed) + ns, memory_order_relaxed);
+    if (ns > atomic_load_explicit(&h->max_ns, memory_order_relaxed)) {
+        atomic_store_explicit(&h->max_ns, ns, memory_order_relaxed);
+    }
+}
+
+void histogramDump(struct histogram *h, FILE *out) {
+    uint32_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t total = 0;
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        buckets[i] = atomic_load_explicit(&h->bucket[i], memory_order_relaxed);
+        total += buckets[i];
+    }
+    uint64_t sum_ns = atomic_load_explicit(&h->sum_ns, memory_order_relaxed);
+    uint64_t max_ns = atomic_load_explicit(&h->max_ns, memory_order_relaxed);
+    if (total == 0) {
+        fprintf(out, "%s: no samples\n", h->name);
+        return;
+    }
+
+    // Percentiles are reported as the upper bound of the bucket they fall in
+    uint64_t p50 = 0, p99 = 0, seen = 0;
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += buckets[i];
+        if (p50 == 0 && seen * 2 >= total) p50 = bucketLimitUs(i);
+        if (p99 == 0 && seen * 100 >= total * 99) p99 = bucketLimitUs(i);
+    }
+    fprintf(out, "%s: %llu samples, mean %.1f us, p50 < %llu us, p99 < %llu us, max %.1f us\n",
+            h->name, (unsigned long long) total, sum_ns / 1e3 / total,
+            (unsigned long long) p50, (unsigned long long) p99, max_ns / 1e3);
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (buckets[i] == 0) continue;
+        fprintf(out, "    < %8llu us: %lu\n", (unsigned long long) bucketLimitUs(i), (unsigned long) buckets[i]);
+    }
+}
@@ -0,0 +1,38 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Latency and jitter histograms.
+//
+// Each histogram counts samples into fixed power-of-two buckets of
+// microseconds. Recording a sample is a handful of relaxed atomic loads and
+// stores with no locking, so histograms can be updated from the control path
+// and read from anywhere. Each histogram must only be recorded into by a
+// single thread.
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+
+// Bucket 0 counts samples under 1us, and bucket n counts samples from
+// 2^(n-1) up to 2^n us. The last bucket also counts anything longer.
+#define HISTOGRAM_BUCKETS 24
+
+struct histogram {
+    const char *name;
+    _Atomic uint32_t bucket[HISTOGRAM_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum_ns;
+    _Atomic uint64_t max_ns;
+};
+
+#define HISTOGRAM_INIT(label) { .name = (label) }
+
+// Record a sample, in nanoseconds
+void histogramRecord(struct histogram *h, uint64_t ns);
+
+// Print a summary of a histogram: count, mean, approximate percentiles,
+// maximum and the non-empty buckets
+void histogramDump(struct histogram *h, FILE *out);
+
+#endif // STATS_H
@@ -0,0 +1,478 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Packet to pulse latency benchmark.
+//
+// Runs the controller built against the mock hardware backend, floods its
+// UDP port at each requested rate in each packet format, and reports the
+// throughput, the drop rate and percentiles of the latency from sending a
+// packet to its first servo pulse. Runs on any Linux machine, so that
+// performance regressions can be caught before deploying to the boards.
+//
+// Every packet in a run carries a different demand, so the pulse length the
+// mock records says which packet it came from. Demands are latest-wins, so
+// a packet overtaken by a newer one before the servo loop gets to it never
+// produces a pulse; those are counted as dropped, as are packets lost in
+// the kernel.
+//
+// With -a, every packet is sent in an authenticated envelope and the
+// controller rejects anything else. The cost of checking an envelope is
+// measured on its own first, per packet, against the cost of the parse.
+//
+// Usage: bench [options] controller
+//   -r rates    comma-separated packet rates per second (50,200,1000,5000)
+//   -f formats  comma-separated packet formats, ascii and/or binary
+//   -d seconds  length of each run (3)
+//   -p port     UDP port to use (2131)
+//   -m us       exit with failure if any run's 99th percentile latency is
+//               above this, 0 for no limit (0)
+//   -a          authenticate every packet
+//   -v          show the controller's output
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "auth.h"
+#include "demand.h"
+#include "hal.h"
+#include "packet.h"
+
+#define BENCH_MAX_RUNS 16
+#define BENCH_PORT 2131
+#define BENCH_SECONDS 3
+// Pulse lengths the benchmark channel can take: BENCH_MIN_US is the safe
+// pulse, every packet gets one of the BENCH_IDS lengths above it, and the
+// startup probe gets the top one
+#define BENCH_MIN_US 1000
+#define BENCH_MAX_US 2000
+#define BENCH_IDS 998
+#define BENCH_PROBE_US BENCH_MAX_US
+// How long to wait for the controller to start, and for the last pulses of
+// a run to come through
+#define BENCH_STARTUP_MS 10000
+#define BENCH_SETTLE_MS 200
+// Largest packet sent, and how many envelopes to check when measuring
+#define BENCH_MAX_PACKET_LEN 128
+#define BENCH_AUTH_PACKETS 100000
+// Key used with -a, in the config file's hex form
+#define BENCH_KEY_ID 1
+#define BENCH_KEY_HEX "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+
+// Pulses recorded by the mock, appended by the reader thread
+static struct hal_pulse_record *pulses;
+static size_t pulse_count, pulse_capacity;
+static pthread_mutex_t pulse_lock = PTHREAD_MUTEX_INITIALIZER;
+static int pulse_fd = -1;
+
+// Authentication with -a, and the last counter used
+static bool authenticate;
+static struct auth_key_config key_config;
+static struct auth_key key;
+static uint64_t auth_counter;
+
+static void sleepUntil(uint64_t ns) {
+    struct timespec ts = { .tv_sec = (time_t) (ns / 1000000000ULL), .tv_nsec = (long) (ns % 1000000000ULL) };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static void *readPulses(__attribute__ ((unused)) void *arg) {
+    struct hal_pulse_record batch[256];
+    ssize_t len;
+    while ((len = read(pulse_fd, batch, sizeof(batch))) > 0) {
+        size_t n = (size_t) len / sizeof(batch[0]);
+        pthread_mutex_lock(&pulse_lock);
+        if (pulse_count + n > pulse_capacity) {
+            size_t capacity = pulse_capacity ? pulse_capacity * 2 : 65536;
+            while (capacity < pulse_count + n) capacity *= 2;
+            struct hal_pulse_record *grown = realloc(pulses, capacity * sizeof(*pulses));
+            if (grown == NULL) {
+                pthread_mutex_unlock(&pulse_lock);
+                break;
+            }
+            pulses = grown;
+            pulse_capacity = capacity;
+        }
+        memcpy(&pulses[pulse_count], batch, n * sizeof(batch[0]));
+        pulse_count += n;
+        pthread_mutex_unlock(&pulse_lock);
+    }
+    return NULL;
+}
+
+// Forget the pulses recorded so far
+static void clearPulses(void) {
+    pthread_mutex_lock(&pulse_lock);
+    pulse_count = 0;
+    pthread_mutex_unlock(&pulse_lock);
+}
+
+// Whether a pulse of the given length has been recorded
+static bool sawPulse(uint16_t pulse_us) {
+    bool seen = false;
+    pthread_mutex_lock(&pulse_lock);
+    for (size_t i = 0; i < pulse_count && !seen; i++) {
+        seen = pulses[i].pulse_us == pulse_us;
+    }
+    pthread_mutex_unlock(&pulse_lock);
+    return seen;
+}
+
+// Build a packet giving the benchmark channel the given pulse length
+static size_t encodePlain(enum packet_format format, uint32_t sequence, uint16_t pulse_us, uint8_t *buf, size_t len) {
+    int32_t demand = (int32_t) (pulse_us - BENCH_MIN_US) * DEMAND_FULL_SCALE / (BENCH_MAX_US - BENCH_MIN_US);
+    if (format == PACKET_FORMAT_ASCII) {
+        int n = snprintf((char *) buf, len, "%d.%02d", demand / DEMAND_SCALE, demand % DEMAND_SCALE);
+        return (n > 0 && (size_t) n < len) ? (size_t) n : 0;
+    }
+    struct packet p = {
+        .format = PACKET_FORMAT_BINARY,
+        .has_sequence = true,
+        .sequence = sequence,
+        .sender_time_us = (uint32_t) (monotonicNanos() / 1000),
+        .channels = 1,
+        .value = { demand }
+    };
+    return packetEncodeBinary(&p, buf, len);
+}
+
+// The same, in an envelope with -a
+static size_t encode(enum packet_format format, uint32_t sequence, uint16_t pulse_us, uint8_t *buf, size_t len) {
+    uint8_t plain[BENCH_MAX_PACKET_LEN];
+    size_t plain_len = encodePlain(format, sequence, pulse_us, plain, sizeof(plain));
+    if (!authenticate || plain_len == 0) {
+        if (plain_len > len) return 0;
+        memcpy(buf, plain, plain_len);
+        return plain_len;
+    }
+    return authWrap(&key, ++auth_counter, plain, plain_len, buf, len);
+}
+
+// Set up the -a key from its hex form
+static void prepareKey(void) {
+    const char *hex = BENCH_KEY_HEX;
+    key_config.id = BENCH_KEY_ID;
+    key_config.len = (uint8_t) (strlen(hex) / 2);
+    for (size_t i = 0; i < key_config.len; i++) {
+        char byte[3] = { hex[2 * i], hex[2 * i + 1], '\0' };
+        key_config.key[i] = (uint8_t) strtoul(byte, NULL, 16);
+    }
+    authPrepare(&key_config, &key);
+}
+
+// Time checking envelopes and parsing packets, per packet, away from the
+// controller. Each envelope has its own counter, as on the wire.
+static bool measureAuth(enum packet_format format) {
+    uint8_t (*envelopes)[BENCH_MAX_PACKET_LEN] = calloc(BENCH_AUTH_PACKETS, BENCH_MAX_PACKET_LEN);
+    size_t *lens = calloc(BENCH_AUTH_PACKETS, sizeof(*lens));
+    if (envelopes == NULL || lens == NULL) {
+        free(envelopes);
+        free(lens);
+        return false;
+    }
+    for (size_t i = 0; i < BENCH_AUTH_PACKETS; i++) {
+        lens[i] = encode(format, (uint32_t) i + 1, (uint16_t) (BENCH_MIN_US + 1 + i % BENCH_IDS), envelopes[i],
+                BENCH_MAX_PACKET_LEN);
+    }
+    authInit(&key_config, 1);
+
+    size_t failures = 0;
+    const uint8_t *body = NULL;
+    size_t body_len = 0;
+    uint64_t start = monotonicNanos();
+    for (size_t i = 0; i < BENCH_AUTH_PACKETS; i++) {
+        if (authVerify(envelopes[i], lens[i], &body, &body_len) != PACKET_OK) failures++;
+    }
+    uint64_t verify_ns = monotonicNanos() - start;
+    struct packet parsed;
+    start = monotonicNanos();
+    for (size_t i = 0; i < BENCH_AUTH_PACKETS; i++) {
+        if (parsePacket(envelopes[i] + AUTH_HEADER_LEN, lens[i] - AUTH_LEN(0), &parsed) != PACKET_OK) failures++;
+    }
+    uint64_t parse_ns = monotonicNanos() - start;
+    printf("%-7s %4zu byte envelopes: verify %.0f ns, parse %.0f ns per packet%s\n",
+            (format == PACKET_FORMAT_ASCII) ? "ascii" : "binary", lens[0],
+            (double) verify_ns / BENCH_AUTH_PACKETS, (double) parse_ns / BENCH_AUTH_PACKETS,
+            (failures > 0) ? ", FAILED" : "");
+    free(envelopes);
+    free(lens);
+    return failures == 0;
+}
+
+static int compareLatency(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static double percentileUs(const uint64_t *sorted, size_t n, double p) {
+    if (n == 0) return 0.0;
+    size_t i = (size_t) (p / 100.0 * (double) (n - 1) + 0.5);
+    return (double) sorted[i] / 1000.0;
+}
+
+// Write the controller's config for the benchmark to a temporary file:
+// one channel, mapped straight from demand to pulse, and no failsafe
+static bool writeConfig(char *path, uint16_t port) {
+    int fd = mkstemp(path);
+    if (fd < 0) return false;
+    FILE *f = fdopen(fd, "w");
+    if (f == NULL) {
+        close(fd);
+        return false;
+    }
+    fprintf(f, "listen = 127.0.0.1 %u\n", (unsigned int) port);
+    fprintf(f, "battery_startup_v = 0\nfailsafe_power_cut_ms = 0\nlog_level = warning\nchannels = 1\n");
+    if (authenticate) fprintf(f, "auth_key = %d %s\nauth_required = yes\n", BENCH_KEY_ID, BENCH_KEY_HEX);
+    fprintf(f, "[channel 1]\nservo = 1\nmin_us = %d\nmax_us = %d\ncentre_us = %d\n",
+            BENCH_MIN_US, BENCH_MAX_US, (BENCH_MIN_US + BENCH_MAX_US) / 2);
+    fprintf(f, "bipolar = no\ninverted = no\nrate_limit = 0\nexpo = 0\ndeadband = 0\n");
+    fprintf(f, "failsafe_hold_ms = 0\ninterpolation = none\nrefresh_divider = 1\nlow_battery_limit = 0\n");
+    return fclose(f) == 0;
+}
+
+// Start the controller with its pulse records going to a pipe. Returns its
+// process ID, or -1.
+static pid_t startController(const char *controller, const char *config_path, bool verbose) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC)) return -1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        int fd = dup(fds[1]);
+        char text[16];
+        snprintf(text, sizeof(text), "%d", fd);
+        setenv(HAL_MOCK_PULSE_FD_ENV, text, 1);
+        if (!verbose) {
+            int null_fd = open("/dev/null", O_WRONLY);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        execl(controller, controller, "-c", config_path, (char *) NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+    pulse_fd = fds[0];
+    if (pid < 0) close(fds[0]);
+    return pid;
+}
+
+struct run_result {
+    double sent_rate;
+    double applied_rate;
+    double dropped_percent;
+    double p50_us, p90_us, p99_us, p999_us, max_us;
+};
+
+// Send packets at rate per second for the given time, then match them up
+// with the pulses they produced
+static bool run(int sock, const struct sockaddr_in *to, enum packet_format format, unsigned int rate,
+        unsigned int seconds, uint32_t *sequence, struct run_result *result) {
+    size_t count = (size_t) rate * seconds;
+    uint64_t *sent_ns = calloc(count, sizeof(*sent_ns));
+    uint64_t *latency_ns = calloc(count, sizeof(*latency_ns));
+    if (sent_ns == NULL || latency_ns == NULL) {
+        free(sent_ns);
+        free(latency_ns);
+        return false;
+    }
+
+    clearPulses();
+    uint64_t period_ns = 1000000000ULL / rate;
+    uint64_t start = monotonicNanos();
+    for (size_t i = 0; i < count; i++) {
+        sleepUntil(start + i * period_ns);
+        uint8_t buf[BENCH_MAX_PACKET_LEN];
+        size_t len = encode(format, ++*sequence, (uint16_t) (BENCH_MIN_US + 1 + i % BENCH_IDS), buf, sizeof(buf));
+        sent_ns[i] = monotonicNanos();
+        sendto(sock, buf, len, 0, (const struct sockaddr *) to, sizeof(*to));
+    }
+    uint64_t elapsed = monotonicNanos() - start;
+    sleepUntil(monotonicNanos() + BENCH_SETTLE_MS * 1000000ULL);
+
+    // Each pulse belongs to the newest packet of its length sent before it.
+    // Later pulses of the same packet are keep-alive refreshes.
+    size_t applied = 0;
+    size_t sent_before = 0;
+    long last = -1;
+    pthread_mutex_lock(&pulse_lock);
+    for (size_t r = 0; r < pulse_count; r++) {
+        const struct hal_pulse_record *p = &pulses[r];
+        while (sent_before < count && sent_ns[sent_before] <= p->time_ns) sent_before++;
+        if (p->pulse_us <= BENCH_MIN_US || p->pulse_us > BENCH_MIN_US + BENCH_IDS || sent_before == 0) continue;
+        size_t id = p->pulse_us - BENCH_MIN_US - 1;
+        if (id >= sent_before) continue;
+        size_t i = id + (sent_before - 1 - id) / BENCH_IDS * BENCH_IDS;
+        if ((long) i <= last) continue;
+        latency_ns[applied++] = p->time_ns - sent_ns[i];
+        last = (long) i;
+    }
+    pthread_mutex_unlock(&pulse_lock);
+
+    qsort(latency_ns, applied, sizeof(*latency_ns), compareLatency);
+    result->sent_rate = (double) count * 1e9 / (double) elapsed;
+    result->applied_rate = (double) applied * 1e9 / (double) elapsed;
+    result->dropped_percent = 100.0 * (double) (count - applied) / (double) count;
+    result->p50_us = percentileUs(latency_ns, applied, 50.0);
+    result->p90_us = percentileUs(latency_ns, applied, 90.0);
+    result->p99_us = percentileUs(latency_ns, applied, 99.0);
+    result->p999_us = percentileUs(latency_ns, applied, 99.9);
+    result->max_us = percentileUs(latency_ns, applied, 100.0);
+    free(sent_ns);
+    free(latency_ns);
+    return true;
+}
+
+// Split a comma-separated list of numbers. Returns how many there were, or
+// 0 if any is invalid.
+static unsigned int parseRates(char *text, unsigned int *rates) {
+    unsigned int n = 0;
+    for (char *word = strtok(text, ","); word != NULL; word = strtok(NULL, ",")) {
+        char *end;
+        long rate = strtol(word, &end, 10);
+        if (*end != '\0' || rate < 1 || rate > 1000000 || n == BENCH_MAX_RUNS) return 0;
+        rates[n++] = (unsigned int) rate;
+    }
+    return n;
+}
+
+static unsigned int parseFormats(char *text, enum packet_format *formats) {
+    unsigned int n = 0;
+    for (char *word = strtok(text, ","); word != NULL; word = strtok(NULL, ",")) {
+        if (n == 2) return 0;
+        if (!strcmp(word, "ascii")) {
+            formats[n++] = PACKET_FORMAT_ASCII;
+        } else if (!strcmp(word, "binary")) {
+            formats[n++] = PACKET_FORMAT_BINARY;
+        } else {
+            return 0;
+        }
+    }
+    return n;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-r rates] [-f formats] [-d seconds] [-p port] [-m max p99 us] [-a] [-v] controller\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int rates[BENCH_MAX_RUNS] = { 50, 200, 1000, 5000 };
+    unsigned int rate_count = 4;
+    enum packet_format formats[2] = { PACKET_FORMAT_ASCII, PACKET_FORMAT_BINARY };
+    unsigned int format_count = 2;
+    unsigned int seconds = BENCH_SECONDS;
+    unsigned int port = BENCH_PORT;
+    double max_p99_us = 0.0;
+    bool verbose = false;
+    int option;
+    while ((option = getopt(argc, argv, "r:f:d:p:m:av")) != -1) {
+        if (option == 'r') {
+            rate_count = parseRates(optarg, rates);
+        } else if (option == 'f') {
+            format_count = parseFormats(optarg, formats);
+        } else if (option == 'd') {
+            seconds = (unsigned int) atoi(optarg);
+        } else if (option == 'p') {
+            port = (unsigned int) atoi(optarg);
+        } else if (option == 'm') {
+            max_p99_us = atof(optarg);
+        } else if (option == 'a') {
+            authenticate = true;
+        } else if (option == 'v') {
+            verbose = true;
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc - 1 || rate_count == 0 || format_count == 0 || seconds == 0 || port == 0 || port > 65535) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    // The envelopes are checked in the comms thread, on the control path, so
+    // their cost is measured first on its own
+    if (authenticate) {
+        prepareKey();
+        for (unsigned int f = 0; f < format_count; f++) {
+            if (!measureAuth(formats[f])) {
+                fprintf(stderr, "ERROR: authentication measurement failed\n");
+                return 2;
+            }
+        }
+        // The controller starts with fresh replay windows
+        auth_counter = 0;
+    }
+
+    char config_path[] = "/tmp/udp_servo_bench_XXXXXX";
+    if (!writeConfig(config_path, (uint16_t) port)) {
+        fprintf(stderr, "ERROR: could not write the controller config\n");
+        return 2;
+    }
+    pid_t controller = startController(argv[optind], config_path, verbose);
+    if (controller < 0) {
+        fprintf(stderr, "ERROR: could not start %s\n", argv[optind]);
+        unlink(config_path);
+        return 2;
+    }
+    pthread_t reader;
+    pthread_create(&reader, NULL, readPulses, NULL);
+
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    struct sockaddr_in to = { .sin_family = AF_INET, .sin_port = htons((uint16_t) port) };
+    inet_pton(AF_INET, "127.0.0.1", &to.sin_addr);
+
+    // Wait for the controller to act on packets
+    int status = 0;
+    uint32_t sequence = 0;
+    bool ready = false;
+    uint64_t give_up = monotonicNanos() + BENCH_STARTUP_MS * 1000000ULL;
+    while (!ready && monotonicNanos() < give_up && waitpid(controller, NULL, WNOHANG) == 0) {
+        uint8_t buf[BENCH_MAX_PACKET_LEN];
+        size_t len = encode(PACKET_FORMAT_BINARY, ++sequence, BENCH_PROBE_US, buf, sizeof(buf));
+        sendto(sock, buf, len, 0, (const struct sockaddr *) &to, sizeof(to));
+        sleepUntil(monotonicNanos() + 100000000ULL);
+        ready = sawPulse(BENCH_PROBE_US);
+    }
+    if (!ready) {
+        fprintf(stderr, "ERROR: controller did not start\n");
+        status = 2;
+    } else {
+        printf("%-7s %8s %9s %10s %8s %9s %9s %9s %9s %9s\n", "format", "rate/s", "sent/s", "applied/s",
+                "dropped", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+        for (unsigned int f = 0; f < format_count; f++) {
+            for (unsigned int r = 0; r < rate_count; r++) {
+                struct run_result result;
+                if (!run(sock, &to, formats[f], rates[r], seconds, &sequence, &result)) {
+                    fprintf(stderr, "ERROR: out of memory\n");
+                    status = 2;
+                    break;
+                }
+                printf("%-7s %8u %9.0f %10.0f %7.1f%% %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+                        (formats[f] == PACKET_FORMAT_ASCII) ? "ascii" : "binary", rates[r],
+                        result.sent_rate, result.applied_rate, result.dropped_percent,
+                        result.p50_us, result.p90_us, result.p99_us, result.p999_us, result.max_us);
+                fflush(stdout);
+                if (max_p99_us > 0.0 && result.p99_us > max_p99_us && status == 0) status = 1;
+            }
+        }
+        if (status == 1) printf("FAIL: 99th percentile latency above %.1f us\n", max_p99_us);
+    }
+
+    kill(controller, SIGTERM);
+    waitpid(controller, NULL, 0);
+    pthread_join(reader, NULL);
+    close(pulse_fd);
+    close(sock);
+    unlink(config_path);
+    free(pulses);
+    return status;
+}
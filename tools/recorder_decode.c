@@ -0,0 +1,141 @@
+// Beaglebone Blue UDP Throttle/Heading Servo Control
+// Flight recorder decoder.
+//
+// Turns a recorder file into CSV on stdout, oldest record first, with one
+// line per record:
+//
+//   run, time, monotonic_ns, type, source, sequence, sender_time_us,
+//   latency_us, failsafe, power_cut, battery_low, channels,
+//   demand1..demand8 (percent), pulse1..pulse8 (us), format, heading
+//
+// run is the wall clock time that run of the controller started, and time
+// the wall clock time of the record, both in seconds since the epoch.
+// Pulses are only given for output records. format (ascii or binary) and
+// the target heading in degrees are only given for demand records, and only
+// from files that recorded them.
+//
+// Usage: recorder_decode [-r] file
+//   -r  only decode the most recent run
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "packet.h"
+#include "recorder.h"
+
+struct found_segment {
+    long offset;
+    struct recorder_segment header;
+};
+
+static int compareIndex(const void *a, const void *b) {
+    const struct found_segment *x = a, *y = b;
+    int32_t diff = (int32_t) (x->header.index - y->header.index);
+    return (diff > 0) - (diff < 0);
+}
+
+static void printRecord(const struct recorder_segment *s, const struct recorder_record *r) {
+    double run = (double) s->run_ns / 1e9;
+    double time = ((double) s->realtime_ns + ((double) r->time_ns - (double) s->monotonic_ns)) / 1e9;
+    printf("%.6f,%.6f,%llu,%s,%u,%u,%u,%u,%d,%d,%d,%u", run, time, (unsigned long long) r->time_ns,
+            (r->type == RECORDER_DEMAND) ? "demand" : (r->type == RECORDER_OUTPUT) ? "output" : "unknown",
+            r->source, r->sequence, r->sender_time_us, r->latency_us,
+            (r->state & PACKET_STATE_FAILSAFE) != 0, (r->state & PACKET_STATE_POWER_CUT) != 0,
+            (r->state & PACKET_STATE_BATTERY_LOW) != 0, r->channels);
+    for (int i = 0; i < DEMAND_CHANNELS; i++) {
+        if (i < r->channels) {
+            printf(",%.2f", r->demand[i] / (double) DEMAND_SCALE);
+        } else {
+            printf(",");
+        }
+    }
+    for (int i = 0; i < DEMAND_CHANNELS; i++) {
+        if (i < r->channels && r->type == RECORDER_OUTPUT) {
+            printf(",%u", r->pulse_us[i]);
+        } else {
+            printf(",");
+        }
+    }
+    if (r->type == RECORDER_DEMAND && s->version > 1) {
+        printf(",%s,", (r->flags & RECORDER_FLAG_BINARY) ? "binary" : "ascii");
+        if (r->flags & RECORDER_FLAG_HEADING) printf("%.2f", r->heading / (double) PACKET_HEADING_SCALE);
+    } else {
+        printf(",,");
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+    bool last_run_only = false;
+    int option;
+    while ((option = getopt(argc, argv, "r")) != -1) {
+        if (option == 'r') {
+            last_run_only = true;
+        } else {
+            fprintf(stderr, "Usage: %s [-r] file\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-r] file\n", argv[0]);
+        return 2;
+    }
+    FILE *f = fopen(argv[optind], "rb");
+    if (f == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    // Find every valid segment, then put them in the order written
+    struct found_segment *found = NULL;
+    size_t count = 0, capacity = 0;
+    for (long offset = 0;; offset += RECORDER_SEGMENT_BYTES) {
+        struct recorder_segment header;
+        if (fseek(f, offset, SEEK_SET) || fread(&header, sizeof(header), 1, f) != 1) break;
+        if (header.magic != RECORDER_MAGIC) continue;
+        if (header.version < RECORDER_VERSION_OLDEST || header.version > RECORDER_VERSION
+                || header.record_size != sizeof(struct recorder_record)) {
+            fprintf(stderr, "Skipping segment at %ld: unsupported version %u\n", offset, header.version);
+            continue;
+        }
+        if (header.count > RECORDER_SEGMENT_RECORDS) header.count = RECORDER_SEGMENT_RECORDS;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            found = realloc(found, capacity * sizeof(*found));
+            if (found == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                return 1;
+            }
+        }
+        found[count].offset = offset;
+        found[count].header = header;
+        count++;
+    }
+    qsort(found, count, sizeof(*found), compareIndex);
+    uint64_t last_run = (count > 0) ? found[count - 1].header.run_ns : 0;
+
+    printf("run,time,monotonic_ns,type,source,sequence,sender_time_us,latency_us,failsafe,power_cut,battery_low,channels");
+    for (int i = 1; i <= DEMAND_CHANNELS; i++) printf(",demand%d", i);
+    for (int i = 1; i <= DEMAND_CHANNELS; i++) printf(",pulse%d", i);
+    printf(",format,heading\n");
+
+    uint64_t dropped = 0;
+    static struct recorder_record records[RECORDER_SEGMENT_RECORDS];
+    for (size_t i = 0; i < count; i++) {
+        const struct recorder_segment *s = &found[i].header;
+        if (last_run_only && s->run_ns != last_run) continue;
+        fseek(f, found[i].offset + (long) sizeof(*s), SEEK_SET);
+        size_t n = fread(records, sizeof(records[0]), s->count, f);
+        for (size_t j = 0; j < n; j++) {
+            printRecord(s, &records[j]);
+        }
+        if (i + 1 == count || found[i + 1].header.run_ns != s->run_ns) dropped += s->dropped;
+    }
+    if (dropped > 0) fprintf(stderr, "%llu records were dropped while recording\n", (unsigned long long) dropped);
+    free(found);
+    fclose(f);
+    return 0;
+}
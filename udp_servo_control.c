@@ -9,213 +9,983 @@
 // Packets are expected to have ASCII contents of the form X,Y where X is
 // a number between 0 and 100 to set the throttle percentage, and Y is a
 // number between -100 and 100 to set the rudder percentage (negative to
-// port).
+// port). Further values drive further channels, as set up in the CHANNELS
+// table below. A compact binary format with sequence numbers and timestamps is
+// also accepted and detected automatically; see packet.h for its layout.
+// Either can add a target heading for the rudder to hold, in the ASCII
+// format as X,Y;H<degrees>; see heading.h.
 //
 // On startup and if no packets are received for a certain amount of time,
 // the controls will be zeroed.
 //
 // If using this for yourself, you may need to customise the #define values
-// near the top of the file to reflect the UDP port and servo control outputs
-// you want to use.
+// and CHANNELS table near the top of the file, or better, the config file
+// (udp_servo_control.conf, read from /etc or wherever -c says), to reflect
+// the UDP port and servo control outputs you want to use. Send SIGHUP to
+// reload the config file without stopping the servos.
 //
 // May need to be run as root for proper hardware control.
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
 #include <signal.h>
-#include <netinet/in.h>
-#include <sys/socket.h>
-#include <sys/time.h>
-#include <arpa/inet.h>
-#include <netdb.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
 #include <unistd.h>
-#include <rc/time.h>
-#include <rc/adc.h>
-#include <rc/servo.h>
 #include <pthread.h>
+#include <getopt.h>
+#include "auth.h"
+#include "demand.h"
+#include "packet.h"
+#include "channels.h"
+#include "hal.h"
+#include "health.h"
+#include "heading.h"
+#include "local.h"
+#include "metrics.h"
+#include "mixer.h"
+#include "interpolate.h"
+#include "realtime.h"
+#include "recorder.h"
+#include "replay.h"
+#include "stats.h"
+#include "log.h"
+#include "notify.h"
+#include "controller.h"
+#include "comms.h"
+#include "config.h"
+#include "battery.h"
+
+// These are the built-in defaults for the settings of the same names in the
+// config file.
 
 // Set the port on which to listen for UDP packets.
 #define UDP_PORT 2031
-// Set which servo outputs are used
-#define THROTTLE_SERVO 0
-#define RUDDER_SERVO 1
-// Set the microsecond pulse lengths corresponding to throttle and rudder
-// positions
-#define THROTTLE_MIN_PULSE_LENGTH_USEC 900
-#define THROTTLE_MAX_PULSE_LENGTH_USEC 2100
-#define RUDDER_MIN_PULSE_LENGTH_USEC 900
-#define RUDDER_MAX_PULSE_LENGTH_USEC 2100
-// Set the pulse rate
+// Set the pulse rate. This is the keep-alive refresh rate, driven from an
+// absolute-deadline timer so that it does not drift. Digital servos and ESCs
+// can take 200-400 Hz or more; channels with analogue servos can be kept
+// at a lower rate with their refresh divider.
 #define SERVO_PULSE_RATE_HZ 50
-// Set the timeout - zero the demands after this many seconds without receiving
-// a packet.
-#define COMMS_TIMEOUT_SEC 5
+// Set to 1 to send new demands as soon as they arrive, restarting the
+// refresh cycle from that pulse, or 0 to only ever send on the regular
+// refresh for ESCs that need perfectly even frames.
+#define SERVO_IMMEDIATE_UPDATES 1
+// Set how late a refresh can be handled before it is counted as late
+#define SERVO_LATE_THRESHOLD_USEC 1000
+// Set the minimum time between the starts of two consecutive pulses. A new
+// demand arriving sooner than this after the last pulse is held back until
+// the current frame has finished.
+#define SERVO_MIN_FRAME_USEC 2500
+// Set how long to hold every output at its safe pulse after the servo power
+// rail comes on, so that ESCs can arm, in milliseconds. Demands received
+// meanwhile are applied as soon as it is over.
+#define ARMING_HOLD_MS 2000
+// Set how long the servo loop can go without a pass, and the comms thread
+// without answering the health monitor, before either counts as stalled.
+// A stalled servo loop has its outputs forced safe by the monitor, and
+// either stops the watchdogs being fed. The servo limit is never less than
+// two servo periods plus the late threshold.
+#define WATCHDOG_SERVO_MS 100
+#define WATCHDOG_COMMS_MS 500
+// Set the hardware watchdog device to feed while the controller is healthy,
+// e.g. "/dev/watchdog" for the AM335x watchdog, or "" for none
+#define WATCHDOG_DEVICE ""
+// Set how much of each servo period the loop's work of working out and
+// sending pulses may take before the tick is counted as over budget. Not
+// in the config file.
+#define SERVO_BUDGET_PERCENT 50
+// Set the size of the socket receive buffer in bytes, or 0 to keep the
+// kernel default. A larger buffer rides out bursts of packets without loss;
+// only the newest demand in a burst is acted upon either way.
+#define UDP_RCVBUF_BYTES 0
+// Set the name of a POSIX shared memory object through which a controller
+// on the same board can write demands without going through the network,
+// e.g. "/udp_servo_control", or "" for none. See local.h.
+#define LOCAL_SHM_NAME ""
+// Set the flight recorder file, which keeps every demand received and
+// every pulse sent, or "" for none, and the most space it may take up in
+// megabytes. Decode it with tools/recorder_decode.
+#define RECORDER_FILE ""
+#define RECORDER_MAX_MB 64
+// Set the TCP port on which to serve Prometheus metrics at /metrics, or 0
+// for none, and the StatsD server to push them to every
+// METRICS_INTERVAL_MS, or "" for none
+#define METRICS_PORT 0
+#define METRICS_STATSD ""
+#define METRICS_STATSD_PORT 8125
+#define METRICS_INTERVAL_MS 10000
+// Set how far a binary packet's sequence number can step backwards before
+// it is treated as a restarted sender rather than a stale packet
+#define SEQUENCE_RESTART_GAP 1000
+// Set the final failsafe stage - cut the servo power rail after this many
+// milliseconds without a valid demand, or 0 never to cut it. Earlier stages
+// are set per channel below. Power comes back with the next valid demand.
+#define FAILSAFE_POWER_CUT_MS 5000
+// Set how long the active controller can go quiet before control fails over
+// to the next highest-priority sender, in milliseconds
+#define SOURCE_FAILOVER_MS 200
+// Set the priority of senders not listed in SOURCES below, or -1 to ignore
+// packets from them altogether
+#define SOURCE_DEFAULT_PRIORITY 0
+// Set the priority of demands written to the shared memory object, or -1
+// to ignore them
+#define SOURCE_LOCAL_PRIORITY 0
+// Set how many times a second to send a state report (pulses applied, last
+// sequence number, latency, battery and failsafe state) back to the active
+// controller, or 0 for none
+#define TELEMETRY_HZ 0
+// Set to 1 to acknowledge every valid demand back to its sender, so that
+// controllers can measure the round trip time
+#define TELEMETRY_ACKS 0
+// Set to 1 to reject every packet that is not in an authenticated envelope
+// (see auth.h). The keys are only ever set in the config file.
+#define AUTH_REQUIRED 0
+// Set how often to sample the battery and DC jack voltages, and the time
+// constant of the filter that smooths them
+#define BATTERY_SAMPLE_HZ 10
+#define BATTERY_FILTER_MS 1000
+// Set the battery voltage, in millivolts, below which channels with a low
+// battery limit are held to it, or 0 for no limits. The battery counts as
+// recovered once it is BATTERY_HYSTERESIS_MV above the low level.
+#define BATTERY_LOW_MV 0
+#define BATTERY_HYSTERESIS_MV 200
+// Set the battery voltage needed before the servos are started
+#define BATTERY_STARTUP_MV 6000
+// Set how often to check for the battery being connected at startup
+#define BATTERY_STARTUP_POLL_MS 50
+// Set the channel steered by heading hold, numbered from 1, or 0 for none.
+// While demands carry a target heading, a PID controller on the board
+// drives this channel to hold it, in place of the channel's value in the
+// packet. With a mixer, this is the packet value before mixing. See
+// heading.h.
+#define HEADING_CHANNEL 0
+// Set the heading hold gains, in percent of full demand per degree of
+// heading error, per degree-second of accumulated error, and per degree per
+// second of turn
+#define HEADING_KP 2.0
+#define HEADING_KI 0.1
+#define HEADING_KD 1.0
+// Set the offset added to the IMU's magnetic heading for the magnetic
+// declination and the way the board is mounted, in degrees
+#define HEADING_OFFSET_DEG 0.0
+// Set the IMU sample rate, which is also the heading hold loop rate. The
+// DMP runs at 200 Hz divided by a whole number.
+#define HEADING_IMU_HZ 100
+// Set to 1 to run the servo loop and comms thread with real-time
+// (SCHED_FIFO) scheduling and all memory locked, so that other processes on
+// the board cannot disturb the servo timing. Needs root. Set the CPU to pin
+// both threads to, or -1 to leave them free to move.
+#define REALTIME_MODE 0
+#define REALTIME_SERVO_PRIORITY 80
+#define REALTIME_COMMS_PRIORITY 70
+#define REALTIME_CPU -1
+// Set how much stack to pre-fault for each real-time thread. Not in the
+// config file.
+#define REALTIME_STACK_PREFAULT_BYTES (64 * 1024)
+// Set what the mixer does when a mix would drive a channel beyond full
+// demand: MIXER_SCALE to scale every mixed channel down together, keeping
+// the ratio between them, or MIXER_CLIP to clip each channel on its own
+#define MIXER_SATURATION MIXER_SCALE
+// Set the most verbose messages to log: LOG_LEVEL_ERROR, LOG_LEVEL_WARNING,
+// LOG_LEVEL_INFO, or LOG_LEVEL_DEBUG to also log every demand received
+#define LOG_LEVEL LOG_LEVEL_INFO
+
+// Set the addresses to listen for packets on. By default this is every IPv4
+// address on UDP_PORT. More entries can be added to listen on IPv6 too, or
+// on several links at once, e.g. a radio and a backup Wi-Fi interface.
+// The port can be left out to use UDP_PORT.
+static const struct listen_address LISTEN[] = {
+    { .address = "0.0.0.0" },
+    // { .address = "::" },
+    // { .address = "0.0.0.0", .port = 2032, .interface = "wlan0" },
+};
+#define LISTEN_COUNT (sizeof(LISTEN) / sizeof(LISTEN[0]))
+
+// Set the priorities of known controllers, by address. When more than one is
+// sending, only the highest-priority one that has been heard from within
+// SOURCE_FAILOVER_MS drives the servos. For example, a manual override
+// station can be given priority over the autopilot, so that it takes control
+// as soon as it starts sending and hands back when it stops.
+static const struct source_priority SOURCES[] = {
+    // { .address = "192.168.8.20", .priority = 20 }, // Manual override
+    // { .address = "192.168.8.10", .priority = 10 }, // Autopilot
+    { .address = "127.0.0.1", .priority = SOURCE_DEFAULT_PRIORITY },
+};
+#define SOURCE_COUNT (sizeof(SOURCES) / sizeof(SOURCES[0]))
 
+// Set up the servo channels. The values in each packet are applied to these
+// in order, so by default the first value is throttle and the second is
+// rudder. Servo outputs are numbered 1-8; 0 drives every output at once.
+// Bipolar channels take demands from -100 to 100 either side of the centre
+// pulse length, others take 0 to 100 from the minimum pulse length. The rate
+// limit is in microseconds of pulse length per second, 0 for no limit. Expo
+// and deadband are in hundredths of a percent, e.g. 3000 for 30% expo.
+// Interpolation smooths each channel between demands from slow controllers;
+// see interpolate.h for the choices. A refresh divider of N refreshes the
+// channel on every Nth tick only. A low battery limit, in hundredths of a
+// percent, caps the channel's demand while the battery is low.
+// If the link is lost, each channel holds its last demand for its failsafe
+// hold time, then ramps to zero over its ramp time. By default throttle
+// starts ramping down after half a second, and rudder centres after two.
+// A mix makes a channel take a weighted sum of the packet's values instead,
+// with weights in hundredths of a percent; for example twin motors each
+// taking throttle plus or minus half the yaw demand would have
+// .mix_count = 2 and .mix = { 10000, 5000 } and { 10000, -5000 }.
+static const struct channel_config CHANNELS[] = {
+    // Throttle
+    { .servo = 0, .min_us = 900, .max_us = 2100, .centre_us = 1500, .bipolar = false, .inverted = false, .rate_limit = 0, .expo = 0, .deadband = 0,
+      .failsafe_hold_ms = 500, .failsafe_ramp_ms = 1000, .interpolation = INTERPOLATE_NONE },
+    // Rudder
+    { .servo = 1, .min_us = 900, .max_us = 2100, .centre_us = 1500, .bipolar = true, .inverted = false, .rate_limit = 0, .expo = 0, .deadband = 0,
+      .failsafe_hold_ms = 2000, .failsafe_ramp_ms = 0, .interpolation = INTERPOLATE_NONE },
+};
+#define CHANNEL_COUNT (sizeof(CHANNELS) / sizeof(CHANNELS[0]))
 
-// Additional calculated defines
-#define THROTTLE_RANGE_USEC (THROTTLE_MAX_PULSE_LENGTH_USEC - THROTTLE_MIN_PULSE_LENGTH_USEC)
-#define RUDDER_RANGE_USEC (RUDDER_MAX_PULSE_LENGTH_USEC - RUDDER_MIN_PULSE_LENGTH_USEC)
-#define RUDDER_CENTRE_PULSE_LENGTH_USEC ((RUDDER_MAX_PULSE_LENGTH_USEC-RUDDER_MIN_PULSE_LENGTH_USEC) / 2.0 + RUDDER_MIN_PULSE_LENGTH_USEC)
+// Config file given on the command line, or NULL for the default
+static const char *config_path;
+// Built-in settings, which the config file overrides
+static struct config_snapshot built_in;
 
-// Globals and mutex for passing throttle and rudder info between threads
-double throttle, rudder = 0.0;
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+// Shared state, see controller.h
+atomic_bool running = true;
+atomic_bool stats_requested = false;
+atomic_bool reload_requested = false;
+struct demand_slot demand_slot;
+int demand_event = -1;
+struct output_slot output_slot;
 
-// interrupt handler to catch ctrl-c
-static int running = 0;
-static void __signal_handler(__attribute__ ((unused)) int dummy) {
-    running = 0;
-    return;
+// Latency histograms for each stage of the path from packet to pulse. The
+// first two are recorded by the comms thread, the rest by the servo loop.
+struct histogram hist_arrival_to_parse = HISTOGRAM_INIT("Packet arrival to parsed");
+struct histogram hist_parse_to_handoff = HISTOGRAM_INIT("Parsed to handed off");
+static struct histogram hist_handoff_to_pulse = HISTOGRAM_INIT("Handed off to pulse sent");
+static struct histogram hist_arrival_to_pulse = HISTOGRAM_INIT("Packet arrival to pulse sent");
+static struct histogram hist_tick_jitter = HISTOGRAM_INIT("Servo tick lateness");
+// Cost of the servo loop's work, to check it fits the servo period at high
+// refresh rates
+static struct histogram hist_pulse_send = HISTOGRAM_INIT("Servo pulse batch send");
+static struct histogram hist_tick_work = HISTOGRAM_INIT("Servo pass work");
+
+// Packet file being replayed instead of listening, if any
+static struct replay_config replay_config;
+
+// Print all timing statistics
+static void dumpStats(void) {
+    printf("Servo timing: %llu ticks, %llu missed, %llu late, worst %.3f ms late, %llu over budget, %llu pulses busy\n",
+            (unsigned long long) metricGet(METRIC_SERVO_TICKS), (unsigned long long) metricGet(METRIC_SERVO_TICKS_MISSED),
+            (unsigned long long) metricGet(METRIC_SERVO_TICKS_LATE), metricGet(METRIC_SERVO_WORST_LATE_NS) / 1e6,
+            (unsigned long long) metricGet(METRIC_SERVO_OVER_BUDGET), (unsigned long long) metricGet(METRIC_PULSES_BUSY));
+    printf("Battery %.2f V%s, DC jack %.2f V\n", batteryMillivolts() / 1000.0,
+            batteryLow() ? " (low)" : "", batteryJackMillivolts() / 1000.0);
+    histogramDump(&hist_arrival_to_parse, stdout);
+    histogramDump(&hist_parse_to_handoff, stdout);
+    histogramDump(&hist_handoff_to_pulse, stdout);
+    histogramDump(&hist_arrival_to_pulse, stdout);
+    histogramDump(&hist_tick_jitter, stdout);
+    histogramDump(&hist_pulse_send, stdout);
+    histogramDump(&hist_tick_work, stdout);
+    healthDumpStats(stdout);
+    if (replay_config.path != NULL) replayDumpStats(stdout);
+    fflush(stdout);
 }
 
-// Comms thread. Receiving UDP packets is handled here. This is forked off from
-// the main code, which continues running to handle the servos.
-void *commsThread() {
-    // Create UDP socket, exit on failure
-    int udpsocket;
-    if ((udpsocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
-        fprintf(stderr,"create socket failed\n");
-        return NULL;
-    }
-
-    // Configure socket
-    struct sockaddr_in listener;
-    bzero(&listener, sizeof(listener));
-    listener.sin_family      = AF_INET;
-    listener.sin_port        = htons(UDP_PORT);
-    listener.sin_addr.s_addr = htonl(INADDR_ANY);
-    int reuse = 1;
-    if (setsockopt(udpsocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
-        fprintf(stderr,"configure socket failed 1\n");
-        return NULL;
-    }
-    struct timeval timeout;
-    timeout.tv_sec = COMMS_TIMEOUT_SEC;
-    timeout.tv_usec = 0;
-    if (setsockopt(udpsocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
-        fprintf(stderr,"configure socket failed 2\n");
-        return NULL;
-    }
-
-    // Bind socket, exit on failure
-    if (bind(udpsocket, (struct sockaddr*) &listener, sizeof(listener)) < 0) {
-        fprintf(stderr,"bind socket failed\n");
-        return NULL;
-    }
-
-    // Listen indefinitely until the program is stopped
-    while (running) {
-        // Read UDP packet, timeout after 5 seconds
-        printf("Waiting for packet...\n");
-        char buffer[20] = {0};
-        struct sockaddr_in sender;
-        unsigned int senderlen = sizeof(sender);
-        bzero(&sender, sizeof(sender));
-        int nbytes = recvfrom(udpsocket, buffer, sizeof(buffer), 0, (struct sockaddr*) &sender, &senderlen);
-
-        double tmpThrottle = 0.0, tmpRudder = 0.0;
-        if (nbytes > 0) {
-            // Parse message
-            char *eptr;
-            buffer[nbytes] = '\0';
-            char delim[] = ",";
-            char *ptr = strtok(buffer, delim);
-            tmpThrottle = strtod(ptr, &eptr);
-            ptr = strtok(NULL, delim);
-            tmpRudder = strtod(ptr, &eptr);
-
-            printf("Received demand: Throttle %f Rudder %f\n", tmpThrottle, tmpRudder);
-        } else {
-            printf("No bytes received, zeroing outputs\n");
+// Fill in the built-in settings from the #defines and tables above
+static void builtInConfig(struct config_snapshot *c) {
+    memset(c, 0, sizeof(*c));
+    c->port = UDP_PORT;
+    memcpy(c->listen, LISTEN, sizeof(LISTEN));
+    c->listen_count = LISTEN_COUNT;
+    c->rcvbuf_bytes = UDP_RCVBUF_BYTES;
+    strcpy(c->local_shm, LOCAL_SHM_NAME);
+    strcpy(c->recorder_file, RECORDER_FILE);
+    c->recorder_max_mb = RECORDER_MAX_MB;
+    c->metrics_port = METRICS_PORT;
+    strcpy(c->metrics_statsd, METRICS_STATSD);
+    c->metrics_statsd_port = METRICS_STATSD_PORT;
+    c->metrics_interval_ms = METRICS_INTERVAL_MS;
+    c->realtime = REALTIME_MODE;
+    c->realtime_servo_priority = REALTIME_SERVO_PRIORITY;
+    c->realtime_comms_priority = REALTIME_COMMS_PRIORITY;
+    c->realtime_cpu = REALTIME_CPU;
+    c->servo_rate_hz = SERVO_PULSE_RATE_HZ;
+    c->immediate_updates = SERVO_IMMEDIATE_UPDATES;
+    c->min_frame_us = SERVO_MIN_FRAME_USEC;
+    c->late_threshold_us = SERVO_LATE_THRESHOLD_USEC;
+    c->failsafe_power_cut_ms = FAILSAFE_POWER_CUT_MS;
+    c->arming_hold_ms = ARMING_HOLD_MS;
+    strcpy(c->watchdog_device, WATCHDOG_DEVICE);
+    c->watchdog_servo_ms = WATCHDOG_SERVO_MS;
+    c->watchdog_comms_ms = WATCHDOG_COMMS_MS;
+    c->log_level = LOG_LEVEL;
+    c->battery_sample_hz = BATTERY_SAMPLE_HZ;
+    c->battery_filter_ms = BATTERY_FILTER_MS;
+    c->battery_low_mv = BATTERY_LOW_MV;
+    c->battery_hysteresis_mv = BATTERY_HYSTERESIS_MV;
+    c->battery_startup_mv = BATTERY_STARTUP_MV;
+    c->heading_channel = HEADING_CHANNEL;
+    c->heading_kp = HEADING_KP;
+    c->heading_ki = HEADING_KI;
+    c->heading_kd = HEADING_KD;
+    c->heading_offset = HEADING_OFFSET_DEG;
+    c->heading_imu_hz = HEADING_IMU_HZ;
+    memcpy(c->sources.priorities, SOURCES, sizeof(SOURCES));
+    c->sources.priority_count = SOURCE_COUNT;
+    c->sources.default_priority = SOURCE_DEFAULT_PRIORITY;
+    c->sources.local_priority = SOURCE_LOCAL_PRIORITY;
+    c->sources.failover_ms = SOURCE_FAILOVER_MS;
+    c->sources.sequence_restart_gap = SEQUENCE_RESTART_GAP;
+    c->telemetry_hz = TELEMETRY_HZ;
+    c->telemetry_acks = TELEMETRY_ACKS;
+    c->auth_required = AUTH_REQUIRED;
+    memcpy(c->channel, CHANNELS, sizeof(CHANNELS));
+    c->channel_count = CHANNEL_COUNT;
+    c->mixer_saturation = MIXER_SATURATION;
+}
+
+// Read the config file again and swap it in. If it is invalid, the running
+// config is kept.
+static void reloadConfig(void) {
+    struct config_snapshot *snapshot = configLoad(config_path, &built_in);
+    if (snapshot == NULL) {
+        logError("Config not reloaded, keeping the current settings");
+        return;
+    }
+    logSetLevel(snapshot->log_level);
+    configPublish(snapshot);
+    logInfo("Config reloaded");
+}
+
+// Called regularly from the log drain thread, which prints the statistics
+// and reloads the config when asked, so that the control path never waits
+// on stdout or the filesystem
+static void housekeeping(void) {
+    if (atomic_exchange(&stats_requested, false)) {
+        dumpStats();
+    }
+    if (atomic_exchange(&reload_requested, false)) {
+        reloadConfig();
+    }
+}
+
+static struct timespec nanosToTimespec(uint64_t ns) {
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000ULL;
+    ts.tv_nsec = ns % 1000000000ULL;
+    return ts;
+}
+
+// Arm the tick timer to expire at the absolute time deadline_ns, and every
+// period_ns after that
+static void armTickTimer(int timer, uint64_t deadline_ns, uint64_t period_ns) {
+    struct itimerspec spec;
+    spec.it_value = nanosToTimespec(deadline_ns);
+    spec.it_interval = nanosToTimespec(period_ns);
+    timerfd_settime(timer, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+// Reasons for the servo loop to wake up
+enum wake_reason {
+    WAKE_TICK,      // the keep-alive refresh is due
+    WAKE_DEMAND,    // a new demand has arrived
+    WAKE_OTHER      // interrupted
+};
+
+// Block until the tick timer expires or a new demand is signalled.
+// deadline_ns holds the next expected expiry of the timer, and is advanced
+// past however many expiries of period_ns have happened, updating the tick
+// metrics.
+static enum wake_reason waitForTickOrDemand(int timer, uint64_t *deadline_ns, uint64_t period_ns, uint64_t late_threshold_ns) {
+    static uint64_t worst_late_ns;
+    struct pollfd pfds[2] = {
+        { .fd = timer, .events = POLLIN, .revents = 0 },
+        { .fd = demand_event, .events = POLLIN, .revents = 0 }
+    };
+    if (poll(pfds, 2, -1) <= 0) return WAKE_OTHER;
+
+    enum wake_reason reason = WAKE_OTHER;
+    if (pfds[1].revents & POLLIN) {
+        eventfd_t count;
+        eventfd_read(demand_event, &count);
+        reason = WAKE_DEMAND;
+    }
+    if (pfds[0].revents & POLLIN) {
+        uint64_t expirations = 0;
+        if (read(timer, &expirations, sizeof(expirations)) == sizeof(expirations) && expirations > 0) {
+            uint64_t now = monotonicNanos();
+            uint64_t latest = *deadline_ns + (expirations - 1) * period_ns;
+            uint64_t late_ns = (now > latest) ? now - latest : 0;
+            metricAdd(METRICS_SERVO, METRIC_SERVO_TICKS, 1);
+            metricAdd(METRICS_SERVO, METRIC_SERVO_TICKS_MISSED, expirations - 1);
+            if (late_ns > late_threshold_ns) metricAdd(METRICS_SERVO, METRIC_SERVO_TICKS_LATE, 1);
+            if (late_ns > worst_late_ns) {
+                worst_late_ns = late_ns;
+                metricSet(METRICS_SERVO, METRIC_SERVO_WORST_LATE_NS, late_ns);
+            }
+            histogramRecord(&hist_tick_jitter, late_ns);
+            *deadline_ns = latest + period_ns;
+            reason = WAKE_TICK;
         }
+    }
+    return reason;
+}
 
-        // Write to global variables to pass the new demands to the other thread
-        pthread_mutex_lock(&mutex);
-        throttle = tmpThrottle;
-        rudder = tmpRudder;
-        pthread_mutex_unlock(&mutex);
+// Wait for up to timeout_ms while the controller is starting up. The comms
+// thread is already handling signals, and wakes the servo loop's event when
+// asked to shut down. Returns false if it has been.
+static bool startupWait(unsigned int timeout_ms) {
+    uint64_t deadline = monotonicNanos() + timeout_ms * 1000000ULL;
+    while (atomic_load(&running)) {
+        uint64_t now = monotonicNanos();
+        if (now >= deadline) break;
+        struct pollfd pfd = { .fd = demand_event, .events = POLLIN, .revents = 0 };
+        if (poll(&pfd, 1, (int) ((deadline - now + 999999) / 1000000)) > 0) {
+            eventfd_t count;
+            eventfd_read(demand_event, &count);
+        }
     }
+    return atomic_load(&running);
+}
 
-    // Close the socket
-    close(udpsocket);
+// Bring up the PRU in the background, leaving the result in *arg
+static void *servoInitThread(void *arg) {
+    *(int *) arg = halServoInit();
     return NULL;
 }
 
-int main()  {
-    // Set up interrupt handler
-    signal(SIGINT, __signal_handler);
-    running = 1;
+int main(int argc, char *argv[])  {
+    uint64_t start_ns = monotonicNanos();
+    static const struct option long_options[] = {
+        {"config", required_argument, NULL, 'c'},
+        {"replay", required_argument, NULL, 'r'},
+        {"speed", required_argument, NULL, 's'},
+        {"hardware", no_argument, NULL, 'H'},
+        {NULL, 0, NULL, 0}
+    };
+    int option;
+    bool replay_hardware = false;
+    replay_config.speed = 1.0;
+    while ((option = getopt_long(argc, argv, "c:r:s:H", long_options, NULL)) != -1) {
+        if (option == 'c') {
+            config_path = optarg;
+        } else if (option == 'r') {
+            replay_config.path = optarg;
+        } else if (option == 's') {
+            char *end;
+            replay_config.speed = (strcmp(optarg, "max") == 0) ? 0.0 : strtod(optarg, &end);
+            if (strcmp(optarg, "max") != 0 && (*end != '\0' || end == optarg || replay_config.speed < 0.0)) {
+                fprintf(stderr, "Invalid replay speed: %s\n", optarg);
+                return -1;
+            }
+        } else if (option == 'H') {
+            replay_hardware = true;
+        } else {
+            fprintf(stderr, "Usage: %s [-c config file] [-r replay file [-s speed|max] [-H]]\n", argv[0]);
+            return -1;
+        }
+    }
+    bool replaying = (replay_config.path != NULL);
+    // A replay drives whatever servos the backend has, so on the real
+    // hardware it has to be asked for
+    if (replaying && !halMock() && !replay_hardware) {
+        fprintf(stderr, "ERROR: replaying would drive the real servos; use the mock build, or -H to do it anyway\n");
+        return -1;
+    }
+
+    // Shutdown and statistics signals are handled by the comms reactor, so
+    // block them before any threads are started
+    if (commsBlockSignals()) {
+        fprintf(stderr, "ERROR: failed to block signals\n");
+        return -1;
+    }
 
-    // Read ADC to make sure battery is connected
-    if (rc_adc_init()) {
-        fprintf(stderr,"ERROR: failed to run rc_adc_init()\n");
+    // Start logging first, and make sure everything logged gets printed
+    // however the program exits
+    logSetLevel(LOG_LEVEL);
+    if (logStart(housekeeping)) {
+        fprintf(stderr, "ERROR: failed to start logging\n");
         return -1;
     }
-    while (rc_adc_batt()<6.0) {
-        printf("Battery disconnected or insufficiently charged to drive servos, waiting until connected...\n");
-        rc_usleep(5000000);
+    atexit(logStop);
+    if (notifyInit()) {
+        logWarning("Could not reach the service manager to report readiness");
     }
-    rc_adc_cleanup();
 
-    // initialize PRU
-    if(rc_servo_init()) return -1;
+    // Load the config, which also builds the channel table
+    builtInConfig(&built_in);
+    struct config_snapshot *initial = configLoad(config_path, &built_in);
+    if (initial == NULL) {
+        logError("ERROR: invalid configuration");
+        return -1;
+    }
+    logSetLevel(initial->log_level);
+    configPublish(initial);
+    // The startup-only settings are taken from the config as it is now
+    const struct config_snapshot *config = configAcquire(CONFIG_READER_SERVO);
+    static struct listen_address listen[COMMS_MAX_LISTEN];
+    static struct comms_config comms_config;
+    memcpy(listen, config->listen, sizeof(listen));
+    comms_config.listen = listen;
+    comms_config.listen_count = config->listen_count;
+    comms_config.rcvbuf_bytes = config->rcvbuf_bytes;
+    comms_config.realtime = config->realtime;
+    comms_config.realtime_priority = config->realtime_comms_priority;
+    comms_config.realtime_cpu = config->realtime_cpu;
+    comms_config.realtime_prefault_bytes = REALTIME_STACK_PREFAULT_BYTES;
+    // Keys are prepared once, here, so that checking a packet only hashes
+    // the packet itself
+    authInit(config->auth_keys, config->auth_key_count);
+    comms_config.auth_required = config->auth_required;
+    if (config->auth_key_count > 0) {
+        logInfo("Authentication %s, with %u keys", config->auth_required ? "required" : "optional",
+                config->auth_key_count);
+    }
+    // A replay takes the place of the network, but only takes packets from
+    // a capture that were sent to the ports that would have been listened on.
+    // Recorder files keep demands without their envelopes, so nothing needs
+    // to be authenticated, though envelopes in a capture are still checked.
+    if (replaying) {
+        comms_config.replay = true;
+        comms_config.auth_required = false;
+        comms_config.listen_count = 0;
+        for (unsigned int i = 0; i < config->listen_count; i++) {
+            replay_config.ports[replay_config.port_count++] = config->listen[i].port;
+        }
+    }
+    // Local demands carry no authentication tag, so they are turned off when
+    // every demand must be authenticated
+    char local_shm[LOCAL_NAME_LEN];
+    strcpy(local_shm, (replaying || config->auth_required) ? "" : config->local_shm);
+    if (config->auth_required && config->local_shm[0] != '\0') {
+        logWarning("Authentication required, so no local demands from shared memory %s", config->local_shm);
+    }
+    char watchdog_device[CONFIG_PATH_LEN];
+    strcpy(watchdog_device, config->watchdog_device);
+    static char metrics_statsd[COMMS_ADDRESS_LEN];
+    strcpy(metrics_statsd, config->metrics_statsd);
+    struct metrics_config metrics_config = {
+        .http_port = config->metrics_port,
+        .statsd_address = metrics_statsd,
+        .statsd_port = config->metrics_statsd_port,
+        .interval_ms = config->metrics_interval_ms
+    };
+    if (replaying && strcmp(config->recorder_file, replay_config.path) == 0) {
+        logWarning("Not recording over the file being replayed");
+    } else if (config->recorder_file[0] != '\0' && recorderStart(config->recorder_file, config->recorder_max_mb)) {
+        logWarning("Flight recorder could not be started, continuing without");
+    }
+    bool heading_hold = config->heading_channel != 0;
+    unsigned int heading_imu_hz = config->heading_imu_hz;
+    bool realtime = config->realtime;
+    int realtime_servo_priority = config->realtime_servo_priority;
+    int realtime_cpu = config->realtime_cpu;
+    configRelease(CONFIG_READER_SERVO);
 
-    // turn on power
-    printf("Turning On 6V Servo Power Rail\n");
-    rc_servo_power_rail_en(1);
+    // In real-time mode, lock memory before any threads are started so that
+    // their stacks are locked too
+    if (realtime) {
+        if (realtimeLockMemory() == 0) {
+            logInfo("Memory locked");
+        } else {
+            logWarning("Memory could not be locked, continuing without");
+        }
+    }
 
-    // Zero outputs at startup
-    printf("Zero output\n");
-    rc_servo_send_pulse_us(THROTTLE_SERVO, THROTTLE_MIN_PULSE_LENGTH_USEC);
-    rc_servo_send_pulse_us(RUDDER_SERVO, RUDDER_CENTRE_PULSE_LENGTH_USEC);
-    rc_usleep(2000000);
+    // Create the event used to wake the servo loop on new demands
+    demand_event = eventfd(0, EFD_NONBLOCK);
+    if (demand_event < 0) {
+        logError("ERROR: failed to create demand eventfd");
+        return -1;
+    }
 
-    // Spin off a new thread for the UDP socket listening
+    // Create the health monitor's ping and the shared memory block before
+    // the reactor, which waits on both
+    if (healthInit(watchdog_device)) {
+        logError("ERROR: failed to set up the health monitor");
+        return -1;
+    }
+    if (local_shm[0] != '\0' && localInit(local_shm)) {
+        logError("ERROR: failed to set up shared memory demands");
+        return -1;
+    }
+
+    // Open the sockets and start the comms thread straight away, so that
+    // the controller is listening while the hardware comes up. Demands that
+    // arrive meanwhile are arbitrated as usual, and the newest is applied as
+    // soon as the servos are armed.
+    if (commsInit(&comms_config)) {
+        logError("ERROR: failed to set up comms");
+        return -1;
+    }
     pthread_t udp_socket_thread;
-    pthread_create(&udp_socket_thread, NULL, commsThread, NULL);
-
-    // Control servos indefinitely until the program is stopped
-    while (running) {
-        // Get global variables
-        pthread_mutex_lock(&mutex);
-        double tmpThrottle = throttle;
-        double tmpRudder = rudder;
-        pthread_mutex_unlock(&mutex);
-
-        // Calculate outputs
-        double throttle_usec = THROTTLE_MIN_PULSE_LENGTH_USEC;
-        if (tmpThrottle >= 0 && tmpThrottle <= 100.0) {
-            throttle_usec = (tmpThrottle / 100.0 * THROTTLE_RANGE_USEC) + THROTTLE_MIN_PULSE_LENGTH_USEC;
+    if (replaying) {
+        if (replay_config.speed > 0.0) {
+            logInfo("Replaying %s at %g times recorded speed", replay_config.path, replay_config.speed);
         } else {
-            printf("Throttle demand out of range\n");
+            logInfo("Replaying %s as fast as possible", replay_config.path);
         }
-        double rudder_usec = RUDDER_CENTRE_PULSE_LENGTH_USEC;
-        if (tmpRudder >= -100.0 && tmpRudder <= 100.0) {
-            rudder_usec = (tmpRudder / 200.0 * RUDDER_RANGE_USEC) + RUDDER_CENTRE_PULSE_LENGTH_USEC;
+        pthread_create(&udp_socket_thread, NULL, replayThread, &replay_config);
+    } else {
+        pthread_create(&udp_socket_thread, NULL, commsThread, NULL);
+    }
+    if (localStart(realtime, comms_config.realtime_priority, realtime_cpu)) {
+        logWarning("Could not start waiting for shared memory demands");
+    }
+    int health_priority = (realtime_servo_priority < 99) ? realtime_servo_priority + 1 : 99;
+    if (healthStart(realtime, health_priority, realtime_cpu)) {
+        logError("ERROR: failed to start the health monitor");
+        return -1;
+    }
+
+    // Export the metrics, which are nice to have but never worth stopping
+    // for
+    metricsAddHistogram("arrival_to_parse_seconds", "Packet arrival to parsed", &hist_arrival_to_parse);
+    metricsAddHistogram("parse_to_handoff_seconds", "Parsed to handed off to the servo loop", &hist_parse_to_handoff);
+    metricsAddHistogram("handoff_to_pulse_seconds", "Handed off to pulse sent", &hist_handoff_to_pulse);
+    metricsAddHistogram("arrival_to_pulse_seconds", "Packet arrival to pulse sent", &hist_arrival_to_pulse);
+    metricsAddHistogram("servo_tick_lateness_seconds", "Servo tick lateness", &hist_tick_jitter);
+    metricsAddHistogram("servo_pass_work_seconds", "Servo pass work", &hist_tick_work);
+    if (metricsStart(&metrics_config)) {
+        logWarning("Metrics could not be exported, continuing without");
+    }
+
+    // The heading hold loop feeds the servo loop, so in real-time mode it
+    // runs just below it. Without an IMU, heading hold runs open loop.
+    int heading_priority = (realtime_servo_priority > 1) ? realtime_servo_priority - 1 : 1;
+    if (heading_hold && headingStart(heading_imu_hz, realtime, heading_priority)) {
+        logWarning("IMU could not be started, heading hold will steer open loop");
+    }
+    logInfo("Listening after %.0f ms", (monotonicNanos() - start_ns) / 1e6);
+
+    // Bring up the PRU while the battery is checked. The check is made
+    // often so that the servos start as soon as it is connected.
+    notifyStatus("Waiting for battery");
+    pthread_t servo_init_thread;
+    int servo_init_result = -1;
+    bool servo_init_threaded = (pthread_create(&servo_init_thread, NULL, servoInitThread, &servo_init_result) == 0);
+    if (!servo_init_threaded) servo_init_result = halServoInit();
+    if (batteryStart()) {
+        logError("ERROR: failed to start battery monitoring");
+        return -1;
+    }
+    config = configAcquire(CONFIG_READER_SERVO);
+    uint32_t startup_mv = config->battery_startup_mv;
+    unsigned int arming_hold_ms = config->arming_hold_ms;
+    configRelease(CONFIG_READER_SERVO);
+    bool warned = false;
+    while (batteryRawMillivolts() < startup_mv && startupWait(BATTERY_STARTUP_POLL_MS)) {
+        // Only once there is a reading, which is 0 for a disconnected pack
+        if (!warned && batterySamples() > 0) {
+            logWarning("Battery disconnected or insufficiently charged to drive servos, waiting until connected...");
+            notifyStatus("Battery disconnected or low, waiting");
+            warned = true;
+        }
+    }
+    if (servo_init_threaded) pthread_join(servo_init_thread, NULL);
+    if (servo_init_result) {
+        logError("ERROR: failed to initialise servos");
+        return -1;
+    }
+    bool started = atomic_load(&running);
+    if (started) {
+        logInfo("Battery at %.2f V", batteryRawMillivolts() / 1000.0);
+
+        // turn on power
+        logInfo("Turning On 6V Servo Power Rail");
+        halServoPowerRail(true);
+    }
+
+    // Zero outputs at startup. The servo loop keeps them there until the
+    // ESCs have had time to arm.
+    int applied_us[CHANNEL_MAX];
+    config = configAcquire(CONFIG_READER_SERVO);
+    struct hal_pulse pulses[CHANNEL_MAX];
+    for (int i = 0; i < config->channels.count; i++) {
+        applied_us[i] = channelSafePulse(&config->channels, i);
+        pulses[i] = (struct hal_pulse) { config->channels.servo[i], applied_us[i] };
+    }
+    if (started) halServoSendPulses(pulses, config->channels.count, NULL);
+    configRelease(CONFIG_READER_SERVO);
+    if (started) {
+        logInfo("Zero output, holding for %u ms to arm", arming_hold_ms);
+        notifyStatus("Arming");
+    }
+
+    // In real-time mode, the servo loop runs at the highest priority
+    if (realtime) {
+        realtimePrefaultStack(REALTIME_STACK_PREFAULT_BYTES);
+        if (realtimeSetCurrentThread("servo", realtime_servo_priority, realtime_cpu) == 0) {
+            logInfo("Servo loop running at SCHED_FIFO priority %d", realtime_servo_priority);
         } else {
-            printf("Rudder demand out of range\n");
+            logWarning("Servo loop could not be made real-time, continuing with normal scheduling");
+        }
+    }
+
+    // Control servos indefinitely until the program is stopped. Pulses are
+    // refreshed at the servo rate from an absolute-deadline timer to keep
+    // the servos and ESCs alive, and optionally also sent whenever a new
+    // demand arrives. The config snapshot is picked up afresh on every pass,
+    // so a reload takes effect on the next pulse, all channels at once.
+    int tick_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tick_timer < 0) {
+        logError("ERROR: failed to create servo timer");
+        atomic_store(&running, false);
+    }
+    config = configAcquire(CONFIG_READER_SERVO);
+    unsigned int generation = config->generation;
+    uint64_t period_ns = config->servo_period_ns;
+    int channel_count = config->channels.count;
+    logInfo("Servo refresh at %u Hz", config->servo_rate_hz);
+    configRelease(CONFIG_READER_SERVO);
+    uint64_t last_pulse_ns = monotonicNanos();
+    uint64_t last_sent_ns[CHANNEL_MAX];
+    for (int i = 0; i < CHANNEL_MAX; i++) {
+        last_sent_ns[i] = last_pulse_ns;
+    }
+    uint64_t deadline_ns = last_pulse_ns + period_ns;
+    armTickTimer(tick_timer, deadline_ns, period_ns);
+    enum wake_reason reason = WAKE_TICK;
+    bool send = true;
+    uint64_t last_handoff_ns = 0;
+    bool in_failsafe = false;
+    bool rail_cut = false;
+    uint32_t latency_us = 0;
+    uint64_t armed_ns = last_pulse_ns + arming_hold_ms * 1000000ULL;
+    bool armed = false;
+    bool heading_lost = false;
+    struct interpolator interpolator;
+    interpolatorInit(&interpolator);
+    while (atomic_load(&running)) {
+        healthServoBeat();
+        config = configAcquire(CONFIG_READER_SERVO);
+        const struct channel_table *channels = &config->channels;
+        if (config->generation != generation) {
+            // Channels added by a reload start from their safe pulse, and a
+            // new servo rate starts from the next tick
+            for (int i = channel_count; i < channels->count; i++) {
+                applied_us[i] = channelSafePulse(channels, i);
+            }
+            channel_count = channels->count;
+            if (config->servo_period_ns != period_ns) {
+                period_ns = config->servo_period_ns;
+                armTickTimer(tick_timer, deadline_ns, period_ns);
+                logInfo("Servo rate now %u Hz", config->servo_rate_hz);
+            }
+            generation = config->generation;
         }
 
-        // Set outputs
-        //printf("Sending servo pulse: Ch%d %f, Ch%d %f\n", THROTTLE_SERVO, throttle_usec, RUDDER_SERVO, rudder_usec);
-        rc_servo_send_pulse_us(THROTTLE_SERVO, throttle_usec);
-        rc_servo_send_pulse_us(RUDDER_SERVO, rudder_usec);
+        if (send) {
+            // Get the latest demand. Until one has been received, outputs
+            // stay zeroed.
+            struct demand d = { .sequence = 0, .timestamp_ns = 0, .arrival_ns = 0, .value = { 0 } };
+            demandRead(&demand_slot, &d);
+
+            // Smooth between demands at the servo refresh rate
+            uint64_t now = monotonicNanos();
+            if (d.timestamp_ns != last_handoff_ns) {
+                interpolatorSample(&interpolator, &d, now);
+            }
+            int32_t smoothed[CHANNEL_MAX];
+            interpolatorOutput(&interpolator, channels, config->mixer.enabled, now, smoothed);
+
+            // In heading hold, the heading controller replaces its packet
+            // value, before any mixing. Without a fresh output from it, the
+            // packet's own value is used instead.
+            int heading_channel = (int) config->heading_channel - 1;
+            if (heading_channel >= 0 && heading_channel < channels->count && d.has_heading) {
+                bool closed = headingOutput(now, &smoothed[heading_channel]);
+                if (closed == heading_lost) {
+                    if (closed) {
+                        logInfo("IMU heading back, heading hold closed loop");
+                    } else {
+                        logWarning("No IMU heading, heading hold steering open loop");
+                        metricAdd(METRICS_SERVO, METRIC_HEADING_OPEN_LOOP, 1);
+                    }
+                    heading_lost = !closed;
+                }
+            }
+
+            // Mix the packet values into channel demands
+            int32_t mixed[CHANNEL_MAX];
+            const int32_t *demands = smoothed;
+            if (config->mixer.enabled) {
+                mixerApply(&config->mixer, smoothed, mixed);
+                demands = mixed;
+            }
 
-        rc_usleep(1000000/SERVO_PULSE_RATE_HZ);
+            // Failsafe stages run from the arrival of the last valid
+            // demand. Until the first one, outputs are simply held safe.
+            uint64_t age_ns = (d.arrival_ns != 0 && now > d.arrival_ns) ? now - d.arrival_ns : 0;
+            uint32_t age_ms = (age_ns / 1000000 > UINT32_MAX) ? UINT32_MAX : (uint32_t) (age_ns / 1000000);
+            bool failsafe = false;
+            bool battery_low = batteryLow();
+
+            // Outputs stay safe until the ESCs are armed, and then the
+            // controller is ready
+            if (!armed && now >= armed_ns) {
+                armed = true;
+                logInfo("Ready after %.0f ms", (now - start_ns) / 1e6);
+                notifySend("READY=1\nSTATUS=Running");
+            }
+
+            // Calculate outputs for every channel due a pulse, limiting each
+            // channel's rate of change over the time since its last pulse,
+            // then start all of their pulses together. A channel with a
+            // refresh divider is only due once that many servo periods have
+            // passed since its own last pulse, whether this pass is a tick or
+            // an immediate update, so analogue servos are never refreshed
+            // faster than their divided rate. Half a period allows for a
+            // late tick.
+            int due = 0;
+            for (int i = 0; i < channels->count; i++) {
+                uint64_t elapsed_ns = now - last_sent_ns[i];
+                uint32_t divider = channels->refresh_divider[i];
+                if (divider > 1 && elapsed_ns + period_ns / 2 < divider * period_ns) continue;
+                uint32_t elapsed_us = (elapsed_ns >= 1000000000ULL) ? 1000000 : (uint32_t) (elapsed_ns / 1000);
+                last_sent_ns[i] = now;
+                bool out_of_range = false;
+                int32_t demand = channelFailsafe(channels, i, demands[i], age_ms, &failsafe);
+                if (battery_low) demand = channelLowBattery(channels, i, demand);
+                int target = armed ? channelPulse(channels, i, demand, &out_of_range) : channelSafePulse(channels, i);
+                if (out_of_range) {
+                    logWarning("Channel %d demand out of range", i);
+                }
+                applied_us[i] = channelSlew(channels, i, applied_us[i], target, elapsed_us);
+                pulses[due++] = (struct hal_pulse) { channels->servo[i], applied_us[i] };
+            }
+            if (due > 0) {
+                uint64_t call_ns = monotonicNanos();
+                int busy;
+                halServoSendPulses(pulses, due, &busy);
+                histogramRecord(&hist_pulse_send, monotonicNanos() - call_ns);
+                if (busy > 0) {
+                    metricAdd(METRICS_SERVO, METRIC_PULSES_BUSY, (uint64_t) busy);
+                    logWarning("%d channels still busy with their last pulse, pulses skipped", busy);
+                }
+            }
+            last_pulse_ns = now;
+
+            if (failsafe != in_failsafe) {
+                if (failsafe) {
+                    logWarning("No valid demand for %u ms, failsafe engaged", age_ms);
+                } else {
+                    logInfo("Valid demands resumed, failsafe cleared");
+                }
+                in_failsafe = failsafe;
+                if (failsafe) metricAdd(METRICS_SERVO, METRIC_FAILSAFE_EVENTS, 1);
+                metricSet(METRICS_SERVO, METRIC_FAILSAFE, failsafe);
+            }
+            bool cut = config->failsafe_power_cut_ms > 0 && age_ms >= config->failsafe_power_cut_ms;
+            if (cut != rail_cut) {
+                if (cut) {
+                    logWarning("No valid demand for %u ms, cutting servo power", age_ms);
+                } else {
+                    logInfo("Restoring servo power");
+                }
+                halServoPowerRail(!cut);
+                rail_cut = cut;
+                if (cut) metricAdd(METRICS_SERVO, METRIC_POWER_CUT_EVENTS, 1);
+                metricSet(METRICS_SERVO, METRIC_POWER_CUT, cut);
+            }
+
+            // The first pulse for each new demand completes its journey
+            if (d.timestamp_ns != last_handoff_ns) {
+                uint64_t sent_ns = monotonicNanos();
+                histogramRecord(&hist_handoff_to_pulse, sent_ns - d.timestamp_ns);
+                histogramRecord(&hist_arrival_to_pulse, sent_ns - d.arrival_ns);
+                latency_us = (uint32_t) ((sent_ns - d.arrival_ns) / 1000);
+                metricSet(METRICS_SERVO, METRIC_LATENCY_US, latency_us);
+                last_handoff_ns = d.timestamp_ns;
+            }
+
+            // Hand what was applied back to the comms thread for telemetry
+            struct output_state o = {
+                .sequence = d.sequence,
+                .sender_time_us = d.sender_time_us,
+                .source = d.source,
+                .latency_us = latency_us,
+                .channels = (uint8_t) channels->count,
+                .failsafe = in_failsafe,
+                .power_cut = rail_cut
+            };
+            for (int i = 0; i < channels->count; i++) {
+                o.pulse_us[i] = (uint16_t) applied_us[i];
+            }
+            outputPublish(&output_slot, &o);
+
+            // And to the flight recorder, with the demand as it arrived
+            struct recorder_record r = {
+                .time_ns = now,
+                .type = RECORDER_OUTPUT,
+                .source = d.source,
+                .channels = o.channels,
+                .state = (uint8_t) ((in_failsafe ? PACKET_STATE_FAILSAFE : 0) | (rail_cut ? PACKET_STATE_POWER_CUT : 0)
+                        | (battery_low ? PACKET_STATE_BATTERY_LOW : 0)),
+                .sequence = d.sequence,
+                .sender_time_us = d.sender_time_us,
+                .latency_us = latency_us
+            };
+            for (int i = 0; i < channels->count; i++) {
+                r.demand[i] = (int16_t) d.value[i];
+                r.pulse_us[i] = o.pulse_us[i];
+            }
+            recorderWrite(&r);
+
+            uint64_t work_ns = monotonicNanos() - now;
+            histogramRecord(&hist_tick_work, work_ns);
+            if (work_ns * 100 > period_ns * SERVO_BUDGET_PERCENT) metricAdd(METRICS_SERVO, METRIC_SERVO_OVER_BUDGET, 1);
+        }
+        bool immediate = config->immediate_updates;
+        uint64_t min_frame_ns = config->min_frame_us * 1000ULL;
+        uint64_t late_threshold_ns = config->late_threshold_us * 1000ULL;
+        configRelease(CONFIG_READER_SERVO);
+
+        // Sleep until the next refresh is due, or until a new demand comes
+        // in. An immediate update restarts the refresh cycle from its own
+        // pulse, and if it arrives part way through the current frame it is
+        // held back until the frame is complete.
+        reason = waitForTickOrDemand(tick_timer, &deadline_ns, period_ns, late_threshold_ns);
+        send = (reason == WAKE_TICK) || (reason == WAKE_DEMAND && immediate);
+        if (reason == WAKE_DEMAND && immediate) {
+            struct timespec frame_end = nanosToTimespec(last_pulse_ns + min_frame_ns);
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &frame_end, NULL) == EINTR);
+            deadline_ns = monotonicNanos() + period_ns;
+            armTickTimer(tick_timer, deadline_ns, period_ns);
+        }
     }
+    close(tick_timer);
+    notifySend("STOPPING=1");
+    healthStop();
+    headingStop();
+    metricsStop();
+    dumpStats();
 
     // Wait for comms thread to finish
     pthread_join(udp_socket_thread, NULL);
+    localStop();
+    commsCleanup();
+    localCleanup();
+    recorderStop();
+    close(demand_event);
+    batteryStop();
 
     // Zero outputs
-    rc_servo_send_pulse_us(THROTTLE_SERVO, THROTTLE_MIN_PULSE_LENGTH_USEC);
-    rc_servo_send_pulse_us(RUDDER_SERVO, RUDDER_CENTRE_PULSE_LENGTH_USEC);
+    config = configAcquire(CONFIG_READER_SERVO);
+    for (int i = 0; i < config->channels.count; i++) {
+        pulses[i] = (struct hal_pulse) { config->channels.servo[i], channelSafePulse(&config->channels, i) };
+    }
+    halServoSendPulses(pulses, config->channels.count, NULL);
+    configRelease(CONFIG_READER_SERVO);
 
     // Turn off power rail & clean up
-    rc_usleep(50000);
-    rc_servo_power_rail_en(0);
-    rc_servo_cleanup();
+    halSleep(50000);
+    halServoPowerRail(false);
+    halServoCleanup();
+    notifyCleanup();
     return 0;
 }